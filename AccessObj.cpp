@@ -5,6 +5,7 @@
 #include <cassert>
 #include <list>
 #include <vector>
+#include <algorithm>
 
 #define _CRT_SECURE_CPP_OVERLOAD_STANDARD_NAMES 1
 
@@ -18,10 +19,21 @@ using namespace std;
 #define SAFE_DELETE_ARRAY(p) if(p) { delete[] (p); (p)=0; }
 #endif
 
+// levels of detail, see BuildLods()
+#define LOD_RATIO 4
+#define LOD_MIN_TRIANGLES 1024
+// largest error of a level, of the size of the model
+#define LOD_MAX_ERROR 0.02f
+// how much worse the vertex cache may get for less overdraw, see
+// CMeshOptimizer::optimizeOverdraw()
+#define OVERDRAW_THRESHOLD 1.05f
+
 
 //////////////////////////////////////////////////////////////////////
 
 #include "AccessObj.h"
+#include "Simplifier.h"
+#include "MeshOptimizer.h"
 
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
@@ -497,6 +509,8 @@ void CAccessObj::Scale(float scale)
 	
 	for (i = 1; i <= m_pModel->nVertices; i++)
 		m_pModel->vpVertices[i] = m_pModel->vpVertices[i] * scale;
+	m_Bvh.clear();
+	m_Lods.clear();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -638,6 +652,8 @@ void CAccessObj::VertexNormals(float angle)
 	nNormals = 1;
 	for (i = 1; i <= m_pModel->nVertices; i++)
 	{
+		unsigned int t_first = nNormals;	/* first normal of this vertex */
+
 		if (members[i].empty())
 		{
 			continue;
@@ -674,12 +690,26 @@ void CAccessObj::VertexNormals(float angle)
 			/* normalize the averaged normal */
 			t_vAverage.unify();
 
+			/* share the normal with the other corners of this vertex that
+			averaged the same facets, so that they can be cached together */
+			unsigned int t_idx = t_first;
+			for (; t_idx<nNormals; ++t_idx)
+			{
+				const CPoint3D &t_n = m_pModel->vpNormals[t_idx];
+				if (t_n.x == t_vAverage.x && t_n.y == t_vAverage.y && t_n.z == t_vAverage.z)
+					break;
+			}
+
 			/* add the normal to the vertex normals list */
-			m_pModel->vpNormals[nNormals] = t_vAverage;
-			Tri(node->triIdx).nindices[node->index] = nNormals;
-			++nNormals;
+			if (t_idx == nNormals)
+			{
+				m_pModel->vpNormals[nNormals] = t_vAverage;
+				++nNormals;
+			}
+			Tri(node->triIdx).nindices[node->index] = t_idx;
 		}
 	}
+	m_pModel->nNormals = nNormals - 1;
 		
 	/* free the member information */
 	ListArrItor ita = members.begin();
@@ -705,6 +735,8 @@ void CAccessObj::Destory()
 {
 	delete m_pModel;
 	m_pModel = NULL;
+	m_Bvh.clear();
+	m_Lods.clear();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -752,6 +784,8 @@ bool CAccessObj::LoadOBJ(const char* filename)
 	if (FirstPass(file))
 	{	
 		SAFE_DELETE(pOldModel);
+		m_Bvh.clear();
+		m_Lods.clear();
 
 		/* allocate memory */
 		m_pModel->vpVertices = new CPoint3D [m_pModel->nVertices + 1];
@@ -817,6 +851,58 @@ void CAccessObj::CalcBoundingBox()
 
 	m_vMax = m_vMax - vCent;
 	m_vMin = m_vMin -vCent;
+
+	CalcGroupBounds();
+}
+
+//////////////////////////////////////////////////////////////////////
+// CalcGroupBounds: the bounding box and sphere of the triangles of
+// each group, so that the groups out of sight can be skipped
+//////////////////////////////////////////////////////////////////////
+void CAccessObj::CalcGroupBounds()
+{
+	COBJgroup *group;
+	unsigned int i, j;
+
+	for (group = m_pModel->pGroups; group; group = group->next)
+	{
+		if (group->nTriangles == 0)
+		{
+			group->m_vMin = group->m_vMax = group->m_vCenter = CPoint3D(0, 0, 0);
+			group->m_fRadius = 0;
+			continue;
+		}
+
+		group->m_vMin = group->m_vMax = 
+			m_pModel->vpVertices[Tri(group->pTriangles[0]).vindices[0]];
+		for (i = 0; i < group->nTriangles; i++)
+		{
+			for (j = 0; j < 3; j++)
+			{
+				CPoint3D &v = m_pModel->vpVertices[Tri(group->pTriangles[i]).vindices[j]];
+				group->m_vMin.x = objMin(group->m_vMin.x, v.x);
+				group->m_vMin.y = objMin(group->m_vMin.y, v.y);
+				group->m_vMin.z = objMin(group->m_vMin.z, v.z);
+				group->m_vMax.x = objMax(group->m_vMax.x, v.x);
+				group->m_vMax.y = objMax(group->m_vMax.y, v.y);
+				group->m_vMax.z = objMax(group->m_vMax.z, v.z);
+			}
+		}
+
+		// around the center of the box, tighter than its half diagonal
+		group->m_vCenter = (group->m_vMax + group->m_vMin)*0.5f;
+		float r2 = 0;
+		for (i = 0; i < group->nTriangles; i++)
+		{
+			for (j = 0; j < 3; j++)
+			{
+				CPoint3D d = m_pModel->vpVertices[Tri(group->pTriangles[i]).vindices[j]] - 
+					group->m_vCenter;
+				r2 = objMax(r2, d & d);
+			}
+		}
+		group->m_fRadius = sqrt(r2);
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -835,4 +921,184 @@ void CAccessObj::UnifiedModel()
 		FacetNormals();
 		VertexNormals(90.f);
 	}
+	OptimizeVertexCache();
+	OptimizeOverdraw();
+	BuildBvh();
+	BuildLods();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Renumber: moves the points of a 1-based array into the order in which
+// the triangles first use them, the unused ones at the end
+//
+// normals - the points are normals, else vertices
+//////////////////////////////////////////////////////////////////////
+static void Renumber(CPoint3D* points, unsigned int nPoints, 
+					 COBJtriangle* triangles, unsigned int nTriangles, bool normals)
+{
+	vector<unsigned int> newIndex(nPoints + 1, 0);
+	unsigned int n = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < nTriangles; i++)
+	{
+		unsigned int *indices = normals ? triangles[i].nindices : triangles[i].vindices;
+		for (j = 0; j < 3; j++)
+		{
+			if (indices[j] == 0)
+				continue;
+			if (newIndex[indices[j]] == 0)
+				newIndex[indices[j]] = ++n;
+			indices[j] = newIndex[indices[j]];
+		}
+	}
+	for (i = 1; i <= nPoints; i++)
+	{
+		if (newIndex[i] == 0)
+			newIndex[i] = ++n;
+	}
+
+	vector<CPoint3D> old(points, points + nPoints + 1);
+	for (i = 1; i <= nPoints; i++)
+		points[newIndex[i]] = old[i];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// OptimizeVertexCache: the triangles of each group in the order of
+// CMeshOptimizer, each group a range of them, then the vertices and
+// normals in the order they are used, so that both the transformed and
+// the fetched vertices are reused while they are at hand
+//////////////////////////////////////////////////////////////////////////
+void CAccessObj::OptimizeVertexCache()
+{
+	if (m_pModel==NULL || m_pModel->nTriangles==0) return;
+
+	COBJmodel *pModel = m_pModel;
+	float fBefore = CMeshOptimizer::acmr(pModel->pTriangles, pModel->nTriangles, 
+		pModel->nVertices);
+
+	COBJtriangle *pTriangles = new COBJtriangle [pModel->nTriangles];
+	CMeshOptimizer optimizer;
+	unsigned int nTriangles = 0;
+	for (COBJgroup *group = pModel->pGroups; group; group = group->next)
+	{
+		for (unsigned int i=0; i<group->nTriangles; ++i)
+		{
+			pTriangles[nTriangles + i] = Tri(group->pTriangles[i]);
+			group->pTriangles[i] = nTriangles + i;
+		}
+		optimizer.optimizeVertexCache(pTriangles + nTriangles, group->nTriangles, 
+			pModel->nVertices);
+		nTriangles += group->nTriangles;
+	}
+	delete [] pModel->pTriangles;
+	pModel->pTriangles = pTriangles;
+
+	Renumber(pModel->vpVertices, pModel->nVertices, pTriangles, nTriangles, false);
+	if (pModel->nNormals)
+		Renumber(pModel->vpNormals, pModel->nNormals, pTriangles, nTriangles, true);
+	m_Bvh.clear();
+	m_Lods.clear();
+
+	printf("OptimizeVertexCache(): ACMR %.3f -> %.3f\n", fBefore, 
+		CMeshOptimizer::acmr(pTriangles, nTriangles, pModel->nVertices));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// OptimizeOverdraw: the triangles in clusters of the order of
+// OptimizeVertexCache(), those likely to hide the others from most
+// views first, see CMeshOptimizer. The groups keep their triangles, and
+// the vertices and normals are numbered in the new order again.
+//////////////////////////////////////////////////////////////////////////
+void CAccessObj::OptimizeOverdraw()
+{
+	if (m_pModel==NULL || m_pModel->nTriangles==0) return;
+
+	COBJmodel *pModel = m_pModel;
+	CMeshOptimizer optimizer;
+	vector<unsigned int> order;
+	unsigned int nClusters = optimizer.optimizeOverdraw(pModel->pTriangles, 
+		pModel->nTriangles, pModel->vpVertices, pModel->nVertices, OVERDRAW_THRESHOLD, &order);
+
+	vector<unsigned int> newIndex(pModel->nTriangles);
+	for (unsigned int i=0; i<pModel->nTriangles; ++i)
+		newIndex[order[i]] = i;
+	for (COBJgroup *group = pModel->pGroups; group; group = group->next)
+	{
+		for (unsigned int i=0; i<group->nTriangles; ++i)
+			group->pTriangles[i] = newIndex[group->pTriangles[i]];
+		sort(group->pTriangles, group->pTriangles + group->nTriangles);
+	}
+
+	Renumber(pModel->vpVertices, pModel->nVertices, pModel->pTriangles, pModel->nTriangles, false);
+	if (pModel->nNormals)
+		Renumber(pModel->vpNormals, pModel->nNormals, pModel->pTriangles, pModel->nTriangles, true);
+	m_Bvh.clear();
+	m_Lods.clear();
+
+	printf("OptimizeOverdraw(): %u clusters, ACMR %.3f\n", nClusters, 
+		CMeshOptimizer::acmr(pModel->pTriangles, pModel->nTriangles, pModel->nVertices));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// BuildBvh: the hierarchy of the triangles for culling, see CBvh. It is
+// cleared when the vertices move.
+//////////////////////////////////////////////////////////////////////////
+void CAccessObj::BuildBvh()
+{
+	if (m_pModel==NULL) return;
+
+	m_Bvh.build(m_pModel);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// BuildLods: levels of detail of the model, each with a quarter of the
+// triangles of the one before, down to LOD_MIN_TRIANGLES or LOD_MAX_ERROR.
+// See CSimplifier.
+//////////////////////////////////////////////////////////////////////////
+void CAccessObj::BuildLods()
+{
+	m_Lods.clear();
+	if (m_pModel==NULL) return;
+
+	// the triangles and the group of each
+	vector<COBJtriangle> triangles;
+	vector<unsigned int> groups;
+	triangles.reserve(m_pModel->nTriangles);
+	groups.reserve(m_pModel->nTriangles);
+	unsigned int id = 0;
+	for (COBJgroup *group = m_pModel->pGroups; group; group = group->next, ++id)
+	{
+		for (unsigned int i=0; i<group->nTriangles; ++i)
+		{
+			triangles.push_back(Tri(group->pTriangles[i]));
+			groups.push_back(id);
+		}
+	}
+
+	CPoint3D vMax, vMin;
+	Boundingbox(vMax, vMin);
+	float fMaxError = LOD_MAX_ERROR * (vMax - vMin).length();
+
+	CSimplifier simplifier;
+	CMeshOptimizer optimizer;
+	float fError = 0;
+	while (triangles.size() / LOD_RATIO >= LOD_MIN_TRIANGLES)
+	{
+		size_t nBefore = triangles.size();
+		fError += simplifier.simplify(m_pModel, triangles, groups, 
+			(unsigned int)(nBefore / LOD_RATIO), fMaxError - fError);
+		// stuck at the vertices which may not move, or at the error
+		if (triangles.size() * 4 > nBefore * 3)
+			break;
+
+		m_Lods.push_back(COBJlod());
+		m_Lods.back().m_Triangles = triangles;
+		m_Lods.back().m_fError = fError;
+		optimizer.optimizeVertexCache(&m_Lods.back().m_Triangles[0], 
+			(unsigned int)triangles.size(), m_pModel->nVertices);
+		optimizer.optimizeOverdraw(&m_Lods.back().m_Triangles[0], 
+			(unsigned int)triangles.size(), m_pModel->vpVertices, m_pModel->nVertices, 
+			OVERDRAW_THRESHOLD);
+	}
 }
\ No newline at end of file
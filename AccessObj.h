@@ -9,8 +9,10 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cassert>
+#include <vector>
 
 #include "Point3D.h"
+#include "Bvh.h"
 
 #define objMax(a,b)	(((a)>(b))?(a):(b))
 #define objMin(a,b)	(((a)<(b))?(a):(b))
@@ -51,12 +53,16 @@ public:
 	float m_fRotate_X;
 	float m_fRotate_Y;
 	float m_fRotate_Z;
+	CPoint3D m_vMin, m_vMax;	// bounding box of its triangles 
+	CPoint3D m_vCenter;			// bounding sphere of its triangles 
+	float m_fRadius;
 	class COBJgroup* next;		// pointer to next group in model 
 
 	COBJgroup()
 	{
 		nTriangles = 0;
 		pTriangles = NULL;
+		m_fRadius = 0;
 		next = NULL;
 	}
 
@@ -69,6 +75,19 @@ public:
 	}
 };// ------------------------------------------------------------------
 
+// --------------------------------------------------------------------
+// COBJlod: a coarser level of detail of a model, see CAccessObj::BuildLods().
+class COBJlod
+{
+public:
+	std::vector<COBJtriangle> m_Triangles;	// on the vertices and normals of the model 
+	float m_fError;		// at most how far its surface is off the model's 
+	COBJlod()
+	{
+		m_fError = 0;
+	}
+};// ------------------------------------------------------------------
+
 // --------------------------------------------------------------------
 // COBJmodel: defines a model.
 class COBJmodel
@@ -168,8 +187,11 @@ public:
 
 protected:
 	CPoint3D m_vMax, m_vMin;
+	CBvh m_Bvh;
+	std::vector<COBJlod> m_Lods;	// coarser and coarser
 
 	void CalcBoundingBox();
+	void CalcGroupBounds();
 	bool Equal(CPoint3D * u, CPoint3D * v, float epsilon);
 
 	COBJgroup* FindGroup(char* name);
@@ -189,6 +211,12 @@ public:
 	void Boundingbox(CPoint3D &vMax, CPoint3D &vMin);
 	bool LoadOBJ(const char* filename);
 	void UnifiedModel();
+	void OptimizeVertexCache();
+	void OptimizeOverdraw();
+	void BuildBvh();
+	const CBvh& Bvh() const { return m_Bvh; }
+	void BuildLods();
+	const std::vector<COBJlod>& Lods() const { return m_Lods; }
 };
 
 #endif
\ No newline at end of file
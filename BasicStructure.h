@@ -19,6 +19,10 @@ SL_QUADS, SL_QUAD_STRIP, SL_POLYGON
 enum LightType { SL_LIGHT_NONE = 0,
 SL_LIGHT_POINT, SL_LIGHT_SPOT, SL_LIGHT_DIRECTIONAL };
 
+// Depth Buffer Format
+enum DepthFormat { SL_DEPTH_FLOAT64 = 0,
+SL_DEPTH_FLOAT32, SL_DEPTH_UNORM24, SL_DEPTH_UNORM16 };
+
 
 //////////////////////////////////////////////////////////////////////////
 // Useful Macro
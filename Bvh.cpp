@@ -0,0 +1,481 @@
+#include "Bvh.h"
+#include "AccessObj.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cfloat>
+
+using std::min;
+using std::max;
+
+// nodes with more triangles are split with all threads, the ones below
+// are built as subtrees, one per thread
+#define BVH_PARALLEL_SIZE (1<<16)
+// triangles binned by one thread at once
+#define BVH_CHUNK_SIZE (1<<14)
+
+static inline void bvh_reset(CBvh::Box& _box)
+{
+	for (int i=0; i<3; ++i)
+	{
+		_box.min[i] = FLT_MAX;
+		_box.max[i] = -FLT_MAX;
+	}
+}
+
+static inline void bvh_grow(CBvh::Box& _box, const CBvh::Box& _other)
+{
+	for (int i=0; i<3; ++i)
+	{
+		_box.min[i] = min(_box.min[i], _other.min[i]);
+		_box.max[i] = max(_box.max[i], _other.max[i]);
+	}
+}
+
+// twice the centroid, it is only compared
+static inline void bvh_growCentroid(CBvh::Box& _box, const CBvh::Box& _tri)
+{
+	for (int i=0; i<3; ++i)
+	{
+		float c = _tri.min[i] + _tri.max[i];
+		_box.min[i] = min(_box.min[i], c);
+		_box.max[i] = max(_box.max[i], c);
+	}
+}
+
+// half the surface, 0 for an empty box
+static inline double bvh_area(const CBvh::Box& _box)
+{
+	if (_box.min[0] > _box.max[0])
+		return 0;
+	double dx = _box.max[0] - _box.min[0];
+	double dy = _box.max[1] - _box.min[1];
+	double dz = _box.max[2] - _box.min[2];
+	return dx*dy + dy*dz + dz*dx;
+}
+
+static inline int bvh_binOf(const CBvh::Box& _tri, int _axis, float _min, float _scale)
+{
+	int k = int((_tri.min[_axis] + _tri.max[_axis] - _min) * _scale);
+	return max(0, min(k, int(CBvh::BINS) - 1));
+}
+
+//////////////////////////////////////////////////////////////////////////
+CBvh::CBvh()
+: mPool(0)
+{
+}
+
+void CBvh::clear()
+{
+	std::vector<Node>().swap(mNodes);
+	std::vector<unsigned int>().swap(mTriangles);
+	std::vector<unsigned int>().swap(mLeafFirsts);
+}
+
+void CBvh::build(const COBJmodel* _model, int _threads)
+{
+	clear();
+	unsigned int t_num = _model->nTriangles;
+	if (t_num == 0)
+		return;
+
+	CThreadPool t_pool;
+	t_pool.setThreadCount(_threads);
+	mPool = &t_pool;
+
+	// the boxes of the triangles
+	mRefs.resize(t_num);
+	int t_chunks = int((t_num + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE);
+	mPool->parallelFor(t_chunks, [&](int _c) {
+		unsigned int t_end = min(t_num, (unsigned int)(_c + 1) * BVH_CHUNK_SIZE);
+		for (unsigned int i = _c * BVH_CHUNK_SIZE; i < t_end; ++i)
+		{
+			Box &t_box = mRefs[i].box;
+			bvh_reset(t_box);
+			for (int j=0; j<3; ++j)
+			{
+				const CPoint3D &v = _model->vpVertices[_model->pTriangles[i].vindices[j]];
+				float p[3] = { v.x, v.y, v.z };
+				for (int k=0; k<3; ++k)
+				{
+					t_box.min[k] = min(t_box.min[k], p[k]);
+					t_box.max[k] = max(t_box.max[k], p[k]);
+				}
+			}
+			mRefs[i].triangle = i;
+		}
+	});
+
+	// the top serially, with parallel loops over the triangles
+	Box t_box, t_centroids;
+	_bounds(0, t_num, t_box, t_centroids, mPool->threadCount() > 1);
+	mNodes.reserve(2 * (t_num / LEAF_SIZE + 1));
+	_buildNode(mNodes, 0, t_num, t_box, t_centroids, true);
+
+	// then the subtrees, each into its own array
+	std::vector< std::vector<Node> > t_subtrees(mTasks.size());
+	mPool->parallelFor(int(mTasks.size()), [&](int _i) {
+		const Task &t_task = mTasks[_i];
+		_buildNode(t_subtrees[_i], t_task.first, t_task.count, t_task.box, t_task.centroids, false);
+	});
+
+	// and moved behind the top. Their roots replace the nodes left for them.
+	for (size_t i=0; i<mTasks.size(); ++i)
+	{
+		const std::vector<Node> &t_sub = t_subtrees[i];
+		unsigned int t_base = (unsigned int)(mNodes.size()) - 1;
+		for (size_t k=0; k<t_sub.size(); ++k)
+		{
+			Node t_node = t_sub[k];
+			if (t_node.left)
+			{
+				t_node.left += t_base;
+				t_node.right += t_base;
+			}
+			if (k == 0)
+				mNodes[mTasks[i].node] = t_node;
+			else
+				mNodes.push_back(t_node);
+		}
+	}
+
+	mTriangles.resize(t_num);
+	for (unsigned int i=0; i<t_num; ++i)
+		mTriangles[i] = mRefs[i].triangle;
+
+	// each leaf in the order of the model, which may be the one of the
+	// vertex cache, see CAccessObj::OptimizeVertexCache()
+	mLeafFirsts.clear();
+	for (size_t i=0; i<mNodes.size(); ++i)
+	{
+		if (mNodes[i].left != 0)
+			continue;
+		std::sort(mTriangles.begin() + mNodes[i].first, 
+			mTriangles.begin() + mNodes[i].first + mNodes[i].count);
+		mLeafFirsts.push_back(mNodes[i].first);
+	}
+	std::sort(mLeafFirsts.begin(), mLeafFirsts.end());
+
+	std::vector<Ref>().swap(mRefs);
+	std::vector<Task>().swap(mTasks);
+	mPool = 0;
+}
+
+unsigned int CBvh::_buildNode(std::vector<Node>& _nodes, unsigned int _first,
+							  unsigned int _count, const Box& _box, const Box& _centroids, bool _top)
+{
+	unsigned int t_id = (unsigned int)(_nodes.size());
+	_nodes.push_back(Node());
+	if (_top && _count <= BVH_PARALLEL_SIZE && mPool->threadCount() > 1)
+	{
+		Task t_task = { t_id, _first, _count, _box, _centroids };
+		mTasks.push_back(t_task);
+		return t_id;
+	}
+
+	_nodes[t_id].box = _box;
+	_nodes[t_id].first = _first;
+	_nodes[t_id].count = _count;
+	_nodes[t_id].left = _nodes[t_id].right = 0;
+	if (_count <= LEAF_SIZE)
+		return t_id;
+
+	// across the longest axis of the centroids
+	int t_axis = 0;
+	for (int i=1; i<3; ++i)
+	{
+		if (_centroids.max[i] - _centroids.min[i] >
+			_centroids.max[t_axis] - _centroids.min[t_axis])
+			t_axis = i;
+	}
+	float t_extent = _centroids.max[t_axis] - _centroids.min[t_axis];
+
+	bool t_parallel = _top && mPool->threadCount() > 1;
+	Ref *t_refs = &mRefs[0];
+	unsigned int t_mid = _first;
+	Bin t_left, t_right;
+	if (t_extent > 0)
+	{
+		float t_min = _centroids.min[t_axis];
+		float t_scale = BINS / t_extent;
+		Bin t_bins[BINS];
+		_bin(_first, _count, t_axis, t_min, t_scale, t_bins, t_parallel);
+
+		// cost of the split after bin i, the area of each side times its
+		// number of triangles
+		Bin t_acc[BINS];
+		t_acc[BINS-1] = t_bins[BINS-1];
+		for (int i=BINS-2; i>0; --i)
+		{
+			t_acc[i] = t_bins[i];
+			bvh_grow(t_acc[i].box, t_acc[i+1].box);
+			bvh_grow(t_acc[i].centroids, t_acc[i+1].centroids);
+			t_acc[i].count += t_acc[i+1].count;
+		}
+		int t_best = -1;
+		double t_bestCost = DBL_MAX;
+		Bin t_sum = t_bins[0];
+		for (int i=0; i<BINS-1; ++i)
+		{
+			if (i > 0)
+			{
+				bvh_grow(t_sum.box, t_bins[i].box);
+				bvh_grow(t_sum.centroids, t_bins[i].centroids);
+				t_sum.count += t_bins[i].count;
+			}
+			const Bin &t_other = t_acc[i+1];
+			if (t_sum.count == 0 || t_other.count == 0)
+				continue;
+			double t_cost = bvh_area(t_sum.box) * t_sum.count +
+				bvh_area(t_other.box) * t_other.count;
+			if (t_cost < t_bestCost)
+			{
+				t_best = i;
+				t_bestCost = t_cost;
+				t_left = t_sum;
+				t_right = t_other;
+				t_mid = _first + t_sum.count;
+			}
+		}
+
+		if (t_best >= 0)
+		{
+			std::partition(t_refs + _first, t_refs + _first + _count,
+				[=](const Ref& _r) {
+					return bvh_binOf(_r.box, t_axis, t_min, t_scale) <= t_best;
+				});
+		}
+	}
+
+	if (t_mid == _first)
+	{
+		// boxes too thin for the bins, split in the middle
+		t_mid = _first + _count/2;
+		_bounds(_first, t_mid - _first, t_left.box, t_left.centroids, t_parallel);
+		_bounds(t_mid, _first + _count - t_mid, t_right.box, t_right.centroids, t_parallel);
+	}
+	unsigned int t_leftId = _buildNode(_nodes, _first, t_mid - _first, t_left.box, t_left.centroids, _top);
+	unsigned int t_rightId = _buildNode(_nodes, t_mid, _first + _count - t_mid, t_right.box, t_right.centroids, _top);
+	_nodes[t_id].left = t_leftId;
+	_nodes[t_id].right = t_rightId;
+	return t_id;
+}
+
+void CBvh::_bounds(unsigned int _first, unsigned int _count, Box& _box, Box& _centroids,
+				   bool _parallel)
+{
+	const Ref *t_refs = &mRefs[_first];
+	int t_chunks = _parallel ? int((_count + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE) : 1;
+	unsigned int t_size = _parallel ? BVH_CHUNK_SIZE : _count;
+	std::vector<Box> t_box(t_chunks), t_centroids(t_chunks);
+	auto t_job = [&](int _c) {
+		bvh_reset(t_box[_c]);
+		bvh_reset(t_centroids[_c]);
+		unsigned int t_end = min(_count, (_c + 1) * t_size);
+		for (unsigned int i = _c * t_size; i < t_end; ++i)
+		{
+			bvh_grow(t_box[_c], t_refs[i].box);
+			bvh_growCentroid(t_centroids[_c], t_refs[i].box);
+		}
+	};
+	if (_parallel)
+		mPool->parallelFor(t_chunks, t_job);
+	else
+		t_job(0);
+
+	_box = t_box[0];
+	_centroids = t_centroids[0];
+	for (int c=1; c<t_chunks; ++c)
+	{
+		bvh_grow(_box, t_box[c]);
+		bvh_grow(_centroids, t_centroids[c]);
+	}
+}
+
+void CBvh::_bin(unsigned int _first, unsigned int _count, int _axis, float _min,
+				float _scale, Bin* _bins, bool _parallel)
+{
+	const Ref *t_refs = &mRefs[_first];
+	int t_chunks = _parallel ? int((_count + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE) : 1;
+	unsigned int t_size = _parallel ? BVH_CHUNK_SIZE : _count;
+	std::vector<Bin> t_bins(t_chunks * BINS);
+	auto t_job = [&](int _c) {
+		Bin *t_local = &t_bins[_c * BINS];
+		for (int k=0; k<BINS; ++k)
+		{
+			bvh_reset(t_local[k].box);
+			bvh_reset(t_local[k].centroids);
+			t_local[k].count = 0;
+		}
+		unsigned int t_end = min(_count, (_c + 1) * t_size);
+		for (unsigned int i = _c * t_size; i < t_end; ++i)
+		{
+			const Box &t_tri = t_refs[i].box;
+			Bin &t_bin = t_local[bvh_binOf(t_tri, _axis, _min, _scale)];
+			bvh_grow(t_bin.box, t_tri);
+			bvh_growCentroid(t_bin.centroids, t_tri);
+			++t_bin.count;
+		}
+	};
+	if (_parallel)
+		mPool->parallelFor(t_chunks, t_job);
+	else
+		t_job(0);
+
+	for (int k=0; k<BINS; ++k)
+	{
+		_bins[k] = t_bins[k];
+		for (int c=1; c<t_chunks; ++c)
+		{
+			const Bin &t_bin = t_bins[c*BINS + k];
+			bvh_grow(_bins[k].box, t_bin.box);
+			bvh_grow(_bins[k].centroids, t_bin.centroids);
+			_bins[k].count += t_bin.count;
+		}
+	}
+}
+
+void CBvh::cull(const Vec4d* _planes, RangeArray& _ranges, 
+				const OcclusionTest* _occluded) const
+{
+	_ranges.clear();
+	if (mNodes.empty())
+		return;
+
+	// a node and the planes its parent crosses, the ones it is wholly
+	// inside need no test below it
+	struct Entry
+	{
+		unsigned int node;
+		int planes;
+	};
+	std::vector<Entry> t_stack;
+	Entry t_root = { 0, 0x3f };
+	t_stack.push_back(t_root);
+	while (!t_stack.empty())
+	{
+		Entry t_e = t_stack.back();
+		t_stack.pop_back();
+		const Node &t_node = mNodes[t_e.node];
+		const Box &b = t_node.box;
+
+		bool t_outside = false;
+		for (int i=0; i<6 && !t_outside; ++i)
+		{
+			if (!(t_e.planes & (1<<i)))
+				continue;
+			// the corners furthest inside and outside
+			const Vec4d &p = _planes[i];
+			double t_in = p[3], t_out = p[3];
+			for (int k=0; k<3; ++k)
+			{
+				t_in += p[k] * ((p[k] >= 0) ? b.max[k] : b.min[k]);
+				t_out += p[k] * ((p[k] >= 0) ? b.min[k] : b.max[k]);
+			}
+			if (t_in < 0)
+				t_outside = true;
+			else if (t_out >= 0)
+				t_e.planes &= ~(1<<i);
+		}
+		if (t_outside)
+			continue;
+		if (_occluded && (*_occluded)(b))
+			continue;
+
+		if (t_node.left == 0 || (t_e.planes == 0 && !_occluded))
+		{
+			// the leaves are visited in the order of triangles()
+			if (!_ranges.empty() && _ranges.back().first + _ranges.back().count == t_node.first)
+			{
+				_ranges.back().count += t_node.count;
+			}
+			else
+			{
+				Range t_range = { t_node.first, t_node.count };
+				_ranges.push_back(t_range);
+			}
+			continue;
+		}
+
+		Entry t_left = { t_node.left, t_e.planes }, t_right = { t_node.right, t_e.planes };
+		t_stack.push_back(t_right);
+		t_stack.push_back(t_left);
+	}
+}
+
+void CBvh::sortByModel(RangeArray& _ranges) const
+{
+	RangeArray t_leaves;
+	t_leaves.reserve(_ranges.size());
+	for (size_t i=0; i<_ranges.size(); ++i)
+	{
+		unsigned int t_begin = _ranges[i].first, t_end = _ranges[i].first + _ranges[i].count;
+		// the leaf t_begin is in, then the ones after it
+		size_t l = std::upper_bound(mLeafFirsts.begin(), mLeafFirsts.end(), t_begin) - 
+			mLeafFirsts.begin();
+		while (t_begin < t_end)
+		{
+			unsigned int t_next = (l < mLeafFirsts.size()) ? min(mLeafFirsts[l], t_end) : t_end;
+			Range t_range = { t_begin, t_next - t_begin };
+			t_leaves.push_back(t_range);
+			t_begin = t_next;
+			++l;
+		}
+	}
+
+	// a leaf is sorted, so its first triangle is its smallest
+	const std::vector<unsigned int> &t_tris = mTriangles;
+	std::sort(t_leaves.begin(), t_leaves.end(), [&t_tris](const Range& _a, const Range& _b) {
+		return t_tris[_a.first] < t_tris[_b.first];
+	});
+	_ranges.swap(t_leaves);
+}
+
+// the ranges are sorted and apart, one pass over both does
+void CBvh::intersect(const RangeArray& _a, const RangeArray& _b, RangeArray& _out)
+{
+	_out.clear();
+	size_t i = 0, j = 0;
+	while (i < _a.size() && j < _b.size())
+	{
+		unsigned int t_begin = max(_a[i].first, _b[j].first);
+		unsigned int t_endA = _a[i].first + _a[i].count, t_endB = _b[j].first + _b[j].count;
+		unsigned int t_end = min(t_endA, t_endB);
+		if (t_begin < t_end)
+		{
+			Range t_range = { t_begin, t_end - t_begin };
+			_out.push_back(t_range);
+		}
+		if (t_endA <= t_endB)
+			++i;
+		else
+			++j;
+	}
+}
+
+void CBvh::subtract(const RangeArray& _a, const RangeArray& _b, RangeArray& _out)
+{
+	_out.clear();
+	size_t j = 0;
+	for (size_t i=0; i<_a.size(); ++i)
+	{
+		unsigned int t_begin = _a[i].first, t_end = _a[i].first + _a[i].count;
+		while (j < _b.size() && _b[j].first + _b[j].count <= t_begin)
+			++j;
+		// cut out the ranges of _b which overlap this one
+		for (size_t k=j; k<_b.size() && _b[k].first < t_end; ++k)
+		{
+			if (_b[k].first > t_begin)
+			{
+				Range t_range = { t_begin, _b[k].first - t_begin };
+				_out.push_back(t_range);
+			}
+			t_begin = max(t_begin, _b[k].first + _b[k].count);
+		}
+		if (t_begin < t_end)
+		{
+			Range t_range = { t_begin, t_end - t_begin };
+			_out.push_back(t_range);
+		}
+	}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include "BasicStructure.h"
+
+class COBJmodel;
+class CThreadPool;
+
+//////////////////////////////////////////////////////////////////////////
+// CBvh: a bounding volume hierarchy over the triangles of a COBJmodel,
+// to cull them against the view frustum by whole clusters.
+//
+// A node is split at the best of BINS planes across the longest axis of
+// the centroids of its triangles, by the surface area heuristic, until
+// it has LEAF_SIZE triangles at most. The triangles are partitioned in
+// place, so those of any subtree are a range of triangles(). The large
+// nodes at the top bin their triangles in parallel, the subtrees below
+// are built in parallel.
+//////////////////////////////////////////////////////////////////////////
+class CBvh
+{
+public:
+	enum { LEAF_SIZE = 64, BINS = 16 };
+
+	struct Box
+	{
+		float min[3], max[3];
+	};
+
+	struct Node
+	{
+		Box box;
+		unsigned int first, count;	// its triangles, a range of triangles()
+		unsigned int left, right;	// children, 0 for a leaf
+	};
+
+	// a range of triangles()
+	struct Range
+	{
+		unsigned int first, count;
+	};
+	typedef std::vector<Range> RangeArray;
+
+	// true if nothing inside the box can be seen
+	typedef std::function<bool(const Box&)> OcclusionTest;
+
+	CBvh();
+
+	// threads used by the build, 0 for one per hardware thread
+	void build(const COBJmodel* _model, int _threads = 0);
+	void clear();
+	bool empty() const { return mNodes.empty(); }
+
+	// the triangles of the leaves which are not wholly outside one of the
+	// planes, see CCamera::frustumPlanes(). Ranges which follow each other
+	// are merged. With _occluded the nodes it finds hidden are skipped too,
+	// it is then asked down to the leaves.
+	void cull(const Vec4d* _planes, RangeArray& _ranges, 
+		const OcclusionTest* _occluded = 0) const;
+
+	// of the sorted ranges cull() returns
+	static void intersect(const RangeArray& _a, const RangeArray& _b, RangeArray& _out);
+	static void subtract(const RangeArray& _a, const RangeArray& _b, RangeArray& _out);
+
+	// the ranges cut at the leaves, in the order of their first triangle in
+	// the model, for an order like the one of CAccessObj::OptimizeOverdraw().
+	// They are no longer sorted for intersect() and subtract().
+	void sortByModel(RangeArray& _ranges) const;
+
+	const std::vector<Node>& nodes() const { return mNodes; }
+	// indices into COBJmodel::pTriangles, in the order of the leaves
+	const std::vector<unsigned int>& triangles() const { return mTriangles; }
+
+private:
+	// a triangle and its box, partitioned with it so that the passes over
+	// the triangles of a node read memory in order
+	struct Ref
+	{
+		Box box;
+		unsigned int triangle;
+	};
+
+	// the box of some triangles and of their centroids
+	struct Bin
+	{
+		Box box, centroids;
+		unsigned int count;
+	};
+
+	// one subtree left to build in parallel
+	struct Task
+	{
+		unsigned int node;
+		unsigned int first, count;
+		Box box, centroids;
+	};
+
+	// the node of [_first, _first+_count) and its subtree, into _nodes. With
+	// _top the large nodes use mPool, and the small ones become mTasks.
+	unsigned int _buildNode(std::vector<Node>& _nodes, unsigned int _first,
+		unsigned int _count, const Box& _box, const Box& _centroids, bool _top);
+	void _bounds(unsigned int _first, unsigned int _count, Box& _box, Box& _centroids,
+		bool _parallel);
+	void _bin(unsigned int _first, unsigned int _count, int _axis, float _min,
+		float _scale, Bin* _bins, bool _parallel);
+
+private:
+	std::vector<Node> mNodes;			// the root first
+	std::vector<unsigned int> mTriangles;
+	std::vector<unsigned int> mLeafFirsts;	// the first of each leaf, increasing
+
+	// only during build()
+	std::vector<Ref> mRefs;
+	std::vector<Task> mTasks;
+	CThreadPool *mPool;
+};
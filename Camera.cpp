@@ -1,5 +1,6 @@
 #include "Camera.h"
 #include <cassert>
+#include <cmath>
 
 CCamera::CCamera(void)
 : mNeedUpdate(true)
@@ -86,12 +87,76 @@ void CCamera::ortho(double left, double right, double bottom, double top,
 }
 
 void CCamera::transform(Vec4d& v)
+{
+	matrix().transformVec(v);
+}
+
+const Mat44d& CCamera::matrix()
 {
 	if (mNeedUpdate)
 	{
 		mFinalMatrix = mProjectMatrix;
 		mFinalMatrix.multiply(mViewMatrix);
+		_extractPlanes();
 		mNeedUpdate = false;
 	}
-	mFinalMatrix.transformVec(v);
+	return mFinalMatrix;
+}
+
+//------------------------------------------------------------------------------
+// Culling
+//------------------------------------------------------------------------------
+void CCamera::_extractPlanes()
+{
+	// a point is inside when -w <= x, y, z <= w in clip space, each row of
+	// the matrix gives one of the coordinates
+	const Mat44d &m = mFinalMatrix;
+	for (int i=0; i<3; ++i)
+	{
+		for (int j=0; j<4; ++j)
+		{
+			mPlanes[2*i][j] = m[3][j] + m[i][j];
+			mPlanes[2*i+1][j] = m[3][j] - m[i][j];
+		}
+	}
+	for (int i=0; i<6; ++i)
+	{
+		Vec4d &p = mPlanes[i];
+		double t_len = sqrt(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+		p /= t_len;
+	}
+}
+
+const Vec4d* CCamera::frustumPlanes()
+{
+	matrix();
+	return mPlanes;
+}
+
+bool CCamera::sphereInFrustum(const Vec3d& _center, double _radius)
+{
+	const Vec4d *t_planes = frustumPlanes();
+	for (int i=0; i<6; ++i)
+	{
+		const Vec4d &p = t_planes[i];
+		if (p[0]*_center[0] + p[1]*_center[1] + p[2]*_center[2] + p[3] < -_radius)
+			return false;
+	}
+	return true;
+}
+
+bool CCamera::boxInFrustum(const Vec3d& _min, const Vec3d& _max)
+{
+	const Vec4d *t_planes = frustumPlanes();
+	for (int i=0; i<6; ++i)
+	{
+		// the corner furthest inside
+		const Vec4d &p = t_planes[i];
+		double x = (p[0] >= 0) ? _max[0] : _min[0];
+		double y = (p[1] >= 0) ? _max[1] : _min[1];
+		double z = (p[2] >= 0) ? _max[2] : _min[2];
+		if (p[0]*x + p[1]*y + p[2]*z + p[3] < 0)
+			return false;
+	}
+	return true;
 }
@@ -14,9 +14,21 @@ public:
 	void frustum(double left, double right, double bottom, double top, double near, double far);
 	void ortho(double left, double right, double bottom, double top, double near, double far);
 	void transform(Vec4d& v);
+	const Mat44d& matrix(); // ProjectMatrix * ViewMatrix
 	const Vec4d& pos() { return mCameraPos; }
+	const Mat44d& projectMatrix() { return mProjectMatrix; }
+
+	// the planes of the view frustum in world space, (a, b, c, d) with
+	// a*x + b*y + c*z + d >= 0 inside and (a, b, c) of unit length
+	enum { PLANE_LEFT = 0, PLANE_RIGHT, PLANE_BOTTOM, PLANE_TOP, PLANE_NEAR, PLANE_FAR };
+	const Vec4d* frustumPlanes();
+	// false if the volume is wholly outside one of the planes
+	bool sphereInFrustum(const Vec3d& _center, double _radius);
+	bool boxInFrustum(const Vec3d& _min, const Vec3d& _max);
 
 private:
+	void _extractPlanes();
+
 	Mat44d mModelMatrix;
 	Mat44d mViewMatrix;
 	Mat44d mProjectMatrix;
@@ -24,4 +36,5 @@ private:
 	Vec4d mCameraPos;
 	bool mNeedUpdate; // is it needed to update @mFinalMatrix
 	Mat44d mFinalMatrix; // ProjectMatrix * ViewMatrix
+	Vec4d mPlanes[6];	// of mFinalMatrix
 };
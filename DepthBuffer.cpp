@@ -0,0 +1,73 @@
+#include "DepthBuffer.h"
+
+CDepthBuffer::CDepthBuffer()
+: mFormat(SL_DEPTH_FLOAT64), mScale(1.0), mSize(0)
+{
+}
+
+void CDepthBuffer::setFormat(DepthFormat _format)
+{
+	if (_format == mFormat)
+		return;
+
+	// release the old storage
+	std::vector<double>().swap(mFloat64);
+	std::vector<float>().swap(mFloat32);
+	std::vector<unsigned int>().swap(mUnorm24);
+	std::vector<unsigned short>().swap(mUnorm16);
+
+	mFormat = _format;
+	switch (mFormat)
+	{
+	case SL_DEPTH_UNORM24:
+		mScale = double((1<<24) - 1);
+		break;
+	case SL_DEPTH_UNORM16:
+		mScale = double((1<<16) - 1);
+		break;
+	default:
+		mScale = 1.0;
+		break;
+	}
+	assign(mSize, 1.0);
+}
+
+void CDepthBuffer::assign(int _size, double _depth)
+{
+	mSize = _size;
+	double t_z = quantize(_depth * mScale);
+	switch (mFormat)
+	{
+	case SL_DEPTH_FLOAT32:
+		mFloat32.assign(_size, float(t_z));
+		break;
+	case SL_DEPTH_UNORM24:
+		mUnorm24.assign(_size, (unsigned int)(t_z));
+		break;
+	case SL_DEPTH_UNORM16:
+		mUnorm16.assign(_size, (unsigned short)(t_z));
+		break;
+	default:
+		mFloat64.assign(_size, t_z);
+		break;
+	}
+}
+
+void* CDepthBuffer::data(int _i)
+{
+	if (mSize == 0)
+		return 0;
+
+	switch (mFormat)
+	{
+	case SL_DEPTH_FLOAT32: return &mFloat32[_i];
+	case SL_DEPTH_UNORM24: return &mUnorm24[_i];
+	case SL_DEPTH_UNORM16: return &mUnorm16[_i];
+	default: return &mFloat64[_i];
+	}
+}
+
+const void* CDepthBuffer::data(int _i) const
+{
+	return const_cast<CDepthBuffer*>(this)->data(_i);
+}
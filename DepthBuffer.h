@@ -0,0 +1,104 @@
+#pragma once
+
+#include <vector>
+#include "BasicStructure.h"
+
+//////////////////////////////////////////////////////////////////////////
+// CDepthBuffer: the z buffer, stored in one of the DepthFormat formats.
+//
+// Depths are passed in buffer units, where the far plane is scale():
+// 1 for the float formats, 2^24-1 and 2^16-1 for the unorm ones. The
+// rasterizer steps z in these units, so a pixel only has to round it.
+// SL_DEPTH_UNORM24 is kept in the low bits of 32-bit words.
+//////////////////////////////////////////////////////////////////////////
+class CDepthBuffer
+{
+public:
+	CDepthBuffer();
+
+	void setFormat(DepthFormat _format);
+	DepthFormat format() const { return mFormat; }
+	double scale() const { return mScale; }
+	// fraction bits of a depth in 32-bit fixed point, which then holds
+	// [-2, 2) times scale()
+	int fixedShift() const
+	{
+		switch (mFormat)
+		{
+		case SL_DEPTH_UNORM24: return 30-24;
+		case SL_DEPTH_UNORM16: return 30-16;
+		default: return 30;
+		}
+	}
+
+	// _depth in [0, 1]
+	void assign(int _size, double _depth);
+	int size() const { return mSize; }
+
+	// the pixels from _i on, of the type of the format
+	void* data(int _i = 0);
+	const void* data(int _i = 0) const;
+
+	// round _z to the format
+	inline double quantize(double _z) const
+	{
+		switch (mFormat)
+		{
+		case SL_DEPTH_FLOAT32:
+			return float(_z);
+		case SL_DEPTH_UNORM24:
+		case SL_DEPTH_UNORM16:
+			if (_z <= 0) return 0;
+			if (_z >= mScale) return mScale;
+			return double((unsigned int)(_z + 0.5));
+		default:
+			return _z;
+		}
+	}
+
+	inline double at(int _i) const
+	{
+		switch (mFormat)
+		{
+		case SL_DEPTH_FLOAT32: return mFloat32[_i];
+		case SL_DEPTH_UNORM24: return mUnorm24[_i];
+		case SL_DEPTH_UNORM16: return mUnorm16[_i];
+		default: return mFloat64[_i];
+		}
+	}
+
+	// _z already quantized
+	inline void set(int _i, double _z)
+	{
+		switch (mFormat)
+		{
+		case SL_DEPTH_FLOAT32: mFloat32[_i] = float(_z); break;
+		case SL_DEPTH_UNORM24: mUnorm24[_i] = (unsigned int)(_z); break;
+		case SL_DEPTH_UNORM16: mUnorm16[_i] = (unsigned short)(_z); break;
+		default: mFloat64[_i] = _z; break;
+		}
+	}
+
+	// the depth test: store _z and return true if it is nearer
+	inline bool testAndSet(int _i, double _z)
+	{
+		double t_z = quantize(_z);
+		if (t_z < at(_i))
+		{
+			set(_i, t_z);
+			return true;
+		}
+		return false;
+	}
+
+private:
+	DepthFormat mFormat;
+	double mScale;
+	int mSize;
+
+	// only the one of the format is used
+	std::vector<double> mFloat64;
+	std::vector<float> mFloat32;
+	std::vector<unsigned int> mUnorm24;
+	std::vector<unsigned short> mUnorm16;
+};
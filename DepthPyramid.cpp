@@ -0,0 +1,146 @@
+#include "DepthPyramid.h"
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+// bound of the rounding of the depths stepped by the rasterizer against
+// the ones of the corners of a box, relative to the depth
+#define DP_EPSILON 1e-6
+
+// _z as a float no nearer than it
+static inline float dp_roundUp(double _z)
+{
+	float t_z = float(_z);
+	if (t_z < _z)
+		t_z = std::nextafter(t_z, FLT_MAX);
+	return t_z;
+}
+
+// level 1 from the pixels of the buffer, of the type of its format
+template <class T>
+static void dp_reduce(const T* _src, int _w, int _h, float* _dst, int _dstW, int _dstH)
+{
+	for (int y=0; y<_dstH; ++y)
+	{
+		const T *t_row0 = _src + (2*y) * _w;
+		const T *t_row1 = _src + min(2*y+1, _h-1) * _w;
+		float *t_out = _dst + y * _dstW;
+		for (int x=0; x<_dstW; ++x)
+		{
+			int x1 = min(2*x+1, _w-1);
+			t_out[x] = dp_roundUp(max(max(t_row0[2*x], t_row0[x1]), max(t_row1[2*x], t_row1[x1])));
+		}
+	}
+}
+
+CDepthPyramid::CDepthPyramid()
+: mZBuffer(0)
+{
+}
+
+void CDepthPyramid::clear()
+{
+	mLevels.clear();
+	mZBuffer = 0;
+}
+
+void CDepthPyramid::build(const CDepthBuffer& _zbuf, int _w, int _h)
+{
+	if (_w <= 0 || _h <= 0 || _zbuf.size() < _w * _h)
+	{
+		clear();
+		return;
+	}
+
+	int t_levels = 1;
+	while ((1 << (t_levels-1)) < max(_w, _h))
+		++t_levels;
+	mLevels.resize(t_levels);
+	mZBuffer = &_zbuf;
+
+	Level &t_base = mLevels[0];
+	t_base.width = _w;
+	t_base.height = _h;
+	t_base.depth.clear();
+
+	// each texel the maximum of the up to 2x2 below it, straight from the
+	// buffer for level 1
+	for (int k=1; k<t_levels; ++k)
+	{
+		const Level &t_src = mLevels[k-1];
+		Level &t_dst = mLevels[k];
+		t_dst.width = (t_src.width + 1) >> 1;
+		t_dst.height = (t_src.height + 1) >> 1;
+		t_dst.depth.resize(t_dst.width * t_dst.height);
+		if (k == 1)
+		{
+			const void *t_pixels = _zbuf.data();
+			float *t_out = &t_dst.depth[0];
+			switch (_zbuf.format())
+			{
+			case SL_DEPTH_FLOAT32:
+				dp_reduce(static_cast<const float*>(t_pixels), _w, _h, t_out, t_dst.width, t_dst.height);
+				break;
+			case SL_DEPTH_UNORM24:
+				dp_reduce(static_cast<const unsigned int*>(t_pixels), _w, _h, t_out, t_dst.width, t_dst.height);
+				break;
+			case SL_DEPTH_UNORM16:
+				dp_reduce(static_cast<const unsigned short*>(t_pixels), _w, _h, t_out, t_dst.width, t_dst.height);
+				break;
+			default:
+				dp_reduce(static_cast<const double*>(t_pixels), _w, _h, t_out, t_dst.width, t_dst.height);
+				break;
+			}
+			continue;
+		}
+		dp_reduce(&t_src.depth[0], t_src.width, t_src.height, &t_dst.depth[0], t_dst.width, t_dst.height);
+	}
+}
+
+bool CDepthPyramid::isOccluded(int _x0, int _y0, int _x1, int _y1, double _z) const
+{
+	if (mLevels.empty())
+		return false;
+
+	const Level &t_base = mLevels[0];
+	_x0 = max(_x0, 0);
+	_y0 = max(_y0, 0);
+	_x1 = min(_x1, t_base.width-1);
+	_y1 = min(_y1, t_base.height-1);
+	if (_x0 > _x1 || _y0 > _y1)
+		return true;
+
+	_z -= DP_EPSILON * std::fabs(_z);
+
+	// written so that a NaN depth is never taken as hidden
+	int k = 0;
+	while (k+1 < int(mLevels.size()) && max(_x1-_x0, _y1-_y0) >> k >= 2)
+		++k;
+	if (k == 0)
+	{
+		for (int y = _y0; y <= _y1; ++y)
+		{
+			for (int x = _x0; x <= _x1; ++x)
+			{
+				if (!(_z >= mZBuffer->at(y * t_base.width + x)))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	const Level &t_level = mLevels[k];
+	for (int y = _y0 >> k; y <= _y1 >> k; ++y)
+	{
+		const float *t_row = &t_level.depth[y * t_level.width];
+		for (int x = _x0 >> k; x <= _x1 >> k; ++x)
+		{
+			if (!(_z >= t_row[x]))
+				return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include "DepthBuffer.h"
+
+//////////////////////////////////////////////////////////////////////////
+// CDepthPyramid: the farthest depth of a CDepthBuffer over blocks of
+// 2^k x 2^k pixels, for every k, in the units of the buffer.
+//
+// It is a snapshot, taken once the occluders are drawn, to test bounding
+// boxes against. A rectangle is read on the level where it spans two
+// texels at most, so a test reads 9 of them whatever its size. Level 0 is
+// the buffer itself, whose depths may only get nearer until clear(). The
+// others are floats, rounded away from the eye.
+//////////////////////////////////////////////////////////////////////////
+class CDepthPyramid
+{
+public:
+	CDepthPyramid();
+
+	// the levels of the _w x _h pixels of _zbuf
+	void build(const CDepthBuffer& _zbuf, int _w, int _h);
+	void clear();
+	bool empty() const { return mLevels.empty(); }
+
+	// nothing nearer than _z can pass the depth test in the rectangle
+	// [_x0, _x1] x [_y0, _y1]
+	bool isOccluded(int _x0, int _y0, int _x1, int _y1, double _z) const;
+
+private:
+	struct Level
+	{
+		int width, height;
+		std::vector<float> depth;	// row by row, empty for level 0
+	};
+	std::vector<Level> mLevels;		// level k is the blocks of 2^k pixels
+	const CDepthBuffer *mZBuffer;	// level 0
+};
@@ -0,0 +1,32 @@
+#include "FastMath.h"
+
+// x^n below this reads as 0
+#define FM_POW_CUTOFF (1.0/4096)
+
+CPowTable::CPowTable()
+: mExponent(0.0), mStart(0.0), mScale(0.0)
+{
+}
+
+void CPowTable::setExponent(double _n)
+{
+	if (_n == mExponent && (!mTable.empty() || _n < 2.0))
+		return;
+
+	mExponent = _n;
+	if (_n < 2.0)
+	{
+		std::vector<double>().swap(mTable);
+		return;
+	}
+
+	// |error| <= h^2/8 * max|f''| <= (ln(1/cutoff) / SIZE)^2 / 8, about 8e-6
+	mStart = std::pow(FM_POW_CUTOFF, 1.0/_n);
+	mScale = SIZE / (1.0 - mStart);
+	mTable.resize(SIZE+1);
+	for (int i=0; i<SIZE; ++i)
+	{
+		mTable[i] = std::pow(mStart + i/mScale, _n);
+	}
+	mTable[SIZE] = 1.0;
+}
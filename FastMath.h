@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FM_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Approximations for the SL_FAST_MATH lighting.
+//
+// Error against the exact path, for unit vectors and 8-bit colors:
+// - fm_rsqrt is off by less than 2.1e-7 relative with SSE, 1.8e-3
+//   without (the bit trick seed is coarser, one Newton step either way).
+// - NdotL and NdotHV come from two normalized vectors, so they are off
+//   by twice that.
+// - CPowTable is off by less than 2.5e-4 absolute on [0, 1], whatever
+//   the exponent. Added to it, the relative error of NdotHV grows
+//   n times through x^n.
+// With SSE and shininess 60 the specular term is off by under 3e-4,
+// a tenth of one step of an 8-bit output.
+//////////////////////////////////////////////////////////////////////////
+
+// 1/sqrt(_x) for _x > 0
+inline double fm_rsqrt(double _x)
+{
+#ifdef FM_USE_SSE
+	// 12 bits from the hardware estimate
+	double t_r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(float(_x))));
+#else
+	// 4 bits from halving the exponent
+	union { double d; long long i; } t_u;
+	t_u.d = _x;
+	t_u.i = 0x5fe6eb50c7b537a9LL - (t_u.i >> 1);
+	double t_r = t_u.d;
+#endif
+	// one Newton step squares the relative error
+	return t_r * (1.5 - 0.5 * _x * t_r * t_r);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CPowTable: x^n on [0, 1] for a fixed n, interpolated from a table.
+//
+// The table only covers [x0, 1], where x0^n = FM_POW_CUTOFF, and gives 0
+// below. That interval narrows as n grows, so the interpolation error
+// doesn't depend on n. Exponents below 2 are curved too much near 0 and
+// fall back to std::pow.
+//////////////////////////////////////////////////////////////////////////
+class CPowTable
+{
+public:
+	enum { SIZE = 1024 };
+
+	CPowTable();
+
+	// rebuilds the table only if _n changed
+	void setExponent(double _n);
+	double exponent() const { return mExponent; }
+
+	double operator()(double _x) const
+	{
+		if (mTable.empty())
+			return std::pow(_x, mExponent);
+		if (_x <= mStart)
+			return 0.0;
+
+		double t_t = (_x - mStart) * mScale;
+		int i = int(t_t);
+		if (i >= SIZE)
+			return mTable[SIZE];
+		return mTable[i] + (t_t - i) * (mTable[i+1] - mTable[i]);
+	}
+
+private:
+	double mExponent;
+	double mStart;		// x0
+	double mScale;		// table entries per unit of x
+	std::vector<double> mTable;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <new>
+
+//////////////////////////////////////////////////////////////////////////
+// CFramePool: storage for objects that live until the end of a frame.
+//
+// Objects are carved out of fixed size blocks. The blocks are kept when
+// the pool is reset, so reset() is O(1) and a pool which has grown to the
+// size of a frame never touches the heap again. Pointers stay valid until
+// the next reset(). No destructor is called, so T must not need one.
+//
+// usage: T *p = new (pool.alloc()) T(...);
+//////////////////////////////////////////////////////////////////////////
+template <class T, int BLOCK_SIZE = 4096>
+class CFramePool
+{
+public:
+	CFramePool()
+		: mBlock(0)
+		, mUsed(0)
+	{
+	}
+
+	~CFramePool()
+	{
+		for (size_t i=0; i<mBlocks.size(); ++i)
+		{
+			::operator delete(mBlocks[i]);
+		}
+	}
+
+	// uninitialised storage for one T
+	void* alloc()
+	{
+		if (mUsed == BLOCK_SIZE)
+		{
+			++mBlock;
+			mUsed = 0;
+		}
+		if (mBlock == mBlocks.size())
+		{
+			mBlocks.push_back(static_cast<T*>(::operator new(sizeof(T)*BLOCK_SIZE)));
+		}
+		return mBlocks[mBlock] + mUsed++;
+	}
+
+	// release all objects, keep the blocks
+	void reset()
+	{
+		mBlock = 0;
+		mUsed = 0;
+	}
+
+	size_t size() const { return mBlock*BLOCK_SIZE + mUsed; }
+
+private:
+	CFramePool(const CFramePool&);
+	CFramePool& operator=(const CFramePool&);
+
+	std::vector<T*> mBlocks;
+	size_t mBlock;	// block in use
+	int mUsed;		// objects used in that block
+};
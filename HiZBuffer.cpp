@@ -0,0 +1,107 @@
+#include "HiZBuffer.h"
+#include <cmath>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+// bound of the rounding of a depth stepped along a span, relative to the
+// largest depth on the way
+#define HIZ_EPSILON 1e-9
+
+// the tests are written so that a NaN depth, from an edge on triangle,
+// is never taken as hidden
+
+CHiZBuffer::CHiZBuffer()
+: mWidth(0), mHeight(0), mTilesX(0), mTilesY(0)
+{
+}
+
+void CHiZBuffer::assign(int _w, int _h, double _depth)
+{
+	mWidth = _w;
+	mHeight = _h;
+	mTilesX = (_w + TILE_SIZE - 1) >> TILE_SHIFT;
+	mTilesY = (_h + TILE_SIZE - 1) >> TILE_SHIFT;
+	mRowMax.assign(_h * mTilesX, _depth);
+	mTileMax.assign(mTilesY * mTilesX, _depth);
+}
+
+void CHiZBuffer::update(const CDepthBuffer& _zbuf, int _y, int _x0, int _x1)
+{
+	if (_x0 >= _x1)
+		return;
+
+	int ty = _y >> TILE_SHIFT;
+	int t_y0 = ty << TILE_SHIFT;
+	int t_y1 = min(t_y0 + TILE_SIZE, mHeight);
+	for (int tx = _x0 >> TILE_SHIFT; tx <= (_x1-1) >> TILE_SHIFT; ++tx)
+	{
+		int t_x0 = tx << TILE_SHIFT;
+		int t_x1 = min(t_x0 + TILE_SIZE, mWidth);
+		double t_max = _zbuf.at(_y*mWidth + t_x0);
+		for (int x = t_x0+1; x < t_x1; ++x)
+		{
+			t_max = max(t_max, _zbuf.at(_y*mWidth + x));
+		}
+		mRowMax[_y*mTilesX + tx] = t_max;
+
+		for (int y = t_y0; y < t_y1; ++y)
+		{
+			t_max = max(t_max, mRowMax[y*mTilesX + tx]);
+		}
+		mTileMax[ty*mTilesX + tx] = t_max;
+	}
+}
+
+bool CHiZBuffer::isOccluded(int _x0, int _y0, int _x1, int _y1, double _z) const
+{
+	_x0 = max(_x0, 0);
+	_y0 = max(_y0, 0);
+	_x1 = min(_x1, mWidth-1);
+	_y1 = min(_y1, mHeight-1);
+	if (_x0 > _x1 || _y0 > _y1)
+		return true;
+
+	_z -= HIZ_EPSILON * std::fabs(_z);
+
+	for (int ty = _y0 >> TILE_SHIFT; ty <= _y1 >> TILE_SHIFT; ++ty)
+	{
+		for (int tx = _x0 >> TILE_SHIFT; tx <= _x1 >> TILE_SHIFT; ++tx)
+		{
+			if (!(_z >= mTileMax[ty*mTilesX + tx]))
+				return false;
+		}
+	}
+	return true;
+}
+
+bool CHiZBuffer::clipSpan(int _y, int& _x0, int& _x1, double _z, double _dz) const
+{
+	const double *t_max = &mTileMax[(_y >> TILE_SHIFT) * mTilesX];
+	int t_first = _x0;
+	double t_eps = HIZ_EPSILON * (std::fabs(_z) + std::fabs(_dz) * (_x1 - _x0));
+
+	// the depth is linear, so its nearest on a piece is at one of the ends
+	while (_x0 < _x1)
+	{
+		int tx = _x0 >> TILE_SHIFT;
+		int t_end = min((tx+1) << TILE_SHIFT, _x1);
+		double t_z0 = _z + (_x0 - t_first) * _dz;
+		double t_z1 = _z + (t_end-1 - t_first) * _dz;
+		if (!(min(t_z0, t_z1) - t_eps >= t_max[tx]))
+			break;
+		_x0 = t_end;
+	}
+	while (_x0 < _x1)
+	{
+		int tx = (_x1-1) >> TILE_SHIFT;
+		int t_begin = max(tx << TILE_SHIFT, _x0);
+		double t_z0 = _z + (t_begin - t_first) * _dz;
+		double t_z1 = _z + (_x1-1 - t_first) * _dz;
+		if (!(min(t_z0, t_z1) - t_eps >= t_max[tx]))
+			break;
+		_x1 = t_begin;
+	}
+	return _x0 < _x1;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include "DepthBuffer.h"
+
+//////////////////////////////////////////////////////////////////////////
+// CHiZBuffer: the farthest depth of each tile of a CDepthBuffer, in the
+// same units.
+//
+// Depths in the buffer only get nearer, so an old maximum still bounds
+// its tile: updating just makes the bound tighter. Every tile also keeps
+// the maximum of each of its rows, so a span refreshes only the row it
+// wrote. Threads may update at once if each of them owns whole tiles.
+//////////////////////////////////////////////////////////////////////////
+class CHiZBuffer
+{
+public:
+	enum { TILE_SHIFT = 3, TILE_SIZE = 1<<TILE_SHIFT };	// 8x8 pixels per tile
+
+	CHiZBuffer();
+
+	// _w x _h pixels all at _depth
+	void assign(int _w, int _h, double _depth);
+
+	// re-read the pixels of the tiles that [_x0, _x1) of row _y is in
+	void update(const CDepthBuffer& _zbuf, int _y, int _x0, int _x1);
+
+	// nothing nearer than _z can fail the depth test in the rectangle
+	// [_x0, _x1] x [_y0, _y1]
+	bool isOccluded(int _x0, int _y0, int _x1, int _y1, double _z) const;
+
+	// trim the pixels [_x0, _x1) of row _y, whose depth is _z at _x0 and
+	// changes by _dz a pixel, to the tiles it may pass. False if none.
+	bool clipSpan(int _y, int& _x0, int& _x1, double _z, double _dz) const;
+
+private:
+	int mWidth, mHeight;
+	int mTilesX, mTilesY;
+	std::vector<double> mRowMax;	// of row y in tile column tx at y*mTilesX+tx
+	std::vector<double> mTileMax;	// of tile (tx, ty) at ty*mTilesX+tx
+};
@@ -0,0 +1,279 @@
+#include "MeshOptimizer.h"
+#include "AccessObj.h"
+#include <algorithm>
+#include <cmath>
+
+// a vertex put in the FIFO cache at _stamp is still in it at _time, that
+// is while fewer than CACHE_SIZE others came in after it. _time counts the
+// misses.
+static inline bool mo_inCache(int _time, int _stamp)
+{
+	return _time - _stamp <= CMeshOptimizer::CACHE_SIZE;
+}
+
+// the vertices of _t not in the cache, which are then put in
+static inline int mo_misses(const COBJtriangle& _t, std::vector<int>& _cached, int& _time)
+{
+	int n = 0;
+	for (int k=0; k<3; ++k)
+	{
+		unsigned int v = _t.vindices[k];
+		if (!mo_inCache(_time, _cached[v]))
+		{
+			_cached[v] = _time++;
+			++n;
+		}
+	}
+	return n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+CMeshOptimizer::CMeshOptimizer()
+{
+}
+
+void CMeshOptimizer::optimizeVertexCache(COBJtriangle* _triangles, unsigned int _count,
+										 unsigned int _nVertices)
+{
+	if (_count == 0)
+		return;
+
+	// the vertices of the triangles, numbered from 0 in the order of use
+	if (mLocal.size() < _nVertices + 1)
+		mLocal.assign(_nVertices + 1, -1);
+	std::vector<unsigned int> t_global;
+	std::vector<int> t_tris(3*_count);
+	for (unsigned int i=0; i<3*_count; ++i)
+	{
+		unsigned int v = _triangles[i/3].vindices[i%3];
+		if (mLocal[v] < 0)
+		{
+			mLocal[v] = int(t_global.size());
+			t_global.push_back(v);
+		}
+		t_tris[i] = mLocal[v];
+	}
+	int t_verts = int(t_global.size());
+	for (int i=0; i<t_verts; ++i)
+		mLocal[t_global[i]] = -1;
+
+	// the triangles around each vertex, and how many are left of them
+	std::vector<int> t_live(t_verts, 0);
+	for (unsigned int i=0; i<3*_count; ++i)
+		++t_live[t_tris[i]];
+	std::vector<int> t_adjStart(t_verts+1, 0), t_adj(3*_count);
+	for (int i=0; i<t_verts; ++i)
+		t_adjStart[i+1] = t_adjStart[i] + t_live[i];
+	{
+		std::vector<int> t_fill(t_adjStart.begin(), t_adjStart.end()-1);
+		for (unsigned int i=0; i<3*_count; ++i)
+			t_adj[t_fill[t_tris[i]]++] = i/3;
+	}
+
+	// see mo_inCache()
+	std::vector<int> t_cached(t_verts, 0);
+	int t_time = CACHE_SIZE + 1;
+	std::vector<char> t_emitted(_count, 0);
+	std::vector<unsigned int> t_order;
+	t_order.reserve(_count);
+	std::vector<int> t_deadEnd, t_candidates;
+	int t_cursor = 0;
+	int t_fan = 0;
+	while (t_fan >= 0)
+	{
+		t_candidates.clear();
+		for (int a = t_adjStart[t_fan]; a < t_adjStart[t_fan+1]; ++a)
+		{
+			int t = t_adj[a];
+			if (t_emitted[t])
+				continue;
+			t_emitted[t] = 1;
+			t_order.push_back(t);
+			for (int k=0; k<3; ++k)
+			{
+				int v = t_tris[3*t+k];
+				t_deadEnd.push_back(v);
+				t_candidates.push_back(v);
+				--t_live[v];
+				if (!mo_inCache(t_time, t_cached[v]))
+					t_cached[v] = t_time++;
+			}
+		}
+
+		// the oldest which stays in the cache through its own triangles, or
+		// else any with triangles left
+		t_fan = -1;
+		int t_best = -1;
+		for (size_t i=0; i<t_candidates.size(); ++i)
+		{
+			int v = t_candidates[i];
+			if (t_live[v] == 0)
+				continue;
+			int t_age = 0;
+			if (t_time - t_cached[v] + 2*t_live[v] <= CACHE_SIZE)
+				t_age = t_time - t_cached[v];
+			if (t_age > t_best)
+			{
+				t_best = t_age;
+				t_fan = v;
+			}
+		}
+
+		// a dead end: back to a recent vertex, or on to the next one
+		while (t_fan < 0 && !t_deadEnd.empty())
+		{
+			int v = t_deadEnd.back();
+			t_deadEnd.pop_back();
+			if (t_live[v] > 0)
+				t_fan = v;
+		}
+		while (t_fan < 0 && t_cursor < t_verts)
+		{
+			if (t_live[t_cursor] > 0)
+				t_fan = t_cursor;
+			else
+				++t_cursor;
+		}
+	}
+
+	std::vector<COBJtriangle> t_source(_triangles, _triangles + _count);
+	for (unsigned int i=0; i<_count; ++i)
+		_triangles[i] = t_source[t_order[i]];
+}
+
+unsigned int CMeshOptimizer::optimizeOverdraw(COBJtriangle* _triangles, unsigned int _count,
+											  const CPoint3D* _vertices, unsigned int _nVertices, 
+											  float _threshold, std::vector<unsigned int>* _order)
+{
+	if (_count == 0)
+		return 0;
+
+	// where the order jumps to another part of the mesh
+	std::vector<int> t_cached(_nVertices + 1, -CACHE_SIZE-1);
+	int t_time = 0;
+	std::vector<unsigned int> t_hard;
+	for (unsigned int i=0; i<_count; ++i)
+	{
+		if (mo_misses(_triangles[i], t_cached, t_time) == 3 || i == 0)
+			t_hard.push_back(i);
+	}
+	t_hard.push_back(_count);
+
+	// and within those, where they are about as cheap as they will get. The
+	// cache is flushed by as many misses as it holds.
+	std::vector<unsigned int> t_starts;
+	for (size_t h=0; h+1<t_hard.size(); ++h)
+	{
+		unsigned int t_first = t_hard[h], t_end = t_hard[h+1];
+		t_time += CACHE_SIZE;
+		int t_misses = 0;
+		for (unsigned int i=t_first; i<t_end; ++i)
+			t_misses += mo_misses(_triangles[i], t_cached, t_time);
+		double t_limit = _threshold * double(t_misses) / (t_end - t_first);
+
+		t_starts.push_back(t_first);
+		t_time += CACHE_SIZE;
+		unsigned int t_start = t_first;
+		t_misses = 0;
+		for (unsigned int i=t_first; i+1<t_end; ++i)
+		{
+			t_misses += mo_misses(_triangles[i], t_cached, t_time);
+			if (t_misses <= t_limit * (i + 1 - t_start))
+			{
+				t_start = i + 1;
+				t_starts.push_back(t_start);
+				t_misses = 0;
+				t_time += CACHE_SIZE;
+			}
+		}
+	}
+	t_starts.push_back(_count);
+
+	// the centroid and normal of each cluster and of the mesh, weighted by
+	// area
+	struct Cluster
+	{
+		unsigned int first, count;
+		double center[3], normal[3], area;
+		double key;
+		bool operator < (const Cluster& _o) const { return key > _o.key; }
+	};
+	std::vector<Cluster> t_clusters(t_starts.size() - 1);
+	double t_center[3] = { 0, 0, 0 }, t_area = 0;
+	for (size_t c=0; c<t_clusters.size(); ++c)
+	{
+		Cluster &t_c = t_clusters[c];
+		t_c.first = t_starts[c];
+		t_c.count = t_starts[c+1] - t_starts[c];
+		t_c.area = 0;
+		for (int k=0; k<3; ++k)
+			t_c.center[k] = t_c.normal[k] = 0;
+		for (unsigned int i = t_c.first; i < t_c.first + t_c.count; ++i)
+		{
+			const CPoint3D &p0 = _vertices[_triangles[i].vindices[0]];
+			const CPoint3D &p1 = _vertices[_triangles[i].vindices[1]];
+			const CPoint3D &p2 = _vertices[_triangles[i].vindices[2]];
+			double e1[3] = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z };
+			double e2[3] = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+			double n[3] = { e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0] };
+			double a = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+			double c[3] = { p0.x + p1.x + p2.x, p0.y + p1.y + p2.y, p0.z + p1.z + p2.z };
+			for (int k=0; k<3; ++k)
+			{
+				t_c.center[k] += a * c[k] / 3;
+				t_c.normal[k] += n[k];
+			}
+			t_c.area += a;
+		}
+		for (int k=0; k<3; ++k)
+			t_center[k] += t_c.center[k];
+		t_area += t_c.area;
+	}
+	if (t_area > 0)
+	{
+		for (int k=0; k<3; ++k)
+			t_center[k] /= t_area;
+	}
+
+	// the clusters facing out of the mesh from further out first
+	for (size_t c=0; c<t_clusters.size(); ++c)
+	{
+		Cluster &t_c = t_clusters[c];
+		double t_len = sqrt(t_c.normal[0]*t_c.normal[0] + t_c.normal[1]*t_c.normal[1] + 
+			t_c.normal[2]*t_c.normal[2]);
+		t_c.key = 0;
+		if (t_c.area > 0 && t_len > 0)
+		{
+			for (int k=0; k<3; ++k)
+				t_c.key += (t_c.center[k] / t_c.area - t_center[k]) * t_c.normal[k] / t_len;
+		}
+	}
+	std::stable_sort(t_clusters.begin(), t_clusters.end());
+
+	std::vector<unsigned int> t_order;
+	t_order.reserve(_count);
+	for (size_t c=0; c<t_clusters.size(); ++c)
+	{
+		for (unsigned int i=0; i<t_clusters[c].count; ++i)
+			t_order.push_back(t_clusters[c].first + i);
+	}
+	std::vector<COBJtriangle> t_source(_triangles, _triangles + _count);
+	for (unsigned int i=0; i<_count; ++i)
+		_triangles[i] = t_source[t_order[i]];
+	if (_order)
+		_order->swap(t_order);
+	return (unsigned int)t_clusters.size();
+}
+
+float CMeshOptimizer::acmr(const COBJtriangle* _triangles, unsigned int _count,
+						   unsigned int _nVertices)
+{
+	if (_count == 0)
+		return 0;
+
+	std::vector<int> t_cached(_nVertices + 1, -CACHE_SIZE-1);
+	int t_time = 0;
+	for (unsigned int i=0; i<_count; ++i)
+		mo_misses(_triangles[i], t_cached, t_time);
+	return float(t_time) / _count;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+
+class COBJtriangle;
+class CPoint3D;
+
+//////////////////////////////////////////////////////////////////////////
+// CMeshOptimizer: orders the triangles of a mesh so that it draws faster.
+//
+// optimizeVertexCache() is Tipsify, of Sander, Nehab and Barczak: it
+// emits the triangles around a vertex, then goes on with the one of
+// their vertices which will still be in a FIFO cache of CACHE_SIZE after
+// its own triangles, the oldest. When there is none it goes back to the
+// last vertex with triangles left. It only looks at vindices.
+//
+// optimizeOverdraw() is the overdraw pass of the same paper. It cuts that
+// order into clusters and sorts them by how far out of the mesh they lie
+// along their normal. Those are the ones most likely to hide the others,
+// from wherever the mesh is seen.
+//////////////////////////////////////////////////////////////////////////
+class CMeshOptimizer
+{
+public:
+	enum { CACHE_SIZE = 16 };
+
+	CMeshOptimizer();
+
+	// reorder the _count triangles in place. Their vindices are at most
+	// _nVertices.
+	void optimizeVertexCache(COBJtriangle* _triangles, unsigned int _count,
+		unsigned int _nVertices);
+
+	// reorder the clusters of the _count triangles, which are in the order
+	// of optimizeVertexCache(). A cluster starts where all three vertices of
+	// a triangle miss the cache, or where the average cache miss ratio so
+	// far is within _threshold times the one of the whole cluster. With
+	// _order, the old index of each triangle. Returns the clusters.
+	unsigned int optimizeOverdraw(COBJtriangle* _triangles, unsigned int _count,
+		const CPoint3D* _vertices, unsigned int _nVertices, float _threshold,
+		std::vector<unsigned int>* _order = 0);
+
+	// the average cache miss ratio: vertices transformed per triangle, with
+	// a FIFO cache of CACHE_SIZE
+	static float acmr(const COBJtriangle* _triangles, unsigned int _count,
+		unsigned int _nVertices);
+
+private:
+	// the number of each vertex among the triangles, -1 between calls
+	std::vector<int> mLocal;
+};
@@ -0,0 +1,40 @@
+#include "QImageTarget.h"
+#include <QImage>
+
+int CQImageTarget::width() const
+{
+	return mImg->width();
+}
+
+int CQImageTarget::height() const
+{
+	return mImg->height();
+}
+
+unsigned char* CQImageTarget::bits()
+{
+	// detaches the image, so it is only called once a frame
+	if (mImg->depth() != 32)
+		return 0;
+	return mImg->bits();
+}
+
+int CQImageTarget::bytesPerLine() const
+{
+	return mImg->bytesPerLine();
+}
+
+unsigned int CQImageTarget::pixel(int _x, int _y)
+{
+	return mImg->pixel(_x, _y);
+}
+
+void CQImageTarget::setPixel(int _x, int _y, unsigned int _argb)
+{
+	mImg->setPixel(_x, _y, _argb);
+}
+
+void CQImageTarget::fill(unsigned int _argb)
+{
+	mImg->fill(_argb);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "RenderTarget.h"
+
+class QImage;
+
+//////////////////////////////////////////////////////////////////////////
+// CQImageTarget: draws into a QImage. The 32-bit formats are written in
+// place, the others pixel by pixel through QImage.
+//////////////////////////////////////////////////////////////////////////
+class CQImageTarget : public CRenderTarget
+{
+public:
+	CQImageTarget(QImage* _img = 0) : mImg(_img) {}
+
+	void setImage(QImage* _img) { mImg = _img; }
+	QImage* image() const { return mImg; }
+
+	int width() const;
+	int height() const;
+	unsigned char* bits();
+	int bytesPerLine() const;
+
+	unsigned int pixel(int _x, int _y);
+	void setPixel(int _x, int _y, unsigned int _argb);
+	void fill(unsigned int _argb);
+
+private:
+	QImage *mImg;
+};
@@ -29,6 +29,57 @@ void CRenderState::setState(int _state, int _val)
 		else
 			mState &= ~_state;
 		break;
+	case SL_TILED:
+		if (_val)
+		{
+			mState |= _state;
+			mState &= ~(SL_BANDED | SL_HALFSPACE);
+		}
+		else
+			mState &= ~_state;
+		break;
+	case SL_BANDED:
+		if (_val)
+		{
+			mState |= _state;
+			mState &= ~(SL_TILED | SL_HALFSPACE);
+		}
+		else
+			mState &= ~_state;
+		break;
+	case SL_HALFSPACE:
+		if (_val)
+		{
+			mState |= _state;
+			mState &= ~(SL_TILED | SL_BANDED);
+		}
+		else
+			mState &= ~_state;
+		break;
+	case SL_HIZ:
+		if (_val)
+			mState |= _state;
+		else
+			mState &= ~_state;
+		break;
+	case SL_VISIBILITY:
+		if (_val)
+			mState |= _state;
+		else
+			mState &= ~_state;
+		break;
+	case SL_FAST_MATH:
+		if (_val)
+			mState |= _state;
+		else
+			mState &= ~_state;
+		break;
+	case SL_FIXED_POINT:
+		if (_val)
+			mState |= _state;
+		else
+			mState &= ~_state;
+		break;
 	case SL_COLOR_BUFFER:
 		break;
 	case SL_SHADE_FLAT:
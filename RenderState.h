@@ -7,6 +7,14 @@
 #define SL_SHADE_FLAT	0x0010
 #define SL_SHADE_SMOOTH	0x0020
 #define SL_DEPTH_TEST	0x0040
+// one of these engines at most, setting one clears the others
+#define SL_TILED		0x0080	// bin to screen tiles, scanned in parallel
+#define SL_BANDED		0x0100	// split into bands of scan lines, scanned in parallel
+#define SL_HALFSPACE	0x0200	// rasterize with edge functions instead of scan lines
+#define SL_HIZ			0x0400	// reject hidden triangles and spans by tiles, see _setupTriangle()
+#define SL_VISIBILITY	0x0800	// smooth shading lights each visible pixel once
+#define SL_FAST_MATH	0x1000	// approximate the lighting, see FastMath.h
+#define SL_FIXED_POINT	0x2000	// step unlit and flat shaded triangles in fixed point
 
 class CRenderState
 {
@@ -21,6 +29,13 @@ public:
 	inline bool isSmoothShading() const { return (mState & SL_LIGHTING) && (mState & SL_SHADE_SMOOTH); }
 	inline bool isLighting() const { return (mState&SL_LIGHTING) > 0; }
 	inline bool isBlending() const { return (mState&SL_BLENDING) > 0; }
+	inline bool isTiled() const { return (mState&SL_TILED) > 0; }
+	inline bool isBanded() const { return (mState&SL_BANDED) > 0; }
+	inline bool isHalfSpace() const { return (mState&SL_HALFSPACE) > 0; }
+	inline bool isHiZ() const { return (mState&SL_HIZ) > 0; }
+	inline bool isVisibility() const { return (mState&SL_VISIBILITY) > 0; }
+	inline bool isFastMath() const { return (mState&SL_FAST_MATH) > 0; }
+	inline bool isFixedPoint() const { return (mState&SL_FIXED_POINT) > 0; }
 	
 private:
 	int mState;
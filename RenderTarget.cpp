@@ -0,0 +1,185 @@
+#include "RenderTarget.h"
+#include <cstddef>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+//------------------------------------------------------------------------------
+// CRenderTarget
+//------------------------------------------------------------------------------
+unsigned int CRenderTarget::pixel(int _x, int _y)
+{
+	return reinterpret_cast<unsigned int*>(bits() + _y*bytesPerLine())[_x];
+}
+
+void CRenderTarget::setPixel(int _x, int _y, unsigned int _argb)
+{
+	reinterpret_cast<unsigned int*>(bits() + _y*bytesPerLine())[_x] = _argb;
+}
+
+void CRenderTarget::fill(unsigned int _argb)
+{
+	unsigned char *t_bits = bits();
+	if (!t_bits)
+		return;
+
+	int t_w = width(), t_h = height();
+	for (int y=0; y<t_h; ++y)
+	{
+		unsigned int *t_row = reinterpret_cast<unsigned int*>(t_bits + y*bytesPerLine());
+		for (int x=0; x<t_w; ++x)
+		{
+			t_row[x] = _argb;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+// CMemoryTarget
+//------------------------------------------------------------------------------
+CMemoryTarget::CMemoryTarget()
+: mWidth(0), mHeight(0), mStride(0), mBits(0)
+{
+}
+
+CMemoryTarget::CMemoryTarget(int _w, int _h)
+: mWidth(0), mHeight(0), mStride(0), mBits(0)
+{
+	resize(_w, _h);
+}
+
+void CMemoryTarget::resize(int _w, int _h)
+{
+	mWidth = _w;
+	mHeight = _h;
+	mStride = (_w*4 + ALIGNMENT-1) / ALIGNMENT * ALIGNMENT;
+
+	// align the first pixel inside the storage
+	mStorage.resize(mStride*_h + ALIGNMENT);
+	size_t t_base = reinterpret_cast<size_t>(&mStorage[0]);
+	size_t t_offset = (ALIGNMENT - t_base % ALIGNMENT) % ALIGNMENT;
+	mBits = &mStorage[0] + t_offset;
+}
+
+//------------------------------------------------------------------------------
+// CMappedTarget
+//------------------------------------------------------------------------------
+#ifdef _WIN32
+
+CMappedTarget::CMappedTarget()
+: mWidth(0), mHeight(0), mBits(0), mFile(INVALID_HANDLE_VALUE), mMapping(0)
+{
+}
+
+bool CMappedTarget::open(const char* _path, int _w, int _h)
+{
+	close();
+	if (_w <= 0 || _h <= 0)
+		return false;
+
+	DWORD t_size = DWORD(_w) * DWORD(_h) * 4;
+	mFile = CreateFileA(_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	// size the file before mapping it, a mapped file can't shrink
+	if (SetFilePointer(mFile, LONG(t_size), 0, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+		SetEndOfFile(mFile))
+	{
+		mMapping = CreateFileMappingA(mFile, 0, PAGE_READWRITE, 0, t_size, 0);
+		if (mMapping)
+			mBits = static_cast<unsigned char*>(MapViewOfFile(mMapping, FILE_MAP_WRITE, 0, 0, t_size));
+	}
+	if (!mBits)
+	{
+		close();
+		return false;
+	}
+	mWidth = _w;
+	mHeight = _h;
+	return true;
+}
+
+void CMappedTarget::close()
+{
+	if (mBits)
+		UnmapViewOfFile(mBits);
+	if (mMapping)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+	mBits = 0;
+	mMapping = 0;
+	mFile = INVALID_HANDLE_VALUE;
+	mWidth = mHeight = 0;
+}
+
+void CMappedTarget::flush()
+{
+	if (mBits)
+		FlushViewOfFile(mBits, 0);
+}
+
+#else
+
+CMappedTarget::CMappedTarget()
+: mWidth(0), mHeight(0), mBits(0), mFile(-1)
+{
+}
+
+bool CMappedTarget::open(const char* _path, int _w, int _h)
+{
+	close();
+	if (_w <= 0 || _h <= 0)
+		return false;
+
+	size_t t_size = size_t(_w) * size_t(_h) * 4;
+	mFile = ::open(_path, O_RDWR | O_CREAT, 0644);
+	if (mFile < 0)
+		return false;
+
+	if (ftruncate(mFile, off_t(t_size)) == 0)
+	{
+		void *t_map = mmap(0, t_size, PROT_READ | PROT_WRITE, MAP_SHARED, mFile, 0);
+		if (t_map != MAP_FAILED)
+			mBits = static_cast<unsigned char*>(t_map);
+	}
+	if (!mBits)
+	{
+		close();
+		return false;
+	}
+	mWidth = _w;
+	mHeight = _h;
+	return true;
+}
+
+void CMappedTarget::close()
+{
+	if (mBits)
+		munmap(mBits, size_t(mWidth) * size_t(mHeight) * 4);
+	if (mFile >= 0)
+		::close(mFile);
+	mBits = 0;
+	mFile = -1;
+	mWidth = mHeight = 0;
+}
+
+void CMappedTarget::flush()
+{
+	if (mBits)
+		msync(mBits, size_t(mWidth) * size_t(mHeight) * 4, MS_SYNC);
+}
+
+#endif
+
+CMappedTarget::~CMappedTarget()
+{
+	close();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+
+// 32-bit pixels are 0xAARRGGBB, the layout of QImage::Format_ARGB32
+#define SL_RGBA(r,g,b,a) ( (unsigned((a)&0xff)<<24) | (unsigned((r)&0xff)<<16) | \
+	(unsigned((g)&0xff)<<8) | unsigned((b)&0xff) )
+#define SL_RGB(r,g,b) SL_RGBA(r, g, b, 0xff)
+#define SL_RED(c)	(((c)>>16)&0xff)
+#define SL_GREEN(c)	(((c)>>8)&0xff)
+#define SL_BLUE(c)	((c)&0xff)
+#define SL_ALPHA(c)	(((c)>>24)&0xff)
+
+//////////////////////////////////////////////////////////////////////////
+// CRenderTarget: the image CScanLine draws into.
+//
+// A target gives its pixels as rows of 32-bit words through bits() and
+// bytesPerLine(), row 0 at the top. The pointer is fetched again at every
+// CScanLine::end(). A target that stores its pixels another way returns
+// 0 from bits() and overrides pixel(), setPixel() and fill().
+//////////////////////////////////////////////////////////////////////////
+class CRenderTarget
+{
+public:
+	virtual ~CRenderTarget() {}
+
+	virtual int width() const = 0;
+	virtual int height() const = 0;
+
+	virtual unsigned char* bits() = 0;
+	virtual int bytesPerLine() const = 0;
+
+	virtual unsigned int pixel(int _x, int _y);
+	virtual void setPixel(int _x, int _y, unsigned int _argb);
+	virtual void fill(unsigned int _argb);
+};
+
+//////////////////////////////////////////////////////////////////////////
+// CMemoryTarget: pixels in memory owned by the target. The first pixel
+// and every row start on a 64-byte boundary, for the vector span kernels.
+//////////////////////////////////////////////////////////////////////////
+class CMemoryTarget : public CRenderTarget
+{
+public:
+	enum { ALIGNMENT = 64 };
+
+	CMemoryTarget();
+	CMemoryTarget(int _w, int _h);
+
+	// the pixels are undefined afterwards
+	void resize(int _w, int _h);
+
+	int width() const { return mWidth; }
+	int height() const { return mHeight; }
+	unsigned char* bits() { return mBits; }
+	int bytesPerLine() const { return mStride; }
+
+private:
+	// no copies, mBits points into mStorage
+	CMemoryTarget(const CMemoryTarget&);
+	CMemoryTarget& operator=(const CMemoryTarget&);
+
+	int mWidth, mHeight;
+	int mStride;
+	std::vector<unsigned char> mStorage;
+	unsigned char *mBits;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// CMappedTarget: pixels in a file mapped to memory, so that another
+// process can read the frame, or it outlives this one. The file holds
+// height() rows of width() 32-bit pixels, top row first, and nothing else.
+//////////////////////////////////////////////////////////////////////////
+class CMappedTarget : public CRenderTarget
+{
+public:
+	CMappedTarget();
+	~CMappedTarget();
+
+	// create or resize the file _path to _w x _h pixels and map it.
+	// False if that fails, the target is then closed.
+	bool open(const char* _path, int _w, int _h);
+	void close();
+	bool isOpen() const { return mBits != 0; }
+	// write the pixels back to the file now
+	void flush();
+
+	int width() const { return mWidth; }
+	int height() const { return mHeight; }
+	unsigned char* bits() { return mBits; }
+	int bytesPerLine() const { return mWidth * 4; }
+
+private:
+	CMappedTarget(const CMappedTarget&);
+	CMappedTarget& operator=(const CMappedTarget&);
+
+	int mWidth, mHeight;
+	unsigned char *mBits;
+#ifdef _WIN32
+	void *mFile;		// HANDLE
+	void *mMapping;		// HANDLE
+#else
+	int mFile;
+#endif
+};
@@ -1,9 +1,27 @@
 #include "ScanLine.h"
-#include <QImage>
 #include <cmath>
+#include <cfloat>
+#include <cstdlib>
 #include <cassert>
+#include <algorithm>
 #include "Point3D.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SL_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled in on x86 and only used when cpuHasAvx2()
+#if defined(SL_USE_SSE2) && defined(__GNUC__)
+#define SL_USE_AVX2
+#define SL_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(SL_USE_SSE2) && defined(_MSC_VER) && _MSC_VER >= 1800
+#define SL_USE_AVX2
+#define SL_TARGET_AVX2
+#include <immintrin.h>
+#endif
+
 using std::fabs;
 using std::max;
 using std::min;
@@ -13,27 +31,64 @@ using trimeshVec::normalize;
 #define SATURATE(x) ( ((x)>255) ? 255 : (((x)<0) ? 0 : x) )
 #define ROUND(x) int((x)+0.5)
 #define DEFAULT_COLOR Color4u(255, 255, 255, 255)
+// triangles are clipped to this many pixels around the screen
+#define CLIP_GUARD_BAND 4096
+// the outcodes, in the order the planes are clipped
+#define CLIP_NEAR	0x01
+#define CLIP_FAR	0x02
+#define CLIP_LEFT	0x04	// of the guard band
+#define CLIP_RIGHT	0x08
+#define CLIP_BOTTOM	0x10
+#define CLIP_TOP	0x20
+// the edge functions of SL_HALFSPACE fit in 32 bits inside this range
+#define HS_GUARD_BAND 8192
+// a light adds less than this to a color channel beyond its radius
+#define LIGHT_CUTOFF (0.5/255)
+// SL_FIXED_POINT: x in 16.16 holds this range with a bit to spare
+#define FX_GUARD_BAND 16384
+// and any color a span reaches, with its differences
+#define FX_COLOR_RANGE 32.0
 
 #define DISABLE_STATE(state,pro) {(state) &= ~(pro);} 
 #define EABLE_STATE(state,pro) {(state) |= (pro);} 
 
+// _v in fixed point with _one for 1.0, rounded
+static inline int sl_fixed(double _v, double _one)
+{
+	return int(std::floor(_v * _one + 0.5));
+}
+
+// scale _v to unit length, returns its old length
+static inline double sl_normalize(Vec3d& _v, bool _fast)
+{
+	double t_len2 = _v DOT _v;
+	if (!_fast)
+	{
+		double t_len = std::sqrt(t_len2);
+		_v /= t_len;
+		return t_len;
+	}
+	double t_inv = fm_rsqrt(t_len2);
+	_v *= t_inv;
+	return t_len2 * t_inv;
+}
+
 //////////////////////////////////////////////////////////////////////////
 CScanLine::CScanLine()
-: mType(SL_NONE), mMaxY(-1)
-, mbInitialised(false)
+: mbInitialised(false)
 , mbHasNormals(true)
+, mMaxY(-1), mType(SL_NONE)
 {
 	_init();
 }
 
-CScanLine::CScanLine(int _w, int _h, QImage* _img)
-: mType(SL_NONE), mMaxY(-1), mCurY(_h-1)
-, mHeight(_h), mWidth(_w), mImg(_img)
-, mZBuffer(_h*_w, 1.0)
-, mbInitialised(true)
+CScanLine::CScanLine(CRenderTarget* _target)
+: mbInitialised(false)
 , mbHasNormals(true)
+, mMaxY(-1), mType(SL_NONE)
 {
 	_init();
+	setRenderTarget(_target);
 }
 
 void CScanLine::_init()
@@ -47,17 +102,37 @@ void CScanLine::_init()
 	mCurNormal[1] = 0;
 	mCurNormal[2] = 0;
 
+	mTarget = 0;
+	mVertexPtr = 0;
+	mNormalPtr = 0;
+	mColorPtr = 0;
+	mVertexStride = mNormalStride = mColorStride = 0;
+	mColorSize = 4;
+	mbColorPerPrimitive = false;
+	mVertexStamp = 0;
+
+	mSpanFill = spanFillFunc();
+	mFixedSpanFill = fixedSpanFillFunc();
+	mbFixedPoint = false;
+	mFrameBits = 0;
+	mFrameStride = 0;
+
+	mbDeferred = false;
+	mVisMinY = 0;
+	mVisMaxY = -1;
+
 	mGlobalAmbient = Color4d(0.1, 0.1, 0.1, 1.0);
-	
+	mLights.assign(1, Light());
+	mLightTilesX = 0;
 }
 
-void CScanLine::setRenderTarget(int _w, int _h, QImage *_img)
+void CScanLine::setRenderTarget(CRenderTarget *_target)
 {
-	mCurY = _h-1;
-	mWidth = _w;
-	mHeight = _h;
-	mImg = _img;
-	mZBuffer.assign(_w*_h, 1.0);
+	mTarget = _target;
+	mWidth = _target->width();
+	mHeight = _target->height();
+	mCurY = mHeight-1;
+	_clearDepth(1.0);
 
 	mbInitialised = true;
 }
@@ -69,52 +144,39 @@ CScanLine::~CScanLine(void)
 
 void CScanLine::_clear()
 {
-	ETableIterator it = mSortedET.begin();
-	ETableIterator it_end = mSortedET.end();
-	for (; it!=it_end; ++it)
-	{
-		EListIterator itl = it->second.begin();
-		EListIterator itl_end = it->second.end();
-		for (; itl!=itl_end; ++itl )
-		{
-			SAFE_DELETE(*itl);
-		}
-	}
-
-	TArrayItor itt = mTriArray.begin();
-	TArrayItor itt_end = mTriArray.end();
-	for (; itt!=itt_end; ++itt)
-	{
-		SAFE_DELETE(*itt);
-	}
-
-	VBufferItor itv = mVertexBuffer.begin();
-	VBufferItor itv_end = mVertexBuffer.end();
-	for (; itv!=itv_end; ++itv)
-	{
-		SAFE_DELETE(*itv);
-	}
+	// the containers keep their capacity, so nothing here frees memory
+	mTriPool.reset();
 
+	mEdges.clear();
 	mSortedET.clear();
 	mTriArray.clear();
 	mAEL.clear();
+	mAENew.clear();
 
 	mVertexBuffer.clear();
+	mIndexBuffer.clear();
 }
 
 void CScanLine::clear(int _target, const Color4u& _c /* = Color4u */, double _depth /* = 1.0 */)
 {
 	if (_target & SL_COLOR_BUFFER)
 	{
-		mImg->fill(qRgba(_c[0], _c[1], _c[2], _c[3]));
+		mTarget->fill(SL_RGBA(_c[0], _c[1], _c[2], _c[3]));
 	}
 	if (_target & SL_DEPTH_BUFFER)
 	{
 		// z buffer reassignment
-		mZBuffer.assign(mWidth*mHeight, _depth);
+		_clearDepth(_depth);
 	}
 }
 
+void CScanLine::_clearDepth(double _depth)
+{
+	mZBuffer.assign(mWidth*mHeight, _depth);
+	mHiZ.assign(mWidth, mHeight, mZBuffer.quantize(_depth * mZBuffer.scale()));
+	mDepthPyramid.clear();
+}
+
 void CScanLine::begin(TargetType _type)
 {
 	if (!mbInitialised) return;
@@ -129,12 +191,46 @@ void CScanLine::begin(TargetType _type)
 //------------------------------------------------------------------------------
 // Vertices
 //------------------------------------------------------------------------------
+void CScanLine::VertexBuffer::clear()
+{
+	resize(0);
+}
+
+void CScanLine::VertexBuffer::resize(int _n)
+{
+	x.resize(_n); y.resize(_n); z.resize(_n); w.resize(_n);
+	sx.resize(_n); sy.resize(_n); sz.resize(_n); sw.resize(_n);
+	r.resize(_n); g.resize(_n); b.resize(_n); a.resize(_n);
+	nx.resize(_n); ny.resize(_n); nz.resize(_n);
+	clip.resize(_n);
+}
+
+void CScanLine::VertexBuffer::push_back(const Vec4d& _pos, const Color4d& _clr, const Normald& _nor)
+{
+	int i = size();
+	resize(i+1);
+	x[i] = _pos[0]; y[i] = _pos[1]; z[i] = _pos[2]; w[i] = _pos[3];
+	setColor(i, _clr);
+	nx[i] = _nor[0]; ny[i] = _nor[1]; nz[i] = _nor[2];
+}
+
+int CScanLine::VertexBuffer::push_lerp(int _i, int _j, double _t)
+{
+	int k = size();
+	resize(k+1);
+	std::vector<double>* t_attribs[] = { &x, &y, &z, &w, &r, &g, &b, &a, &nx, &ny, &nz };
+	for (int n=0; n<11; ++n)
+	{
+		std::vector<double> &v = *t_attribs[n];
+		v[k] = v[_i] + _t * (v[_j] - v[_i]);
+	}
+	clip[k] = 0;
+	return k;
+}
+
 void CScanLine::vertex3d(double _x, double _y, double _z)
 {
-	Vertex *t_pv = new Vertex(_x, _y, _z, 1);
-	t_pv->color = mCurColor;
-	t_pv->normalWorld = mCurNormal;
-	mVertexBuffer.push_back(t_pv);
+	mVertexBuffer.push_back(Vec4d(_x, _y, _z, 1), mCurColor, mCurNormal);
 }
 
 void CScanLine::vertex3dv(const Vec3d& v)
@@ -199,21 +295,361 @@ void CScanLine::normal3fv(const CPoint3D& _n)
 	mCurNormal[2] = _n.z;
 }
 
-//void CScanLine::setLight(const Light& light)
-//{
-//	if (mLights.empty()) 
-//		mLights.push_back(light);
-//	else 
-//		mLights[0] = light;
-//
-//	mLights.back().direction.norm();
-//}
+//------------------------------------------------------------------------------
+// Vertex arrays
+//------------------------------------------------------------------------------
+void CScanLine::vertexPointer(int _stride, const float* _pointer)
+{
+	mVertexStride = _stride ? _stride : 3*sizeof(float);
+	mVertexPtr = _pointer;
+}
+
+void CScanLine::normalPointer(int _stride, const float* _pointer)
+{
+	mNormalStride = _stride ? _stride : 3*sizeof(float);
+	mNormalPtr = _pointer;
+}
+
+void CScanLine::colorPointer(int _size, int _stride, const unsigned char* _pointer, 
+							 bool _perPrimitive /* = false */)
+{
+	assert(_size==3 || _size==4);
+	mColorSize = _size;
+	mColorStride = _stride ? _stride : _size;
+	mColorPtr = _pointer;
+	mbColorPerPrimitive = _perPrimitive;
+}
+
+void CScanLine::drawElements(TargetType _type, int _count, const unsigned int* _vindices, 
+							 const unsigned int* _nindices /* = 0 */, int _istride /* = 0 */)
+{
+	if (!mbInitialised || !mVertexPtr || _count<=0) return;
+
+	begin(_type);
+	_fetchElements(_count, _vindices, _nindices, _istride);
+	end();
+}
+
+void CScanLine::_fetchElements(int _count, const unsigned int* _vindices, 
+							   const unsigned int* _nindices, int _istride)
+{
+	// indices per primitive, strips are a single packed run
+	int t_group = _count;
+	if (mType == SL_TRIANGLES)
+		t_group = 3;
+	else if (mType == SL_QUADS)
+		t_group = 4;
+	if (_istride == 0)
+		_istride = t_group * sizeof(unsigned int);
+
+	const char *t_vbase = reinterpret_cast<const char*>(mVertexPtr);
+	const char *t_nbase = reinterpret_cast<const char*>(mNormalPtr);
+	const char *t_vibase = reinterpret_cast<const char*>(_vindices);
+	const char *t_nibase = reinterpret_cast<const char*>(_nindices ? _nindices : _vindices);
+
+	// a vertex shared by several corners is fetched once, and so is
+	// transformed and lit once. The color follows the vertex index, so
+	// (vindex, nindex) identifies a vertex completely. Colors by primitive
+	// are not shared, each corner is a vertex of its own.
+	// The table has an entry per source vertex and is not cleared, the
+	// entries of earlier draws have an older stamp.
+	bool t_shared = !(mColorPtr && mbColorPerPrimitive);
+	VertexCacheEntry t_empty = { 0, 0, -1, -1 };
+	if (++mVertexStamp == 0)
+	{
+		std::fill(mVertexCache.begin(), mVertexCache.end(), t_empty);
+		mVertexStamp = 1;
+	}
+	mVertexCacheMore.clear();
+
+	VertexBuffer &vb = mVertexBuffer;
+	vb.resize(_count);	// upper bound, shrunk below
+	mIndexBuffer.resize(_count);
+	int k = 0;
+	int n = 0;
+	for (int p=0; n<_count; ++p)
+	{
+		const unsigned int *t_vi = reinterpret_cast<const unsigned int*>(t_vibase + p*_istride);
+		const unsigned int *t_ni = reinterpret_cast<const unsigned int*>(t_nibase + p*_istride);
+		for (int j=0; j<t_group && n<_count; ++j, ++n)
+		{
+			if (t_shared)
+			{
+				// look up the cache, then the other normals of the vertex
+				if (t_vi[j] >= mVertexCache.size())
+					mVertexCache.resize(max(size_t(t_vi[j]) + 1, 2*mVertexCache.size()), t_empty);
+				VertexCacheEntry *t_e = &mVertexCache[t_vi[j]];
+				if (t_e->stamp != mVertexStamp)
+				{
+					VertexCacheEntry t_new = { mVertexStamp, t_ni[j], k, -1 };
+					*t_e = t_new;
+				}
+				else
+				{
+					while (t_e->nindex != t_ni[j] && t_e->next >= 0)
+						t_e = &mVertexCacheMore[t_e->next];
+					if (t_e->nindex == t_ni[j])
+					{
+						mIndexBuffer[n] = t_e->slot;
+						continue;
+					}
+					VertexCacheEntry t_new = { mVertexStamp, t_ni[j], k, -1 };
+					t_e->next = int(mVertexCacheMore.size());
+					mVertexCacheMore.push_back(t_new);
+				}
+			}
+			mIndexBuffer[n] = k;
+
+			const float *t_pos = reinterpret_cast<const float*>(t_vbase + t_vi[j]*mVertexStride);
+			vb.x[k] = t_pos[0];
+			vb.y[k] = t_pos[1];
+			vb.z[k] = t_pos[2];
+			vb.w[k] = 1;
+
+			if (mNormalPtr)
+			{
+				const float *t_nor = reinterpret_cast<const float*>(t_nbase + t_ni[j]*mNormalStride);
+				vb.nx[k] = t_nor[0];
+				vb.ny[k] = t_nor[1];
+				vb.nz[k] = t_nor[2];
+			}
+			else
+			{
+				vb.nx[k] = mCurNormal[0];
+				vb.ny[k] = mCurNormal[1];
+				vb.nz[k] = mCurNormal[2];
+			}
+
+			if (mColorPtr)
+			{
+				const unsigned char *t_clr = mColorPtr + 
+					(mbColorPerPrimitive ? p : t_vi[j])*mColorStride;
+				vb.r[k] = t_clr[0]/255.0;
+				vb.g[k] = t_clr[1]/255.0;
+				vb.b[k] = t_clr[2]/255.0;
+				vb.a[k] = (mColorSize == 4) ? t_clr[3]/255.0 : 1.0;
+			}
+			else
+			{
+				vb.setColor(k, mCurColor);
+			}
+			++k;
+		}
+	}
+	vb.resize(k);
+}
+
+//------------------------------------------------------------------------------
+// Lights
+//------------------------------------------------------------------------------
+int CScanLine::addLight(const Light& _light)
+{
+	mLights.push_back(_light);
+	return int(mLights.size()) - 1;
+}
+
+void CScanLine::setLight(int _i, const Light& _light)
+{
+	mLights[_i] = _light;
+}
+
+void CScanLine::clearLights()
+{
+	mLights.clear();
+}
+
+// the distance at which _light adds _cutoff to a channel at most, with
+// colors and materials up to 1. DBL_MAX if it never fades that much.
+static double sl_lightRadius(const Light& _light, const Color4d& _specular, double _cutoff)
+{
+	double t_max = 0;
+	for (int i=0; i<3; ++i)
+	{
+		t_max = max(t_max, _light.ambient[i] + _light.diffuse[i] + 
+			_light.specular[i] * _specular[i]);
+	}
+
+	// solve a0 + a1*d + a2*d^2 = t_max / _cutoff
+	double a0 = _light.attenuation0, a1 = _light.attenuation1, a2 = _light.attenuation2;
+	double t_k = t_max / _cutoff;
+	if (a1 < 0 || a2 < 0 || (a1 == 0 && a2 == 0))
+		return DBL_MAX;
+	if (a0 >= t_k)
+		return 0;
+	if (a2 == 0)
+		return (t_k - a0) / a1;
+	return (-a1 + std::sqrt(a1*a1 - 4*a2*(a0 - t_k))) / (2*a2);
+}
+
+void CScanLine::_setupLights()
+{
+	bool t_fast = mRenderState.isFastMath();
+	int t_num = int(mLights.size());
+	mLightSetup.resize(t_num);
+	mActiveLights.clear();
+
+	// the spheres the lights reach, center and radius
+	std::vector<Vec4d> t_center(t_num);
+	std::vector<double> t_reach(t_num, DBL_MAX);
+	for (int i=0; i<t_num; ++i)
+	{
+		const Light &light = mLights[i];
+		LightSetup &t_setup = mLightSetup[i];
+		t_setup.radius = DBL_MAX;
+		t_setup.cosCutoff = -2.0;
+		if (light.type == SL_LIGHT_NONE)
+			continue;
+		mActiveLights.push_back(i);
+
+		if (light.type == SL_LIGHT_DIRECTIONAL)
+		{
+			t_setup.dir = -light.direction;
+			sl_normalize(t_setup.dir, t_fast);
+			continue;
+		}
+
+		t_setup.radius = sl_lightRadius(light, mMaterial.specular, LIGHT_CUTOFF);
+		t_center[i] = light.position;
+		t_reach[i] = t_setup.radius;
+		if (light.type == SL_LIGHT_SPOT)
+		{
+			t_setup.dir = light.direction;
+			sl_normalize(t_setup.dir, false);
+			if (light.spot_falloff < 180)
+			{
+				double t_angle = light.spot_falloff * (3.14159265358979 / 180);
+				t_setup.cosCutoff = std::cos(t_angle);
+				// a narrow cone fits in the sphere through its apex and
+				// its rim, which is smaller than the one around the apex
+				double t_cos = max(t_setup.cosCutoff, 0.0);
+				if (t_reach[i] < DBL_MAX && 2*t_cos > 1)
+				{
+					double t_r = t_reach[i] / (2*t_cos);
+					t_center[i] = light.position + Vec4d(t_setup.dir[0]*t_r, 
+						t_setup.dir[1]*t_r, t_setup.dir[2]*t_r, 0);
+					t_reach[i] = t_r;
+				}
+			}
+		}
+	}
+
+	// only the pixels of smooth shading look up their tile
+	if (!mRenderState.isSmoothShading())
+		return;
+
+	mLightTilesX = (mWidth + TILE_SIZE - 1) / TILE_SIZE;
+	int t_tilesY = (mHeight + TILE_SIZE - 1) / TILE_SIZE;
+	mTileLights.resize(mLightTilesX * t_tilesY);
+	for (size_t i=0; i<mTileLights.size(); ++i)
+	{
+		mTileLights[i].clear();
+	}
+
+	const Mat44d &m = mCamera.matrix();
+	double t_hw = mWidth*0.5, t_hh = mHeight*0.5;
+	for (size_t k=0; k<mActiveLights.size(); ++k)
+	{
+		int i = mActiveLights[k];
+		int t_x0 = 0, t_y0 = 0, t_x1 = mWidth-1, t_y1 = mHeight-1;
+		if (t_reach[i] < DBL_MAX)
+		{
+			// project the box around the sphere. It covers the screen if 
+			// it reaches behind the eye.
+			double t_minX = DBL_MAX, t_maxX = -DBL_MAX;
+			double t_minY = DBL_MAX, t_maxY = -DBL_MAX;
+			bool t_behind = false;
+			for (int c=0; c<8 && !t_behind; ++c)
+			{
+				double x = t_center[i][0] + ((c&1) ? t_reach[i] : -t_reach[i]);
+				double y = t_center[i][1] + ((c&2) ? t_reach[i] : -t_reach[i]);
+				double z = t_center[i][2] + ((c&4) ? t_reach[i] : -t_reach[i]);
+				double t_w = m[3][0]*x + m[3][1]*y + m[3][2]*z + m[3][3];
+				if (t_w <= DBL_EPSILON)
+				{
+					t_behind = true;
+					break;
+				}
+				double t_sx = (m[0][0]*x + m[0][1]*y + m[0][2]*z + m[0][3]) / t_w;
+				double t_sy = (m[1][0]*x + m[1][1]*y + m[1][2]*z + m[1][3]) / t_w;
+				t_minX = min(t_minX, t_sx);
+				t_maxX = max(t_maxX, t_sx);
+				t_minY = min(t_minY, t_sy);
+				t_maxY = max(t_maxY, t_sy);
+			}
+			if (!t_behind)
+			{
+				// a pixel further than the rounding of the vertices
+				t_minX = (t_minX+1)*t_hw - 1;
+				t_maxX = (t_maxX+1)*t_hw + 1;
+				t_minY = (t_minY+1)*t_hh - 1;
+				t_maxY = (t_maxY+1)*t_hh + 1;
+				if (t_maxX < 0 || t_maxY < 0 || t_minX >= mWidth || t_minY >= mHeight)
+					continue;
+				t_x0 = int(max(t_minX, 0.0));
+				t_x1 = int(min(t_maxX, mWidth-1.0));
+				t_y0 = int(max(t_minY, 0.0));
+				t_y1 = int(min(t_maxY, mHeight-1.0));
+			}
+		}
+
+		for (int ty = t_y0/TILE_SIZE; ty <= t_y1/TILE_SIZE; ++ty)
+		{
+			for (int tx = t_x0/TILE_SIZE; tx <= t_x1/TILE_SIZE; ++tx)
+			{
+				mTileLights[ty*mLightTilesX + tx].push_back(i);
+			}
+		}
+	}
+}
 
 void CScanLine::end()
 {
+	// nothing to draw to, see setRenderTarget()
+	if (!mTarget)
+		return;
+
+	// before any lighting, the shading threads only read the table
+	// and the lights
+	if (mRenderState.isFastMath())
+		mSpecularPow.setExponent(mMaterial.shiness);
+	if (mRenderState.isLighting())
+		_setupLights();
+
 	_modelViewProjectionTransform();
-	//_normalizeDeviceCoordinates();
+	_clipCodes();
+	_normalizeDeviceCoordinates();
 	_screenCoordinates();
+
+	// fetch the pixels once here: the spans write 32-bit pixels directly,
+	// and SL_TILED and SL_BANDED write from several threads
+	mFrameBits = mTarget->bits();
+	mFrameStride = mTarget->bytesPerLine();
+
+	// SL_VISIBILITY only pays with per pixel lighting. Blending depends on
+	// the order of the fragments, so it is shaded directly.
+	mbDeferred = mRenderState.isVisibility() && 
+		mRenderState.isSmoothShading() && !mRenderState.isBlending();
+	if (mbDeferred && int(mVisBuffer.size()) != mWidth*mHeight)
+	{
+		VisSample t_empty = { -1, 0, 0 };
+		mVisBuffer.assign(mWidth*mHeight, t_empty);
+	}
+	mVisMinY = mHeight;
+	mVisMaxY = -1;
+
+	// the fixed point kernel writes the 32-bit pixels only
+	mbFixedPoint = mRenderState.isFixedPoint() && 
+		!mRenderState.isSmoothShading() && mFrameBits;
+
+	// vertices given one by one are used once, in order
+	if (mIndexBuffer.empty())
+	{
+		int v_num = mVertexBuffer.size();
+		mIndexBuffer.resize(v_num);
+		for (int i=0; i<v_num; ++i)
+			mIndexBuffer[i] = i;
+	}
+
 	switch (mType)
 	{
 	case SL_TRIANGLES:
@@ -250,121 +686,309 @@ void CScanLine::end()
 		break;
 	}
 
-	_scanLine();
+	if (mRenderState.isTiled())
+		_scanTiles();
+	else if (mRenderState.isBanded())
+		_scanBands();
+	else
+		_scanLine();
+
+	if (mbDeferred)
+		_resolveVisibility();
 
 	mType = SL_NONE;
 }
 
 void CScanLine::_addTriangles()
 {
-	int v_num = mVertexBuffer.size()/3;
+	const IndexBuffer &ib = mIndexBuffer;
+	int v_num = ib.size()/3;
 	for (int i=0; i<v_num; ++i)
 	{
-		Vertex *t_v1 = mVertexBuffer[3*i];
-		Vertex *t_v2 = mVertexBuffer[3*i+1];
-		Vertex *t_v3 = mVertexBuffer[3*i+2];
-		
-		_addATriangle(t_v1, t_v2, t_v3);
+		_addATriangle(ib[3*i], ib[3*i+1], ib[3*i+2]);
+	}
+}
+
+void CScanLine::_addATriangle(int _v1, int _v2, int _v3)
+{
+	const VertexBuffer &vb = mVertexBuffer;
+
+	// all outside one plane
+	if (vb.clip[_v1] & vb.clip[_v2] & vb.clip[_v3])
+		return;
+
+	// crossing one, its screen coordinates may not even exist
+	int t_planes = vb.clip[_v1] | vb.clip[_v2] | vb.clip[_v3];
+	if (t_planes)
+	{
+		_clipTriangle(_v1, _v2, _v3, t_planes);
+		return;
+	}
+	_setupTriangle(_v1, _v2, _v3);
+}
+
+void CScanLine::_clipTriangle(int _v1, int _v2, int _v3, int _planes)
+{
+	// the corners in clip space, the vertices only keep their screen position
+	struct ClipVertex
+	{
+		int v;
+		Vec4d pos;
+	};
+
+	// the planes, positive inside, and the coordinate of clip space they
+	// cut at a value of x/w
+	double t_gx = 1.0 + CLIP_GUARD_BAND / (mWidth*0.5);
+	double t_gy = 1.0 + CLIP_GUARD_BAND / (mHeight*0.5);
+	int t_axis = 0;
+	double t_at = 0;
+	auto t_distance = [&](const Vec4d& _p) -> double {
+		return (t_at < 0) ? _p[t_axis] - t_at*_p[3] : t_at*_p[3] - _p[t_axis];
+	};
+
+	// Sutherland-Hodgman, each plane adds one corner at most
+	VertexBuffer &vb = mVertexBuffer;
+	ClipVertex t_poly[2][9];
+	int t_in = 0, t_n = 3;
+	int t_first = vb.size();
+	int t_v[3] = { _v1, _v2, _v3 };
+	for (int i=0; i<3; ++i)
+	{
+		t_poly[0][i].v = t_v[i];
+		t_poly[0][i].pos = _clipPosition(t_v[i]);
+	}
+	for (int t_plane = CLIP_NEAR; t_plane <= CLIP_TOP; t_plane <<= 1)
+	{
+		if (!(_planes & t_plane))
+			continue;
+
+		switch (t_plane)
+		{
+		case CLIP_NEAR: t_axis = 2; t_at = -1; break;
+		case CLIP_FAR: t_axis = 2; t_at = 1; break;
+		case CLIP_LEFT: t_axis = 0; t_at = -t_gx; break;
+		case CLIP_RIGHT: t_axis = 0; t_at = t_gx; break;
+		case CLIP_BOTTOM: t_axis = 1; t_at = -t_gy; break;
+		default: t_axis = 1; t_at = t_gy; break;
+		}
+
+		const ClipVertex *t_src = t_poly[t_in];
+		ClipVertex *t_dst = t_poly[1-t_in];
+		int t_m = 0;
+		for (int i=0; i<t_n; ++i)
+		{
+			// from the lower index, so that the neighbor gets the same corner
+			const ClipVertex *c1 = &t_src[i], *c2 = &t_src[(i+1) % t_n];
+			double d1 = t_distance(c1->pos), d2 = t_distance(c2->pos);
+			if (d1 >= 0)
+				t_dst[t_m++] = *c1;
+			if ((d1 >= 0) == (d2 >= 0))
+				continue;
+			if (c1->v > c2->v)
+			{
+				std::swap(c1, c2);
+				std::swap(d1, d2);
+			}
+
+			ClipVertex &t_new = t_dst[t_m++];
+			double t = d1 / (d1 - d2);
+			t_new.pos = c1->pos + t * (c2->pos - c1->pos);
+			// the spans interpolate linearly on the screen, so the other
+			// values are taken where the corner is on the screen. Behind
+			// the eye the screen makes no sense.
+			double s = t;
+			if (t_plane != CLIP_NEAR)
+			{
+				double t_s1 = c1->pos[t_axis] / c1->pos[3];
+				double t_s2 = c2->pos[t_axis] / c2->pos[3];
+				s = (t_at - t_s1) / (t_s2 - t_s1);
+			}
+			t_new.v = vb.push_lerp(c1->v, c2->v, s);
+		}
+		t_n = t_m;
+		t_in = 1 - t_in;
+		if (t_n < 3)
+			return;
+	}
+
+	const ClipVertex *t_p = t_poly[t_in];
+	for (int i=0; i<t_n; ++i)
+	{
+		int k = t_p[i].v;
+		if (k < t_first)
+			continue;
+		vb.sx[k] = t_p[i].pos[0];
+		vb.sy[k] = t_p[i].pos[1];
+		vb.sz[k] = t_p[i].pos[2];
+		vb.sw[k] = t_p[i].pos[3];
+		_projectVertex(k);
+	}
+	for (int i=1; i+1<t_n; ++i)
+	{
+		_setupTriangle(t_p[0].v, t_p[i].v, t_p[i+1].v);
 	}
 }
 
-void CScanLine::_addATriangle(const Vertex *_v1, const Vertex *_v2, const Vertex *_v3)
+void CScanLine::_setupTriangle(int _v1, int _v2, int _v3)
 {
+	const VertexBuffer &vb = mVertexBuffer;
+
+	int t_minY = min(vb.sy[_v3], min(vb.sy[_v1], vb.sy[_v2]));
+	int t_maxY = max(vb.sy[_v3], max(vb.sy[_v1], vb.sy[_v2]));
+	if (t_maxY<0 || t_minY>=mHeight) // no scan line to fill
+		return;
+
+	// nor a column. The spans may reach one pixel left of the box.
+	int t_minX = min(vb.sx[_v3], min(vb.sx[_v1], vb.sx[_v2]));
+	int t_maxX = max(vb.sx[_v3], max(vb.sx[_v1], vb.sx[_v2]));
+	if (t_maxX<0 || t_minX>mWidth)
+		return;
+
 	// on x-z face, skip
-	if (_v1->posScreen[1] == _v2->posScreen[1] && _v1->posScreen[1] == _v3->posScreen[1]) 
+	if (vb.sy[_v1] == vb.sy[_v2] && vb.sy[_v1] == vb.sy[_v3]) 
 		return;
 
-	Normald t_nor = (_v2->posScreen - _v1->posScreen) CROSS (_v3->posScreen - _v1->posScreen);
+	Vec3d t_p1 = vb.posScreen(_v1);
+	Normald t_nor = (vb.posScreen(_v2) - t_p1) CROSS (vb.posScreen(_v3) - t_p1);
 	if (t_nor[2]<0) // back cull, faster
 		return;
 
-	Triangle *tri = new Triangle;
+	// the nearest of its pixels, allowing for a span to run a pixel past
+	// the edges. Edge on triangles get no bound.
+	double t_zNear = -DBL_MAX;
+	if (t_nor[2]>0)
+	{
+		t_zNear = min(vb.sz[_v3], min(vb.sz[_v1], vb.sz[_v2]));
+		t_zNear -= (fabs(t_nor[0]) + fabs(t_nor[1])) / t_nor[2];
+		t_zNear *= mZBuffer.scale();
+	}
+	// a span may start one pixel left of the box by rounding. Scan lines
+	// are filled after all the triangles are set up, so this only sees the
+	// earlier draws, except with SL_HALFSPACE which fills each triangle
+	// here. The spans are clipped by tiles as they are filled, and SL_TILED
+	// tests each triangle again per tile, after the ones before it.
+	if (mRenderState.isHiZ() && 
+		mHiZ.isOccluded(t_minX-1, t_minY, t_maxX+1, t_maxY, t_zNear))
+		return;
+
+	if (mbDeferred)
+	{
+		mVisMinY = min(mVisMinY, max(t_minY, 0));
+		mVisMaxY = max(mVisMaxY, min(t_maxY, mHeight-1));
+	}
+
+	if (mRenderState.isHalfSpace())
+	{
+		_rasterizeTriangle(_v1, _v2, _v3);
+		return;
+	}
+
+	Triangle *tri = new (mTriPool.alloc()) Triangle;
 	tri->normal = t_nor;
-	tri->d = -(tri->normal DOT _v1->posScreen);
-	int t_minY = min(_v3->posScreen[1], min(_v1->posScreen[1], _v2->posScreen[1]));
-	int t_maxY = max(_v3->posScreen[1], max(_v1->posScreen[1], _v2->posScreen[1]));
+	tri->d = -(tri->normal DOT t_p1);
 	tri->dy = t_maxY - t_minY;
+	tri->minX = t_minX;
+	tri->maxX = t_maxX;
+	tri->minY = t_minY;
+	tri->maxY = t_maxY;
+	tri->zNear = t_zNear;
+	if (mbDeferred)
+		_setupBarycentrics(*tri, _v1, _v2, _v3);
 
 	int t_id = mTriArray.size();
-	_addEdge(_v1, _v2, t_id);
-	_addEdge(_v2, _v3, t_id);
-	_addEdge(_v3, _v1, t_id);
+	tri->edge = mEdges.size();
+	_addEdge(_v1, _v2, t_id, t_maxY);
+	_addEdge(_v2, _v3, t_id, t_maxY);
+	_addEdge(_v3, _v1, t_id, t_maxY);
+	tri->nEdges = mEdges.size() - tri->edge;
+	tri->fixed = mbFixedPoint && _setupFixedPoint(*tri, _v1, _v2, _v3);
 
 	mTriArray.push_back(tri);
 }
 
-bool CScanLine::_addEdge(const Vertex* _v1, const Vertex* _v2, int _id)
+bool CScanLine::_addEdge(int _v1, int _v2, int _id, int _maxY)
 {
 	assert(_id==mTriArray.size());
 
-	if (_v1->posScreen[1] == _v2->posScreen[1])
+	const VertexBuffer &vb = mVertexBuffer;
+	if (vb.sy[_v1] == vb.sy[_v2])
 		return false;
 
-	// clipping		
+	// the triangle is clipped to the guard band, see _addATriangle()
 
 	// swap, so that y coordinates are sorted decreasingly
-	if (_v1->posScreen[1] < _v2->posScreen[1])
+	if (vb.sy[_v1] < vb.sy[_v2])
 	{
-		const Vertex *t_v = _v1; 
-		_v1 = _v2;
-		_v2 = t_v;
+		std::swap(_v1, _v2);
 	}
 
+	// the edge ends below the first scan line, or it hands off to the
+	// upper edge of the triangle right at the first scan line
+	int t_y1 = vb.sy[_v1];
+	int t_y2 = vb.sy[_v2];
+	if (t_y1<0 || (t_y1==0 && t_y2<0 && t_y1!=_maxY))
+		return false;
+	if (t_y2>=mHeight)
+		return false;
+
 	// create edge
-	Edge *edge = new Edge;
+	mEdges.push_back(Edge());
+	Edge *edge = &mEdges.back();
 	edge->id = _id;
+	edge->y = t_y2;
 
-	edge->dy = _v1->posScreen[1] - _v2->posScreen[1];
-	edge->x = _v2->posScreen[0];
-	edge->dx = (_v1->posScreen[0] - _v2->posScreen[0]) * 1.0 / edge->dy;
+	edge->dy = t_y1 - t_y2;
+	edge->x = vb.sx[_v2];
+	edge->dx = (vb.sx[_v1] - vb.sx[_v2]) * 1.0 / edge->dy;
 	
 	//color 
-	const Color4d &c1 = _v1->color;
-	const Color4d &c2 = _v2->color;
-	edge->color = c2;
-	edge->dclr = (c1 - c2);
+	edge->color = vb.color(_v2);
+	edge->dclr = (vb.color(_v1) - edge->color);
 	edge->dclr /= 1.0 * edge->dy;
 
 	// position in world space
-	const Vec4d &p1 = _v1->posWorld;
-	const Vec4d &p2 = _v2->posWorld;
-	edge->posW = p2;	
-	edge->dPosW = (p1 - p2);
+	edge->posW = vb.posWorld(_v2);
+	edge->dPosW = (vb.posWorld(_v1) - edge->posW);
 	edge->dPosW /= 1.0 * edge->dy;
 
 	// normal in world space
 	if (mRenderState.isLighting())
 	{
-		const Normald &n1 = _v1->normalWorld;
-		const Normald &n2 = _v2->normalWorld;
-		edge->normalW = n2;
-		edge->dNorW = (n1 - n2);
+		edge->normalW = vb.normalWorld(_v2);
+		edge->dNorW = (vb.normalWorld(_v1) - edge->normalW);
 		edge->dNorW /= 1.0 * edge->dy;
 	}
 
-	// add new edge
-	mSortedET[_v2->posScreen[1]].push_back(edge);
+	// start from the first scan line if the edge begins below it
+	if (edge->y < 0)
+	{
+		double t_skip = -edge->y;
+		edge->dy += edge->y;
+		edge->y = 0;
+		edge->x += edge->dx * t_skip;
+		edge->color += edge->dclr * t_skip;
+		edge->posW += edge->dPosW * t_skip;
+		if (mRenderState.isLighting())
+			edge->normalW += edge->dNorW * t_skip;
+	}
 
-	if (_v2->posScreen[1] < mCurY) 
-		mCurY = _v2->posScreen[1];
+	if (edge->y < mCurY) 
+		mCurY = edge->y;
 
-	if (_v1->posScreen[1] > mMaxY) // && _v1->posScreen[1] < mHeight)
-		mMaxY = _v1->posScreen[1];
+	if (t_y1 > mMaxY) // && t_y1 < mHeight)
+		mMaxY = t_y1;
 
 	return true;
 }
 
 void CScanLine::_addTriangleStrip()
 {
-	int v_num = mVertexBuffer.size();
+	const IndexBuffer &ib = mIndexBuffer;
+	int v_num = ib.size();
 
 	for (int i=0; i<v_num-2; ++i)
 	{
-		Vertex *t_v1 = mVertexBuffer[i];
-		Vertex *t_v2 = mVertexBuffer[i+1];
-		Vertex *t_v3 = mVertexBuffer[i+2];
-
-		_addATriangle(t_v1, t_v2, t_v3);
+		_addATriangle(ib[i], ib[i+1], ib[i+2]);
 	}
 }
 
@@ -374,17 +998,14 @@ void CScanLine::_addTriangleFan()
 
 void CScanLine::_addQuads()
 {
-	int v_num = mVertexBuffer.size();
+	const IndexBuffer &ib = mIndexBuffer;
+	int v_num = ib.size();
 
 	for (int i=0; i<v_num/4; ++i)
 	{
 		for (int j=0; j<2; ++j)
 		{
-			Vertex *t_v1 = mVertexBuffer[4*i];
-			Vertex *t_v2 = mVertexBuffer[4*i+j+1];
-			Vertex *t_v3 = mVertexBuffer[4*i+j+2];
-
-			_addATriangle(t_v1, t_v2, t_v3);
+			_addATriangle(ib[4*i], ib[4*i+j+1], ib[4*i+j+2]);
 		}
 	}
 }
@@ -397,6 +1018,54 @@ void CScanLine::_addPolygon()
 {
 }
 
+void CScanLine::_sortEdgeTable()
+{
+	// count the edges of each scan line
+	mETBucket.assign(mHeight+1, 0);
+	EArrayItor it = mEdges.begin();
+	EArrayItor it_end = mEdges.end();
+	for (; it!=it_end; ++it)
+	{
+		++mETBucket[it->y+1];
+	}
+	for (int i=0; i<mHeight; ++i)
+	{
+		mETBucket[i+1] += mETBucket[i];
+	}
+
+	// stable scatter, so that the two lower edges of a triangle stay adjacent
+	mSortedET.resize(mEdges.size());
+	for (it = mEdges.begin(); it!=it_end; ++it)
+	{
+		mSortedET[mETBucket[it->y]++] = *it;
+	}
+	for (int i=mHeight; i>0; --i)
+	{
+		mETBucket[i] = mETBucket[i-1];
+	}
+	mETBucket[0] = 0;
+}
+
+void CScanLine::_mergeActiveEdges(ActiveEdgeList& _ael, ActiveEdgeList& _aeNew)
+{
+	if (_aeNew.empty())
+		return;
+
+	// both lists are sorted by id, merge from the back in place
+	int i = int(_ael.size()) - 1;
+	int j = int(_aeNew.size()) - 1;
+	_ael.resize(_ael.size() + _aeNew.size());
+	int k = int(_ael.size()) - 1;
+	while (j>=0)
+	{
+		if (i>=0 && _ael[i].id > _aeNew[j].id)
+			_ael[k--] = _ael[i--];
+		else
+			_ael[k--] = _aeNew[j--];
+	}
+	_aeNew.clear();
+}
+
 bool CScanLine::_compare_edges(const Edge* e1, const Edge* e2)
 {
 	return (e1->x == e2->x) ? (e1->dx < e2->dx) : (e1->x < e2->x);
@@ -405,336 +1074,1081 @@ bool CScanLine::_compare_edges(const Edge* e1, const Edge* e2)
 void CScanLine::_scanLine()
 {
 	if (mMaxY>=mHeight) mMaxY=mHeight-1;
-	
-	int nNextY = mCurY; // the line which will be added next time
-	ETableIterator itset_next = mSortedET.begin(); // related iterator
-	while (mCurY<=mMaxY)
+
+	if (mCurY>mMaxY)
+		return;
+
+	_sortEdgeTable();
+	_scanRows(mCurY, mMaxY+1, &mSortedET[0], 0, mAEL, mAENew);
+	mCurY = mMaxY+1;
+}
+
+void CScanLine::_scanRows(int _y0, int _y1, Edge* _et, int _etBase, 
+						  ActiveEdgeList& _ael, ActiveEdgeList& _aeNew)
+{
+	for (int t_y=_y0; t_y<_y1; ++t_y)
 	{
-		ActiveEdge *t_ae;
 		AEListItor itae, itae_end;
 
-		// Step 1: add edges at mCurY line to Active Edge List
-		//ETableIterator it_set = mSortedET.find(mCurY);
-		if (mCurY==nNextY && itset_next != mSortedET.end() 
-			&& !(itset_next->second.empty()))
+		// Step 1: add edges at t_y line to Active Edge List
+		Edge *itl = _et + (mETBucket[t_y] - _etBase);
+		Edge *itl_end = _et + (mETBucket[t_y+1] - _etBase);
+		for (; itl!=itl_end; ++itl)
 		{
-			EListIterator itl = itset_next->second.begin();
-			EListIterator itl_end = itset_next->second.end();
-			for (; itl!=itl_end; ++itl)
+			int id = itl->id;
+			itae = std::lower_bound(_ael.begin(), _ael.end(), id, ActiveEdgeLess());
+			if (itae!=_ael.end() && itae->id==id)
 			{
-				int id = (*itl)->id;
-				itae = mAEL.find(id);
-				if (itae!=mAEL.end())
-				{
-					t_ae = &(itae->second);
-					if (t_ae->el->dy == 0)
-						t_ae->el = *itl;
-					if (t_ae->er->dy == 0)
-						t_ae->er = *itl;
-				}
-				else
-				{ // if it's a new triangle
-					//Edge *el = *itl;
-					//++itl;
-					//Edge *er = *itl;
-					//if (el->id!=er->id)
-					//{
-					//	int i = 0;
-					//}
-					ActiveEdge *t_ae = &mAEL[id];
-					//t_ae->el = el;
-					//t_ae->er = er;
-					t_ae->el = *itl;
-					++itl;
-					assert(t_ae->el->id == (*itl)->id);
-					t_ae->er = *itl;
-					if (!_compare_edges(t_ae->el, t_ae->er))
-					{
-						Edge* t_e = t_ae->er;
-						t_ae->er = t_ae->el;
-						t_ae->el = t_e;
-					}
-					// calculate z depth at left
-					Triangle &tri = *(mTriArray[id]);
-					Edge *t_el = t_ae->el;
-					t_ae->zl = -(tri.normal[0]*t_el->x + tri.normal[1]*mCurY + tri.d) / (tri.normal[2]);
-					t_ae->dzx = -tri.normal[0] / tri.normal[2];
-					t_ae->dzy = -tri.normal[1] / tri.normal[2];
-				}
+				_handOffEdge(*itae, itl);
 			}
-			++itset_next;
-			if (itset_next != mSortedET.end())
-				nNextY = itset_next->first;
-		}// end if (mCurY==nNextY && it_set != mSortedET.end() && !(it_set->second.empty()))
+			else
+			{ // if it's a new triangle
+				Edge *t_e1 = itl;
+				++itl;
+				assert(t_e1->id == itl->id);
+				_aeNew.push_back(ActiveEdge());
+				_activateEdges(_aeNew.back(), t_e1, itl, t_y);
+			}
+		}
+		_mergeActiveEdges(_ael, _aeNew);
 
-		if (mCurY>=0)
+		// Step 2: fill the region in pairs, horizontal operations
+		itae = _ael.begin();
+		itae_end = _ael.end();
+		for (; itae!=itae_end; ++itae )
 		{
-			// Step 2: fill the region in pairs, horizontal operations
-			itae = mAEL.begin();
-			itae_end = mAEL.end();
-			for (; itae!=itae_end; ++itae )
-			{
-				t_ae = &(itae->second);
-				Edge *e1 = t_ae->el;
-				Edge *e2 = t_ae->er;
-
-				double t_xl = e1->x;	// valid x on the left side
-				double t_xr = e2->x;	// valid x on the right side
-				// skip the scan line which is out of region
-				if (t_xl>=mWidth || t_xr<0)
-				{// out of area
-					continue;
-				}
+			_fillSpan(*itae, t_y, 0, mWidth);
+		}
 
-				// calculate the interpolated color
-				double skip_x = e2->x - e1->x;
+		// Step 3: update the edges, vertical operations
+		itae = _ael.begin();
+		itae_end = _ael.end();
+		AEListItor itae_keep = _ael.begin();	// compact in place, keeping the order
+		for (; itae!=itae_end; ++itae)
+		{
+			if (_stepActiveEdge(*itae))
+			{
+				if (itae_keep != itae)
+					*itae_keep = *itae;
+				++itae_keep;
+			}
+		}//end for update edges
+		_ael.erase(itae_keep, itae_end);
+	}
+}
 
-				Color4d t_dclr(0, 0, 0, 0);
-				Vec4d t_dposW(0,0,0,0);
-				Normald t_dnorW(0, 0, 0);
-				if (skip_x>0)
-				{
-					t_dclr = (e2->color - e1->color) / skip_x;
-					if ( mRenderState.isSmoothShading() )
-					{
-						t_dposW = (e2->posW - e1->posW) / skip_x;
-						t_dnorW = (e2->normalW - e1->normalW) / skip_x;
-					}
-				}
-				Color4d t_color = e1->color;
-				Vec4d t_posW = e1->posW;
-				Normald t_norW = e1->normalW;
-				double t_zl = t_ae->zl; // z depth on the left side
+void CScanLine::_activateEdges(ActiveEdge& _ae, Edge* _e1, Edge* _e2, int _y)
+{
+	_ae.id = _e1->id;
+	_ae.el = _e1;
+	_ae.er = _e2;
+	if (!_compare_edges(_ae.el, _ae.er))
+	{
+		std::swap(_ae.el, _ae.er);
+	}
+	// calculate z depth at left, in the units of the depth buffer
+	const Triangle &tri = *(mTriArray[_ae.id]);
+	double t_scale = mZBuffer.scale();
+	_ae.zl = -(tri.normal[0]*_ae.el->x + tri.normal[1]*_y + tri.d) / (tri.normal[2]) * t_scale;
+	_ae.dzx = -tri.normal[0] / tri.normal[2] * t_scale;
+	_ae.dzy = -tri.normal[1] / tri.normal[2] * t_scale;
+
+	_ae.fixed = tri.fixed;
+	if (_ae.fixed)
+	{
+		double t_one = double(1 << mZBuffer.fixedShift());
+		_ae.fzl = sl_fixed(_ae.zl, t_one);
+		_ae.fdzx = sl_fixed(_ae.dzx, t_one);
+		_ae.fdzy = sl_fixed(_ae.dzy, t_one);
+	}
+}
 
-				// skip the region over the left
-				if (t_xl<0)
-				{
-					t_color += t_dclr*(-t_xl);
-					if (mRenderState.isSmoothShading())
-					{
-						t_posW += t_dposW*(-t_xl);
-						t_norW += t_dnorW*(-t_xl);
-					}
-					t_xl = 0;
-				}
+void CScanLine::_handOffEdge(ActiveEdge& _ae, Edge* _e)
+{
+	// the upper edge takes over from the finished one
+	if (_ae.el->dy == 0)
+		_ae.el = _e;
+	if (_ae.er->dy == 0)
+		_ae.er = _e;
+}
 
-				Color4d t_final_clr;
-				//for (int pi = std::max(e1->x,0.0); pi<std::min(e2->x+1, (double)mImg->width()); ++pi)
-				for (int pi = int(t_xl); pi<std::min(int(t_xr+1), mWidth); ++pi)
-				{
-					if (t_zl<mZBuffer[mCurY*mWidth+pi])
-					{
-						t_final_clr = t_color;
-						if ( mRenderState.isSmoothShading() )
-							_calculateLight(t_posW, t_norW, t_final_clr);
-						_setFrameBuffer(mCurY, pi, t_final_clr);
-						mZBuffer[mCurY*mWidth+pi] = t_zl;
-					}
-					// update color, normal, zl
-					t_color += t_dclr;
-					t_zl += t_ae->dzx;
-					if ( mRenderState.isSmoothShading() )
-					{
-						t_posW += t_dposW;
-						t_norW += t_dnorW;
-					}
-				}
-			}
+void CScanLine::_fillSpan(const ActiveEdge& _ae, int _y, int _x0, int _x1)
+{
+	if (_ae.fixed)
+	{
+		_fillFixedSpan(_ae, _y, _x0, _x1);
+		return;
+	}
+
+	const Edge *e1 = _ae.el;
+	const Edge *e2 = _ae.er;
+
+	double t_xl = e1->x;	// valid x on the left side
+	double t_xr = e2->x;	// valid x on the right side
+	// skip the scan line which is out of region
+	if (t_xl>=_x1 || t_xr<_x0)
+	{// out of area
+		return;
+	}
+
+	// calculate the interpolated color
+	double skip_x = e2->x - e1->x;
+
+	Color4d t_dclr(0, 0, 0, 0);
+	Vec4d t_dposW(0,0,0,0);
+	Normald t_dnorW(0, 0, 0);
+	if (skip_x>0)
+	{
+		t_dclr = (e2->color - e1->color) / skip_x;
+		if ( mRenderState.isSmoothShading() )
+		{
+			t_dposW = (e2->posW - e1->posW) / skip_x;
+			t_dnorW = (e2->normalW - e1->normalW) / skip_x;
 		}
+	}
+	Color4d t_color = e1->color;
+	Vec4d t_posW = e1->posW;
+	Normald t_norW = e1->normalW;
+	double t_zl = _ae.zl; // z depth on the left side
 
-		// Step 3: update the edges, vertical operations
-		itae = mAEL.begin();
-		itae_end = mAEL.end();
-		if (mCurY<0)
+	// skip the region over the left
+	if (t_xl<0)
+	{
+		t_color += t_dclr*(-t_xl);
+		if (mRenderState.isSmoothShading())
+		{
+			t_posW += t_dposW*(-t_xl);
+			t_norW += t_dnorW*(-t_xl);
+		}
+		t_xl = 0;
+	}
+
+	int pi = int(t_xl);
+	int pi_end = std::min(int(t_xr+1), _x1);
+
+	// SL_HIZ: the window shrinks to the tiles the span is not behind
+	int t_x0 = _x0;
+	if (mRenderState.isHiZ())
+	{
+		t_x0 = max(pi, _x0);
+		if (!mHiZ.clipSpan(_y, t_x0, pi_end, t_zl + (t_x0-pi)*_ae.dzx, _ae.dzx))
+			return;
+	}
+
+	// step up to the clipping window
+	for (; pi<t_x0 && pi<pi_end; ++pi)
+	{
+		t_color += t_dclr;
+		t_zl += _ae.dzx;
+		if ( mRenderState.isSmoothShading() )
+		{
+			t_posW += t_dposW;
+			t_norW += t_dnorW;
+		}
+	}
+	if (pi>=pi_end)
+		return;
+
+	// without per pixel lighting the span goes to the vector kernel
+	if ( !mRenderState.isSmoothShading() && mFrameBits )
+	{
+		SpanInfo t_span;
+		t_span.count = pi_end - pi;
+		t_span.z = t_zl;
+		t_span.dz = _ae.dzx;
+		for (int i=0; i<4; ++i)
+		{
+			t_span.color[i] = t_color[i];
+			t_span.dcolor[i] = t_dclr[i];
+		}
+		t_span.blend = mRenderState.isBlending();
+		t_span.depthFormat = mZBuffer.format();
+		t_span.depthScale = mZBuffer.scale();
+		t_span.depth = mZBuffer.data(_y*mWidth + pi);
+		t_span.pixels = _frameRow(_y) + pi;
+		mSpanFill(t_span);
+	}
+	else if (mbDeferred)
+	{
+		// the weights at the points the color is stepped to, which stays
+		// at the left end if the span is empty
+		const Triangle &tri = *(mTriArray[_ae.id]);
+		double t_step = (skip_x>0) ? 1.0 : 0.0;
+		double t_x = t_xl + (pi - int(t_xl)) * t_step;
+		double t_l2 = tri.bary[0][0]*t_x + tri.bary[0][1]*_y + tri.bary[0][2];
+		double t_l3 = tri.bary[1][0]*t_x + tri.bary[1][1]*_y + tri.bary[1][2];
+		double t_dl2 = tri.bary[0][0] * t_step;
+		double t_dl3 = tri.bary[1][0] * t_step;
+		for (; pi<pi_end; ++pi)
 		{
-			double nMinY = -mCurY; // NOTE
-			if (itset_next != mSortedET.end() && !(itset_next->second.empty())
-				&& (nNextY-mCurY < nMinY) )
+			if (mZBuffer.testAndSet(_y*mWidth+pi, t_zl))
 			{
-				nMinY = nNextY-mCurY;
+				VisSample &t_s = mVisBuffer[_y*mWidth+pi];
+				t_s.id = _ae.id;
+				t_s.l2 = float(t_l2);
+				t_s.l3 = float(t_l3);
 			}
-			if (nMinY)
-			for (; itae!=itae_end; ++itae)
+			t_zl += _ae.dzx;
+			t_l2 += t_dl2;
+			t_l3 += t_dl3;
+		}
+	}
+	else
+	{
+		Color4d t_final_clr;
+		unsigned int *t_row = _frameRow(_y);
+		for (; pi<pi_end; ++pi)
+		{
+			if (mZBuffer.testAndSet(_y*mWidth+pi, t_zl))
 			{
-				t_ae = &(itae->second);
-				if (t_ae->el->dy < nMinY)
-				{
-					nMinY = t_ae->el->dy;
-				}
-				if (t_ae->er->dy < nMinY)
-				{
-					nMinY = t_ae->er->dy;
-				}
+				t_final_clr = t_color;
+				if ( mRenderState.isSmoothShading() )
+					_calculateLight(t_posW, t_norW, t_final_clr, _tileLights(pi, _y));
+				_setFrameBuffer(t_row, _y, pi, t_final_clr);
 			}
-			itae = mAEL.begin();
-			for (; itae!=itae_end;)
+			// update color, normal, zl
+			t_color += t_dclr;
+			t_zl += _ae.dzx;
+			if ( mRenderState.isSmoothShading() )
 			{
-				t_ae = &(itae->second);
-				
-				// dy
-				t_ae->el->dy -= nMinY;
-				t_ae->er->dy -= nMinY;
+				t_posW += t_dposW;
+				t_norW += t_dnorW;
+			}
+		}
+	}
 
-				if (t_ae->el->dy == 0 && t_ae->er->dy == 0)
-				{
-					itae  = mAEL.erase(itae);
-					continue;
-				}
+	if (mRenderState.isHiZ())
+		mHiZ.update(mZBuffer, _y, t_x0, pi_end);
+}
 
-				// x, zl
-				t_ae->el->x += t_ae->el->dx * nMinY;
-				t_ae->er->x += t_ae->er->dx * nMinY;
-				t_ae->zl += (t_ae->dzx * t_ae->el->dx + t_ae->dzy) * nMinY;
+bool CScanLine::_stepActiveEdge(ActiveEdge& _ae)
+{
+	// remove the edges whose nearby edge is at the other side of the scan line.
+	if (_ae.el->dy == 0 && _ae.er->dy == 0)
+		return false;
 
-				// color
-				t_ae->el->color += t_ae->el->dclr * nMinY;
-				t_ae->er->color += t_ae->er->dclr * nMinY;	
+	// dy
+	--_ae.el->dy;
+	--_ae.er->dy;
 
-				if ( mRenderState.isSmoothShading() )
-				{
-					// normal in WS
-					t_ae->el->normalW += t_ae->el->dNorW * nMinY;
-					t_ae->er->normalW += t_ae->er->dNorW * nMinY;
+	if (_ae.fixed)
+	{
+		// the color is only read on the left
+		_ae.fzl += _ae.fdzy + int((long long)(_ae.fdzx) * _ae.el->fdx >> 16);
+		_ae.el->fx += _ae.el->fdx;
+		_ae.er->fx += _ae.er->fdx;
+		for (int i=0; i<4; ++i)
+			_ae.el->fclr[i] += _ae.el->fdclr[i];
+		return true;
+	}
 
-					// position in WS
-					t_ae->el->posW += t_ae->el->dPosW * nMinY;
-					t_ae->er->posW += t_ae->er->dPosW * nMinY;
-				}
+	// x, zl
+	_ae.el->x += _ae.el->dx;
+	_ae.er->x += _ae.er->dx;
+	_ae.zl += _ae.dzx * _ae.el->dx + _ae.dzy;
+
+	// color
+	_ae.el->color += _ae.el->dclr;
+	_ae.er->color += _ae.er->dclr;	
+
+	if ( mRenderState.isSmoothShading() )
+	{
+		// normal in WS
+		_ae.el->normalW += _ae.el->dNorW;
+		_ae.er->normalW += _ae.er->dNorW;
 
-				++itae;
+		// position in WS
+		_ae.el->posW += _ae.el->dPosW;
+		_ae.er->posW += _ae.er->dPosW;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Fixed point scan conversion
+//------------------------------------------------------------------------------
+bool CScanLine::_setupFixedPoint(Triangle& _tri, int _v1, int _v2, int _v3)
+{
+	const VertexBuffer &vb = mVertexBuffer;
+	if (_tri.minX < -FX_GUARD_BAND || _tri.maxX > FX_GUARD_BAND)
+		return false;
+
+	// z, a pixel past the edges as for zNear, stays a quarter of the depth
+	// range around [0, scale()], so that neither it nor its change along
+	// a span overflows. Edge on triangles have no zNear and stay in double.
+	const Vec3d &n = _tri.normal;
+	double t_scale = mZBuffer.scale();
+	double t_zFar = max(vb.sz[_v3], max(vb.sz[_v1], vb.sz[_v2]));
+	t_zFar += (fabs(n[0]) + fabs(n[1])) / n[2];
+	t_zFar *= t_scale;
+	if (!(_tri.zNear >= -0.25*t_scale && t_zFar <= 1.25*t_scale))
+		return false;
+	if (fabs(n[0]/n[2]) + fabs(n[1]/n[2]) > 0.5)
+		return false;
+
+	// the color is linear over the triangle, so it steps the same along x
+	// on every span, and spans need no division
+	double x1 = vb.sx[_v1], y1 = vb.sy[_v1];
+	double x2 = vb.sx[_v2], y2 = vb.sy[_v2];
+	double x3 = vb.sx[_v3], y3 = vb.sy[_v3];
+	double t_area = (x2-x1)*(y3-y1) - (x3-x1)*(y2-y1);
+	Color4d c1 = vb.color(_v1), c2 = vb.color(_v2), c3 = vb.color(_v3);
+	double t_dclr[4];
+	for (int i=0; i<4; ++i)
+	{
+		t_dclr[i] = ((c2[i]-c1[i])*(y3-y1) - (c3[i]-c1[i])*(y2-y1)) / t_area;
+		double t_dy = ((c3[i]-c1[i])*(x2-x1) - (c2[i]-c1[i])*(x3-x1)) / t_area;
+		double t_max = max(fabs(c1[i]), max(fabs(c2[i]), fabs(c3[i])));
+		// slivers step too far for 16.16
+		if (!(t_max + 2*(fabs(t_dclr[i]) + fabs(t_dy)) <= FX_COLOR_RANGE))
+			return false;
+	}
+	for (int i=0; i<4; ++i)
+	{
+		_tri.fdclr[i] = sl_fixed(t_dclr[i], SF_FIXED_ONE);
+	}
+
+	for (int k=_tri.edge; k<_tri.edge+_tri.nEdges; ++k)
+	{
+		Edge &e = mEdges[k];
+		e.fx = sl_fixed(e.x, 65536.0);
+		e.fdx = sl_fixed(e.dx, 65536.0);
+		for (int i=0; i<4; ++i)
+		{
+			e.fclr[i] = sl_fixed(e.color[i], SF_FIXED_ONE);
+			e.fdclr[i] = sl_fixed(e.dclr[i], SF_FIXED_ONE);
+		}
+	}
+	return true;
+}
+
+void CScanLine::_fillFixedSpan(const ActiveEdge& _ae, int _y, int _x0, int _x1)
+{
+	// the steps of _fillSpan(), from the left end of the span
+	const Edge *e1 = _ae.el;
+	const Edge *e2 = _ae.er;
+	int t_xl = e1->fx;
+	int t_xr = e2->fx;
+	if (t_xl >= (_x1<<16) || t_xr < (_x0<<16))
+		return;
+
+	const Triangle &tri = *(mTriArray[_ae.id]);
+	FixedSpanInfo t_span;
+	for (int i=0; i<4; ++i)
+	{
+		t_span.color[i] = e1->fclr[i];
+		t_span.dcolor[i] = tri.fdclr[i];
+	}
+	int t_z = _ae.fzl;
+
+	// skip the region over the left, z is kept as _fillSpan() does
+	if (t_xl < 0)
+	{
+		for (int i=0; i<4; ++i)
+			t_span.color[i] += int((long long)(t_span.dcolor[i]) * (-t_xl) >> 16);
+		t_xl = 0;
+	}
+
+	int pi = t_xl >> 16;
+	int pi_end = min((t_xr >> 16) + 1, _x1);
+
+	int t_x0 = _x0;
+	if (mRenderState.isHiZ())
+	{
+		double t_unit = 1.0 / (1 << mZBuffer.fixedShift());
+		t_x0 = max(pi, _x0);
+		if (!mHiZ.clipSpan(_y, t_x0, pi_end, (t_z + double(t_x0-pi)*_ae.fdzx) * t_unit, 
+			_ae.fdzx * t_unit))
+			return;
+	}
+
+	// step up to the clipping window
+	int t_skip = min(t_x0, pi_end) - pi;
+	if (t_skip > 0)
+	{
+		for (int i=0; i<4; ++i)
+			t_span.color[i] += t_skip * t_span.dcolor[i];
+		t_z += t_skip * _ae.fdzx;
+		pi += t_skip;
+	}
+	if (pi >= pi_end)
+		return;
+
+	t_span.count = pi_end - pi;
+	t_span.z = t_z;
+	t_span.dz = _ae.fdzx;
+	t_span.zShift = mZBuffer.fixedShift();
+	t_span.blend = mRenderState.isBlending();
+	t_span.depthFormat = mZBuffer.format();
+	t_span.depthScale = mZBuffer.scale();
+	t_span.depth = mZBuffer.data(_y*mWidth + pi);
+	t_span.pixels = _frameRow(_y) + pi;
+	mFixedSpanFill(t_span);
+
+	if (mRenderState.isHiZ())
+		mHiZ.update(mZBuffer, _y, t_x0, pi_end);
+}
+
+//------------------------------------------------------------------------------
+// Tiled scan conversion
+//------------------------------------------------------------------------------
+void CScanLine::setThreadCount(int _n)
+{
+	mThreadPool.setThreadCount(_n);
+}
+
+void CScanLine::_scanTiles()
+{
+	mTilesX = (mWidth + TILE_SIZE - 1) / TILE_SIZE;
+	mTilesY = (mHeight + TILE_SIZE - 1) / TILE_SIZE;
+	mTileBins.resize(mTilesX * mTilesY);
+	for (size_t i=0; i<mTileBins.size(); ++i)
+	{
+		mTileBins[i].clear();
+	}
+
+	// bin in submission order, so that every pixel still sees the
+	// triangles in that order
+	int t_num = mTriArray.size();
+	for (int id=0; id<t_num; ++id)
+	{
+		const Triangle &tri = *(mTriArray[id]);
+		// a span may start one pixel left of the box by rounding
+		int t_x0 = max(tri.minX - 1, 0);
+		int t_x1 = min(tri.maxX + 1, mWidth - 1);
+		int t_y0 = max(tri.minY, 0);
+		int t_y1 = min(tri.maxY, mHeight - 1);
+		if (tri.nEdges == 0 || t_x0 > t_x1 || t_y0 > t_y1)
+			continue;
+
+		for (int ty = t_y0/TILE_SIZE; ty <= t_y1/TILE_SIZE; ++ty)
+		{
+			for (int tx = t_x0/TILE_SIZE; tx <= t_x1/TILE_SIZE; ++tx)
+			{
+				mTileBins[ty*mTilesX + tx].push_back(id);
 			}
-			mCurY += int(nMinY);
+		}
+	}
+
+	// the tiles write disjoint parts of mZBuffer and mTarget, no locking
+	mThreadPool.parallelFor(mTilesX * mTilesY, [this](int _tile) {
+		int t_x0 = (_tile % mTilesX) * TILE_SIZE;
+		int t_y0 = (_tile / mTilesX) * TILE_SIZE;
+		int t_x1 = min(t_x0 + TILE_SIZE, mWidth);
+		int t_y1 = min(t_y0 + TILE_SIZE, mHeight);
+		const TileBin &bin = mTileBins[_tile];
+		for (size_t i=0; i<bin.size(); ++i)
+		{
+			_scanTriangle(bin[i], t_x0, t_y0, t_x1, t_y1);
+		}
+	});
+}
+
+void CScanLine::_scanTriangle(int _id, int _x0, int _y0, int _x1, int _y1)
+{
+	// skip the seek too if the triangle is hidden in this tile
+	const Triangle &tri = *(mTriArray[_id]);
+	if (mRenderState.isHiZ() && mHiZ.isOccluded(max(tri.minX-1, _x0), max(tri.minY, _y0), 
+		min(tri.maxX+1, _x1-1), min(tri.maxY, _y1-1), tri.zNear))
+		return;
+
+	TriangleScan t_ts;
+	_beginTriangle(_id, t_ts);
+	_seekTriangle(t_ts, _y0);
+	for (int t_y = max(t_ts.edges[0].y, _y0); t_y < _y1; ++t_y)
+	{
+		if (!_enterRow(t_ts, t_y))
+		{
+			if (t_ts.next == t_ts.nEdges)
+				break;
+			continue;
+		}
+		_fillSpan(t_ts.ae, t_y, _x0, _x1);
+		t_ts.active = _stepActiveEdge(t_ts.ae);
+	}
+}
+
+void CScanLine::_beginTriangle(int _id, TriangleScan& _ts)
+{
+	const Triangle &tri = *(mTriArray[_id]);
+
+	// insertion sort, stable like the edge table
+	_ts.nEdges = tri.nEdges;
+	for (int i=0; i<_ts.nEdges; ++i)
+	{
+		const Edge &t_e = mEdges[tri.edge + i];
+		int j = i;
+		for (; j>0 && _ts.edges[j-1].y > t_e.y; --j)
+		{
+			_ts.edges[j] = _ts.edges[j-1];
+		}
+		_ts.edges[j] = t_e;
+	}
+	_ts.next = 0;
+	_ts.active = false;
+}
+
+bool CScanLine::_enterRow(TriangleScan& _ts, int _y)
+{
+	for (; _ts.next<_ts.nEdges && _ts.edges[_ts.next].y == _y; ++_ts.next)
+	{
+		if (_ts.active)
+		{
+			_handOffEdge(_ts.ae, &_ts.edges[_ts.next]);
 		}
 		else
-		{// mCurY>=0
-			for (; itae!=itae_end;)
+		{
+			assert(_ts.next+1 < _ts.nEdges);
+			_activateEdges(_ts.ae, &_ts.edges[_ts.next], &_ts.edges[_ts.next+1], _y);
+			_ts.active = true;
+			++_ts.next;
+		}
+	}
+	return _ts.active;
+}
+
+void CScanLine::_seekTriangle(TriangleScan& _ts, int _y)
+{
+	// the same steps as _scanRows(), so the edges get exactly the values
+	// they have there
+	for (int t_y = _ts.edges[0].y; t_y < _y; ++t_y)
+	{
+		if (!_enterRow(_ts, t_y))
+		{
+			if (_ts.next == _ts.nEdges)
+				break;
+			continue;
+		}
+		_ts.active = _stepActiveEdge(_ts.ae);
+	}
+}
+
+//------------------------------------------------------------------------------
+// Banded scan conversion
+//------------------------------------------------------------------------------
+void CScanLine::_scanBands()
+{
+	if (mMaxY>=mHeight) mMaxY=mHeight-1;
+	if (mCurY>mMaxY)
+		return;
+
+	_sortEdgeTable();
+
+	// a few bands per thread, so that the busy parts of the image balance.
+	// They are whole rows of Hi-Z tiles, so that no two threads share a tile.
+	const int t_align = CHiZBuffer::TILE_SIZE;
+	int t_base = mCurY - mCurY % t_align;
+	int t_rows = mMaxY - t_base + 1;
+	int t_height = max(8, (t_rows + 4*threadCount() - 1) / (4*threadCount()));
+	t_height = (t_height + t_align - 1) / t_align * t_align;
+	int t_bands = (t_rows + t_height - 1) / t_height;
+	mBands.resize(t_bands);
+	for (int i=0; i<t_bands; ++i)
+	{
+		mBands[i].seedIds.clear();
+	}
+
+	// the triangles that are already active at the first row of a band
+	int t_num = mTriArray.size();
+	for (int id=0; id<t_num; ++id)
+	{
+		const Triangle &tri = *(mTriArray[id]);
+		if (tri.nEdges == 0)
+			continue;
+		int t_y0 = max(tri.minY, 0);
+		int t_y1 = min(tri.maxY, mMaxY);
+		// bands whose first row is in (t_y0, t_y1]
+		int b = max(t_y0 - t_base, 0) / t_height + 1;
+		for (; b<t_bands && t_base + b*t_height <= t_y1; ++b)
+		{
+			mBands[b].seedIds.push_back(id);
+		}
+	}
+
+	// bands are handed out one at a time, so fast threads take more of them
+	mThreadPool.parallelFor(t_bands, [this, t_base, t_height](int _band) {
+		int t_y0 = max(t_base + _band * t_height, mCurY);
+		int t_y1 = min(t_base + (_band+1) * t_height, mMaxY + 1);
+		_scanBand(mBands[_band], t_y0, t_y1);
+	});
+	mCurY = mMaxY+1;
+}
+
+void CScanLine::_scanBand(ScanBand& _band, int _y0, int _y1)
+{
+	_band.ael.clear();
+	_band.aeNew.clear();
+
+	// seed the active edge list, in id order
+	int t_seeds = _band.seedIds.size();
+	_band.seeds.resize(t_seeds);
+	for (int i=0; i<t_seeds; ++i)
+	{
+		TriangleScan &t_ts = _band.seeds[i];
+		_beginTriangle(_band.seedIds[i], t_ts);
+		_seekTriangle(t_ts, _y0);
+		if (t_ts.active)
+			_band.ael.push_back(t_ts.ae);
+	}
+
+	// the edges starting in the band are stepped in place, so copy them.
+	// The edges of the seeds that start here hand off through the list.
+	_band.edges.assign(mSortedET.begin() + mETBucket[_y0], 
+		mSortedET.begin() + mETBucket[_y1]);
+	Edge *t_et = _band.edges.empty() ? 0 : &_band.edges[0];
+	_scanRows(_y0, _y1, t_et, mETBucket[_y0], _band.ael, _band.aeNew);
+}
+
+//------------------------------------------------------------------------------
+// Half-space rasterization
+//------------------------------------------------------------------------------
+// takes the coverage _mask of the _width pixels from _k of a row into the
+// covered pixels [_x0, _x1). True when the row is done: the triangle is
+// convex, so they follow each other.
+static inline bool sl_coverBlock(int _mask, int _k, int _width, bool& _inside, int& _x0, int& _x1)
+{
+	if (_mask == 0)
+		return _inside;
+	int t_low = 0, t_high = 0;
+	while (!(_mask & (1<<t_low)))
+		++t_low;
+	while (_mask >> t_high)
+		++t_high;
+	if (!_inside)
+		_x0 = _k + t_low;
+	_x1 = _k + t_high;
+	_inside = true;
+	return t_high < _width;
+}
+
+// the pixels [_x0, _x1) of the _n of a row the triangle covers, counted
+// from the first. _e are its edge functions there and _a their steps.
+// False if there are none.
+static bool sl_coverRow64(const long long* _e, const long long* _a, int _n, int& _x0, int& _x1)
+{
+	bool t_inside = false;
+	for (int k=0; k<_n; ++k)
+	{
+		long long e0 = _e[0] + _a[0]*k, e1 = _e[1] + _a[1]*k, e2 = _e[2] + _a[2]*k;
+		int t_mask = ((e0|e1|e2) >= 0) ? 1 : 0;
+		if (sl_coverBlock(t_mask, k, 1, t_inside, _x0, _x1))
+			break;
+	}
+	return t_inside;
+}
+
+#ifdef SL_USE_SSE2
+// the same in 32 bits, inside HS_GUARD_BAND
+typedef bool (*SlCoverRowFunc)(const int* _e, const int* _a, int _n, int& _x0, int& _x1);
+
+static bool sl_coverRowSSE2(const int* _e, const int* _a, int _n, int& _x0, int& _x1)
+{
+	__m128i t_e[3], t_step[3];
+	for (int i=0; i<3; ++i)
+	{
+		t_e[i] = _mm_set_epi32(_e[i]+3*_a[i], _e[i]+2*_a[i], _e[i]+_a[i], _e[i]);
+		t_step[i] = _mm_set1_epi32(4*_a[i]);
+	}
+	bool t_inside = false;
+	for (int k=0; k<_n; k+=4)
+	{
+		__m128i t_or = _mm_or_si128(t_e[0], _mm_or_si128(t_e[1], t_e[2]));
+		int t_mask = ~_mm_movemask_ps(_mm_castsi128_ps(t_or)) & 0xF;
+		if (k+4 > _n)
+			t_mask &= (1<<(_n-k)) - 1;
+		if (sl_coverBlock(t_mask, k, 4, t_inside, _x0, _x1))
+			break;
+		for (int i=0; i<3; ++i)
+		{
+			t_e[i] = _mm_add_epi32(t_e[i], t_step[i]);
+		}
+	}
+	return t_inside;
+}
+
+#ifdef SL_USE_AVX2
+SL_TARGET_AVX2
+static bool sl_coverRowAVX2(const int* _e, const int* _a, int _n, int& _x0, int& _x1)
+{
+	const __m256i t_lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i t_e[3], t_step[3];
+	for (int i=0; i<3; ++i)
+	{
+		t_e[i] = _mm256_add_epi32(_mm256_set1_epi32(_e[i]), 
+			_mm256_mullo_epi32(t_lanes, _mm256_set1_epi32(_a[i])));
+		t_step[i] = _mm256_set1_epi32(8*_a[i]);
+	}
+	bool t_inside = false;
+	for (int k=0; k<_n; k+=8)
+	{
+		__m256i t_or = _mm256_or_si256(t_e[0], _mm256_or_si256(t_e[1], t_e[2]));
+		int t_mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(t_or)) & 0xFF;
+		if (k+8 > _n)
+			t_mask &= (1<<(_n-k)) - 1;
+		if (sl_coverBlock(t_mask, k, 8, t_inside, _x0, _x1))
+			break;
+		for (int i=0; i<3; ++i)
+		{
+			t_e[i] = _mm256_add_epi32(t_e[i], t_step[i]);
+		}
+	}
+	_mm256_zeroupper();
+	return t_inside;
+}
+#endif
+
+// 8 pixels a step with AVX2, as spanFillFunc() picks its kernel
+static SlCoverRowFunc sl_coverRowFunc()
+{
+#ifdef SL_USE_AVX2
+	if (cpuHasAvx2())
+		return sl_coverRowAVX2;
+#endif
+	return sl_coverRowSSE2;
+}
+#endif
+
+void CScanLine::_rasterizeTriangle(int _v1, int _v2, int _v3)
+{
+	const VertexBuffer &vb = mVertexBuffer;
+
+	// screen coordinates are whole pixels, so the edge functions are exact
+	int x1 = int(vb.sx[_v1]), y1 = int(vb.sy[_v1]);
+	int x2 = int(vb.sx[_v2]), y2 = int(vb.sy[_v2]);
+	int x3 = int(vb.sx[_v3]), y3 = int(vb.sy[_v3]);
+
+	// bounding box on the screen
+	int t_minX = max(min(x1, min(x2, x3)), 0);
+	int t_maxX = min(max(x1, max(x2, x3)), mWidth-1);
+	int t_minY = max(min(y1, min(y2, y3)), 0);
+	int t_maxY = min(max(y1, max(y2, y3)), mHeight-1);
+	if (t_minX>t_maxX || t_minY>t_maxY)
+		return;
+
+	// E(x,y) = A*x + B*y + C is positive left of the edge. The triangle is
+	// front facing, so counter-clockwise, and Ei weights the vertex i.
+	long long A[3] = { y2-y3, y3-y1, y1-y2 };
+	long long B[3] = { x3-x2, x1-x3, x2-x1 };
+	long long C[3] = { 
+		-(A[0]*x2 + B[0]*y2), 
+		-(A[1]*x3 + B[1]*y3), 
+		-(A[2]*x1 + B[2]*y1) };
+	long long t_area = A[0]*x1 + B[0]*y1 + C[0];
+	if (t_area<=0)
+		return;
+	double t_inv = 1.0 / t_area;
+
+	// attributes at v1, and their change towards v2 and v3
+	double t_scale = mZBuffer.scale();
+	double z1 = vb.sz[_v1] * t_scale;
+	double dz2 = vb.sz[_v2] * t_scale - z1, dz3 = vb.sz[_v3] * t_scale - z1;
+	Color4d c1 = vb.color(_v1);
+	Color4d dc2 = vb.color(_v2) - c1, dc3 = vb.color(_v3) - c1;
+	bool t_smooth = mRenderState.isSmoothShading();
+
+	// SL_VISIBILITY: a triangle without edges, only to be looked up by id
+	int t_id = -1;
+	if (mbDeferred)
+	{
+		Triangle *tri = new (mTriPool.alloc()) Triangle;
+		tri->vertex[0] = _v1;
+		tri->vertex[1] = _v2;
+		tri->vertex[2] = _v3;
+		tri->nEdges = 0;
+		t_id = mTriArray.size();
+		mTriArray.push_back(tri);
+	}
+	Vec4d p1, dp2, dp3;
+	Normald n1, dn2, dn3;
+	if (t_smooth)
+	{
+		p1 = vb.posWorld(_v1);
+		dp2 = vb.posWorld(_v2) - p1;
+		dp3 = vb.posWorld(_v3) - p1;
+		n1 = vb.normalWorld(_v1);
+		dn2 = vb.normalWorld(_v2) - n1;
+		dn3 = vb.normalWorld(_v3) - n1;
+	}
+
+#ifdef SL_USE_SSE2
+	static const SlCoverRowFunc s_coverRow = sl_coverRowFunc();
+	bool t_simd = 
+		abs(x1)<=HS_GUARD_BAND && abs(y1)<=HS_GUARD_BAND &&
+		abs(x2)<=HS_GUARD_BAND && abs(y2)<=HS_GUARD_BAND &&
+		abs(x3)<=HS_GUARD_BAND && abs(y3)<=HS_GUARD_BAND &&
+		mWidth<=HS_GUARD_BAND && mHeight<=HS_GUARD_BAND;
+	int t_a[3] = { int(A[0]), int(A[1]), int(A[2]) };
+#endif
+
+	// without per pixel lighting a row goes to the span kernel, which steps
+	// the depth and the color along x
+	bool t_spans = !t_smooth && t_id < 0 && mFrameBits;
+	SpanInfo t_span;
+	if (t_spans)
+	{
+		t_span.dz = (A[1]*dz2 + A[2]*dz3) * t_inv;
+		for (int i=0; i<4; ++i)
+		{
+			t_span.dcolor[i] = (A[1]*dc2[i] + A[2]*dc3[i]) * t_inv;
+		}
+		t_span.blend = mRenderState.isBlending();
+		t_span.depthFormat = mZBuffer.format();
+		t_span.depthScale = mZBuffer.scale();
+	}
+
+	Color4d t_clr;
+	for (int y=t_minY; y<=t_maxY; ++y)
+	{
+		long long t_row[3];
+		for (int i=0; i<3; ++i)
+		{
+			t_row[i] = A[i]*t_minX + B[i]*y + C[i];
+		}
+
+		// the pixels [t_x0, t_x1) of the row
+		int t_x0 = 0, t_x1 = 0;
+		bool t_covered;
+#ifdef SL_USE_SSE2
+		if (t_simd)
+		{
+			int t_e[3] = { int(t_row[0]), int(t_row[1]), int(t_row[2]) };
+			t_covered = s_coverRow(t_e, t_a, t_maxX-t_minX+1, t_x0, t_x1);
+		}
+		else
+#endif
+			t_covered = sl_coverRow64(t_row, A, t_maxX-t_minX+1, t_x0, t_x1);
+		if (!t_covered)
+			continue;
+		t_x0 += t_minX;
+		t_x1 += t_minX;
+
+		unsigned int *t_pixels = _frameRow(y);
+		if (t_spans)
+		{
+			double l2 = (t_row[1] + A[1]*(t_x0-t_minX)) * t_inv;
+			double l3 = (t_row[2] + A[2]*(t_x0-t_minX)) * t_inv;
+			Color4d t_color = c1 + l2*dc2 + l3*dc3;
+			t_span.count = t_x1 - t_x0;
+			t_span.z = z1 + l2*dz2 + l3*dz3;
+			for (int i=0; i<4; ++i)
 			{
-				// remove the edges whose nearby edge is at the other side of the scan line.
-				t_ae = &(itae->second);
-				if (t_ae->el->dy == 0 && t_ae->er->dy == 0)
+				t_span.color[i] = t_color[i];
+			}
+			t_span.depth = mZBuffer.data(y*mWidth + t_x0);
+			t_span.pixels = t_pixels + t_x0;
+			mSpanFill(t_span);
+		}
+		else
+		{
+			for (int px=t_x0; px<t_x1; ++px)
+			{
+				double l2 = (t_row[1] + A[1]*(px-t_minX)) * t_inv;
+				double l3 = (t_row[2] + A[2]*(px-t_minX)) * t_inv;
+				double t_z = z1 + l2*dz2 + l3*dz3;
+				if (!mZBuffer.testAndSet(y*mWidth+px, t_z))
+					continue;
+				if (t_id >= 0)
 				{
-					itae  = mAEL.erase(itae);
+					VisSample &t_s = mVisBuffer[y*mWidth+px];
+					t_s.id = t_id;
+					t_s.l2 = float(l2);
+					t_s.l3 = float(l3);
+					continue;
 				}
-				else
+				t_clr = c1 + l2*dc2 + l3*dc3;
+				if (t_smooth)
 				{
-					// dy
-					--t_ae->el->dy;
-					--t_ae->er->dy;
-
-					// x, zl
-					t_ae->el->x += t_ae->el->dx;
-					t_ae->er->x += t_ae->er->dx;
-					t_ae->zl += t_ae->dzx * t_ae->el->dx + t_ae->dzy;
+					Vec4d t_posW = p1 + l2*dp2 + l3*dp3;
+					Normald t_norW = n1 + l2*dn2 + l3*dn3;
+					_calculateLight(t_posW, t_norW, t_clr, _tileLights(px, y));
+				}
+				_setFrameBuffer(t_pixels, y, px, t_clr);
+			}
+		}
 
-					// color
-					t_ae->el->color += t_ae->el->dclr;
-					t_ae->er->color += t_ae->er->dclr;	
+		if (mRenderState.isHiZ())
+			mHiZ.update(mZBuffer, y, t_x0, t_x1);
+	}
+}
 
-					if ( mRenderState.isSmoothShading() )
-					{
-						// normal in WS
-						t_ae->el->normalW += t_ae->el->dNorW;
-						t_ae->er->normalW += t_ae->er->dNorW;
+//------------------------------------------------------------------------------
+// Visibility buffer
+//------------------------------------------------------------------------------
+void CScanLine::_setupBarycentrics(Triangle& _tri, int _v1, int _v2, int _v3)
+{
+	const VertexBuffer &vb = mVertexBuffer;
+	_tri.vertex[0] = _v1;
+	_tri.vertex[1] = _v2;
+	_tri.vertex[2] = _v3;
+
+	// the edge functions of _rasterizeTriangle() over the doubled area
+	double x1 = vb.sx[_v1], y1 = vb.sy[_v1];
+	double x2 = vb.sx[_v2], y2 = vb.sy[_v2];
+	double x3 = vb.sx[_v3], y3 = vb.sy[_v3];
+	double t_area = (x2-x1)*(y3-y1) - (x3-x1)*(y2-y1);
+	if (t_area == 0)
+	{
+		// edge on, take the first corner
+		for (int i=0; i<3; ++i)
+		{
+			_tri.bary[0][i] = _tri.bary[1][i] = 0;
+		}
+		return;
+	}
+	_tri.bary[0][0] = (y3-y1) / t_area;
+	_tri.bary[0][1] = (x1-x3) / t_area;
+	_tri.bary[0][2] = -(_tri.bary[0][0]*x3 + _tri.bary[0][1]*y3);
+	_tri.bary[1][0] = (y1-y2) / t_area;
+	_tri.bary[1][1] = (x2-x1) / t_area;
+	_tri.bary[1][2] = -(_tri.bary[1][0]*x1 + _tri.bary[1][1]*y1);
+}
 
-						// position in WS
-						t_ae->el->posW += t_ae->el->dPosW;
-						t_ae->er->posW += t_ae->er->dPosW;
-					}
+void CScanLine::_resolveVisibility()
+{
+	if (mVisMinY > mVisMaxY)
+		return;
 
-					++itae;
-				}
-			}//end for update edges
-			++mCurY;
+	if (mRenderState.isTiled() || mRenderState.isBanded())
+	{
+		// the rows are independent
+		mThreadPool.parallelFor(mVisMaxY - mVisMinY + 1, [this](int _i) {
+			_shadeRow(mVisMinY + _i);
+		});
+	}
+	else
+	{
+		for (int y=mVisMinY; y<=mVisMaxY; ++y)
+		{
+			_shadeRow(y);
 		}
 	}
 }
 
-void CScanLine::_setFrameBuffer(int _y, int _x, Color4d& _clr)
+void CScanLine::_shadeRow(int _y)
+{
+	const VertexBuffer &vb = mVertexBuffer;
+	VisSample *t_row = &mVisBuffer[_y*mWidth];
+	unsigned int *t_pixels = _frameRow(_y);
+	for (int x=0; x<mWidth; ++x)
+	{
+		VisSample &t_s = t_row[x];
+		if (t_s.id < 0)
+			continue;
+
+		const Triangle &tri = *(mTriArray[t_s.id]);
+		int v1 = tri.vertex[0], v2 = tri.vertex[1], v3 = tri.vertex[2];
+		double l2 = t_s.l2, l3 = t_s.l3;
+
+		Color4d c1 = vb.color(v1);
+		Color4d t_clr = c1 + l2*(vb.color(v2) - c1) + l3*(vb.color(v3) - c1);
+		Vec4d p1 = vb.posWorld(v1);
+		Vec4d t_posW = p1 + l2*(vb.posWorld(v2) - p1) + l3*(vb.posWorld(v3) - p1);
+		Normald n1 = vb.normalWorld(v1);
+		Normald t_norW = n1 + l2*(vb.normalWorld(v2) - n1) + l3*(vb.normalWorld(v3) - n1);
+
+		_calculateLight(t_posW, t_norW, t_clr, _tileLights(x, _y));
+		_setFrameBuffer(t_pixels, _y, x, t_clr);
+		t_s.id = -1;
+	}
+}
+
+void CScanLine::_setFrameBuffer(unsigned int* _row, int _y, int _x, Color4d& _clr)
 {
 	if (mRenderState.isBlending())
 	{
-		QRgb oldclr = mImg->pixel(_x, mHeight-_y-1);
+		unsigned int oldclr = _row ? _row[_x] : mTarget->pixel(_x, mHeight-_y-1);
 		double t_a = _clr[3];
-		_clr[0] = _clr[0] * t_a + qRed(oldclr) * (1-t_a);
-		_clr[1] = _clr[1] * t_a + qGreen(oldclr) * (1-t_a);
-		_clr[2] = _clr[2] * t_a + qBlue(oldclr) * (1-t_a);
+		_clr[0] = _clr[0] * t_a + SL_RED(oldclr) * (1-t_a);
+		_clr[1] = _clr[1] * t_a + SL_GREEN(oldclr) * (1-t_a);
+		_clr[2] = _clr[2] * t_a + SL_BLUE(oldclr) * (1-t_a);
 		_clr[3] = 1.0;
 	}
 	_clr *= 255.0;
-	mImg->setPixel(_x, mHeight-_y-1, 
-		qRgb(SATURATE(_clr[0]), SATURATE(_clr[1]), SATURATE(_clr[2])) );
+	// opaque, so a 32-bit pixel is stored as is in any of the formats
+	unsigned int t_rgb = SL_RGB(int(SATURATE(_clr[0])), int(SATURATE(_clr[1])), int(SATURATE(_clr[2])));
+	if (_row)
+		_row[_x] = t_rgb;
+	else
+		mTarget->setPixel(_x, mHeight-_y-1, t_rgb);
 }
 
-void CScanLine::_calculateLight(const Vec4d& _pos, const Normald& _nor, Color4d& _clr)
+void CScanLine::_calculateLight(const Vec4d& _pos, const Normald& _nor, Color4d& _clr, 
+							   const LightList& _lights)
 {
-	if ( !mRenderState.isLighting())
+	if ( !mRenderState.isLighting() || mActiveLights.empty())
 		return;
 
-	Normald normal = _nor.normed();
+	bool t_fast = mRenderState.isFastMath();
+	Normald normal = _nor;
+	sl_normalize(normal, t_fast);
 	Color4d diffuse, ambient, specular, globalAmbient, finalColor;
-	double NdotL, NdotHV, dist, att;
+	double NdotL, NdotHV, dist, att, spot;
 
 	Vec3d lightDir, halfVector;
 	Vec3d eyeDir = mCamera.pos() - _pos;
-	dist = eyeDir.length();
-	eyeDir.norm();
-
+	sl_normalize(eyeDir, t_fast);
 
-	switch(mLight.type)
+	globalAmbient = mMaterial.ambient * mGlobalAmbient;
+	finalColor = globalAmbient;
+	for (size_t i=0; i<_lights.size(); ++i)
 	{
-	case SL_LIGHT_DIRECTIONAL:
-		lightDir = -mLight.direction;
-		lightDir.norm();
-		NdotL = std::max((normal DOT lightDir), 0.0);
-		//diffuse = mMaterial.diffuse * mLight.diffuse;
-		//ambient = mMaterial.ambient * mLight.ambient;
-		globalAmbient = mMaterial.ambient * mGlobalAmbient;
-		finalColor =globalAmbient;
-		// specular
-		if (NdotL>0)
+		const Light &light = mLights[_lights[i]];
+		const LightSetup &t_setup = mLightSetup[_lights[i]];
+		if (light.type == SL_LIGHT_DIRECTIONAL)
 		{
-			diffuse = _clr * mLight.diffuse;
-			ambient = _clr * mLight.ambient;
-			halfVector = lightDir + eyeDir;
-			halfVector.norm();
-			NdotHV = std::max((normal DOT halfVector), 0.0);
-			specular = mMaterial.specular * mLight.specular * std::pow(NdotHV, mMaterial.shiness);
-			finalColor +=  NdotL * diffuse + specular + ambient;
+			lightDir = t_setup.dir;
+			NdotL = std::max((normal DOT lightDir), 0.0);
+			//diffuse = mMaterial.diffuse * light.diffuse;
+			//ambient = mMaterial.ambient * light.ambient;
+			// specular
+			if (NdotL>0)
+			{
+				diffuse = _clr * light.diffuse;
+				ambient = _clr * light.ambient;
+				halfVector = lightDir + eyeDir;
+				sl_normalize(halfVector, t_fast);
+				NdotHV = std::max((normal DOT halfVector), 0.0);
+				specular = mMaterial.specular * light.specular * 
+					(t_fast ? mSpecularPow(NdotHV) : std::pow(NdotHV, mMaterial.shiness));
+				finalColor +=  NdotL * diffuse + specular + ambient;
+			}
+			continue;
+		}
+
+		// SL_LIGHT_POINT and SL_LIGHT_SPOT
+		lightDir = light.position - _pos;
+		dist = sl_normalize(lightDir, t_fast);
+		if (dist > t_setup.radius)
+			continue;
+		spot = 1.0;
+		if (light.type == SL_LIGHT_SPOT && t_setup.cosCutoff > -1.0)
+		{
+			double t_cos = -(lightDir DOT t_setup.dir);
+			if (t_cos < t_setup.cosCutoff)
+				continue;
+			spot = std::pow(std::max(t_cos, 0.0), double(light.spot_exponent));
 		}
-		_clr = finalColor;
-		_clr[3] = 1.0;
-		break;
-	case SL_LIGHT_POINT:
-		lightDir = mLight.position - _pos;
-		lightDir.norm();
 		NdotL = std::max((normal DOT lightDir), 0.0);
-		//diffuse = mMaterial.diffuse * mLight.diffuse;
-		//ambient = mMaterial.ambient * mLight.ambient;
-		globalAmbient = mMaterial.ambient * mGlobalAmbient;
-		finalColor = globalAmbient;
 		// specular
 		if (NdotL>0)
 		{
-			diffuse = _clr * mLight.diffuse;
-			ambient = _clr * mLight.ambient;
-			att = 1.0 / (mLight.attenuation0 + mLight.attenuation1 * dist +
-				mLight.attenuation2 * dist *dist);
-			halfVector = (lightDir + eyeDir).normed();
+			diffuse = _clr * light.diffuse;
+			ambient = _clr * light.ambient;
+			att = 1.0 / (light.attenuation0 + light.attenuation1 * dist +
+				light.attenuation2 * dist *dist);
+			if (light.type == SL_LIGHT_SPOT)
+				att *= spot;
+			halfVector = lightDir + eyeDir;
+			sl_normalize(halfVector, t_fast);
 			NdotHV = std::max((normal DOT halfVector), 0.0);
-			specular = mMaterial.specular * mLight.specular * std::pow(NdotHV, mMaterial.shiness);
+			specular = mMaterial.specular * light.specular * 
+				(t_fast ? mSpecularPow(NdotHV) : std::pow(NdotHV, mMaterial.shiness));
 			// final color
 			finalColor += att * (NdotL * diffuse + ambient + specular);
 		}
-		_clr = finalColor;
-		_clr[3] = 1.0;
-		break;
-	case SL_LIGHT_SPOT:
-		break;
-	case SL_LIGHT_NONE:
-		break;
-	default:
-		break;
 	}
+	_clr = finalColor;
+	_clr[3] = 1.0;
 }
 
 //------------------------------------------------------------------------------
@@ -762,56 +2176,186 @@ void CScanLine::ortho(double left, double right, double bottom, double top,
 	mCamera.ortho(left, right, bottom, top, near, far);
 }
 
+bool CScanLine::sphereInFrustum(const Vec3d& _center, double _radius)
+{
+	return mCamera.sphereInFrustum(_center, _radius);
+}
+
+bool CScanLine::boxInFrustum(const Vec3d& _min, const Vec3d& _max)
+{
+	return mCamera.boxInFrustum(_min, _max);
+}
+
+const Vec4d* CScanLine::frustumPlanes()
+{
+	return mCamera.frustumPlanes();
+}
+
+void CScanLine::buildDepthPyramid()
+{
+	if (!mbInitialised) return;
+
+	mDepthPyramid.build(mZBuffer, mWidth, mHeight);
+}
+
+bool CScanLine::boxOccluded(const Vec3d& _min, const Vec3d& _max)
+{
+	if (!mbInitialised || mDepthPyramid.empty())
+		return false;
+
+	// the screen rectangle of the corners and the nearest of their depths,
+	// which bounds the depth of any point inside on a line of sight
+	const Mat44d &m = mCamera.matrix();
+	double t_hw = mWidth*0.5, t_hh = mHeight*0.5;
+	double t_minX = DBL_MAX, t_minY = DBL_MAX, t_maxX = -DBL_MAX, t_maxY = -DBL_MAX;
+	double t_minZ = DBL_MAX;
+	for (int i=0; i<8; ++i)
+	{
+		double x = (i&1) ? _max[0] : _min[0];
+		double y = (i&2) ? _max[1] : _min[1];
+		double z = (i&4) ? _max[2] : _min[2];
+		double cx = m[0][0]*x + m[0][1]*y + m[0][2]*z + m[0][3];
+		double cy = m[1][0]*x + m[1][1]*y + m[1][2]*z + m[1][3];
+		double cz = m[2][0]*x + m[2][1]*y + m[2][2]*z + m[2][3];
+		double cw = m[3][0]*x + m[3][1]*y + m[3][2]*z + m[3][3];
+		// a corner before the near plane, the box may cover anything
+		if (!(cw > 0) || cz < -cw)
+			return false;
+		double sx = (cx/cw + 1)*t_hw, sy = (cy/cw + 1)*t_hh;
+		t_minX = min(t_minX, sx);
+		t_maxX = max(t_maxX, sx);
+		t_minY = min(t_minY, sy);
+		t_maxY = max(t_maxY, sy);
+		t_minZ = min(t_minZ, 0.5*cz/cw + 0.5);
+	}
+
+	// a pixel is covered by the rounded corners, one more on each side
+	// keeps off the rounding
+	t_minX = max(t_minX, -1.0);
+	t_minY = max(t_minY, -1.0);
+	t_maxX = min(t_maxX, double(mWidth));
+	t_maxY = min(t_maxY, double(mHeight));
+	return mDepthPyramid.isOccluded(int(floor(t_minX))-1, int(floor(t_minY))-1, 
+		int(ceil(t_maxX))+1, int(ceil(t_maxY))+1, t_minZ * mZBuffer.scale());
+}
+
+double CScanLine::pixelSize(const Vec3d& _center, double _radius)
+{
+	if (!mbInitialised) return 0;
+
+	// w is the distance along the view direction for a perspective, and 1
+	// for a parallel projection. A pixel spans 2*w/(height*P[1][1]).
+	const Mat44d &m = mCamera.matrix();
+	double w = m[3][0]*_center[0] + m[3][1]*_center[1] + m[3][2]*_center[2] + m[3][3];
+	w -= _radius * sqrt(m[3][0]*m[3][0] + m[3][1]*m[3][1] + m[3][2]*m[3][2]);
+	if (w <= 0)
+		return 0;
+	return 2*w / (mHeight * fabs(mCamera.projectMatrix()[1][1]));
+}
+
 //------------------------------------------------------------------------------
 // Transformations
 //------------------------------------------------------------------------------
 void CScanLine::_normalizeDeviceCoordinates()
 {
-	VBufferItor it = mVertexBuffer.begin();
-	VBufferItor it_end = mVertexBuffer.end();
-	for (; it!=it_end; ++it)
+	// perspective division
+	VertexBuffer &vb = mVertexBuffer;
+	int v_num = vb.size();
+	double *t_sx = &vb.sx[0], *t_sy = &vb.sy[0], *t_sz = &vb.sz[0];
+	const double *t_sw = &vb.sw[0];
+	for (int i=0; i<v_num; ++i)
 	{
-		Vertex *t_pv = *it;
-		t_pv->posWorld[0] /= t_pv->posWorld[3];
-		t_pv->posWorld[1] /= t_pv->posWorld[3];
-		t_pv->posWorld[2] /= t_pv->posWorld[3];
-		t_pv->posWorld[3] = 1;
+		t_sx[i] = t_sx[i] / t_sw[i];
+		t_sy[i] = t_sy[i] / t_sw[i];
+		t_sz[i] = t_sz[i] / t_sw[i];
 	}
 }
 
 void CScanLine::_screenCoordinates()
 {
-	VBufferItor it = mVertexBuffer.begin();
-	VBufferItor it_end = mVertexBuffer.end();
-	for (; it!=it_end; ++it)
+	// viewport mapping
+	VertexBuffer &vb = mVertexBuffer;
+	int v_num = vb.size();
+	double *t_sx = &vb.sx[0], *t_sy = &vb.sy[0], *t_sz = &vb.sz[0];
+	double t_hw = mWidth*0.5, t_hh = mHeight*0.5;
+	for (int i=0; i<v_num; ++i)
 	{
-		Vertex *t_pv = *it;
 		// round the coordinates
-		t_pv->posScreen[0] = ROUND((t_pv->posScreen[0]+1)*mWidth*0.5);
-		t_pv->posScreen[1] = ROUND((t_pv->posScreen[1]+1)*mHeight*0.5);
-		t_pv->posScreen[2] = 0.5 * t_pv->posScreen[2] + 0.5;
+		t_sx[i] = ROUND((t_sx[i]+1)*t_hw);
+		t_sy[i] = ROUND((t_sy[i]+1)*t_hh);
+		t_sz[i] = 0.5 * t_sz[i] + 0.5;
 	}
 }
 
+void CScanLine::_clipCodes()
+{
+	VertexBuffer &vb = mVertexBuffer;
+	int v_num = vb.size();
+	const double *t_sx = &vb.sx[0], *t_sy = &vb.sy[0], *t_sz = &vb.sz[0], *t_sw = &vb.sw[0];
+	unsigned char *t_clip = &vb.clip[0];
+	// the guard band, in units of w
+	double t_gx = 1.0 + CLIP_GUARD_BAND / (mWidth*0.5);
+	double t_gy = 1.0 + CLIP_GUARD_BAND / (mHeight*0.5);
+	for (int i=0; i<v_num; ++i)
+	{
+		double t_gw = t_gx*t_sw[i], t_hw = t_gy*t_sw[i];
+		t_clip[i] = (t_sz[i] < -t_sw[i] ? CLIP_NEAR : 0) | (t_sz[i] > t_sw[i] ? CLIP_FAR : 0) |
+			(t_sx[i] < -t_gw ? CLIP_LEFT : 0) | (t_sx[i] > t_gw ? CLIP_RIGHT : 0) |
+			(t_sy[i] < -t_hw ? CLIP_BOTTOM : 0) | (t_sy[i] > t_hw ? CLIP_TOP : 0);
+	}
+}
+
+void CScanLine::_projectVertex(int _i)
+{
+	VertexBuffer &vb = mVertexBuffer;
+	double t_hw = mWidth*0.5, t_hh = mHeight*0.5;
+	vb.sx[_i] = vb.sx[_i] / vb.sw[_i];
+	vb.sy[_i] = vb.sy[_i] / vb.sw[_i];
+	vb.sz[_i] = vb.sz[_i] / vb.sw[_i];
+	vb.sx[_i] = ROUND((vb.sx[_i]+1)*t_hw);
+	vb.sy[_i] = ROUND((vb.sy[_i]+1)*t_hh);
+	vb.sz[_i] = 0.5 * vb.sz[_i] + 0.5;
+}
+
+Vec4d CScanLine::_clipPosition(int _i)
+{
+	const VertexBuffer &vb = mVertexBuffer;
+	const Mat44d &m = mCamera.matrix();
+	double x = vb.x[_i], y = vb.y[_i], z = vb.z[_i], w = vb.w[_i];
+	return Vec4d(m[0][0]*x + m[0][1]*y + m[0][2]*z + m[0][3]*w,
+		m[1][0]*x + m[1][1]*y + m[1][2]*z + m[1][3]*w,
+		m[2][0]*x + m[2][1]*y + m[2][2]*z + m[2][3]*w,
+		m[3][0]*x + m[3][1]*y + m[3][2]*z + m[3][3]*w);
+}
+
 void CScanLine::_modelViewProjectionTransform()
 {
-	Vertex *t_pv;
-	Vec4d t_pos;
+	VertexBuffer &vb = mVertexBuffer;
+	int v_num = vb.size();
+	if (v_num==0)
+		return;
 
-	VBufferItor it = mVertexBuffer.begin();
-	VBufferItor it_end = mVertexBuffer.end();
-	for (; it!=it_end; ++it)
+	// transform to clip space
+	const Mat44d &m = mCamera.matrix();
+	const double *t_x = &vb.x[0], *t_y = &vb.y[0], *t_z = &vb.z[0], *t_w = &vb.w[0];
+	double *t_sx = &vb.sx[0], *t_sy = &vb.sy[0], *t_sz = &vb.sz[0], *t_sw = &vb.sw[0];
+	for (int i=0; i<v_num; ++i)
 	{
-		t_pv = *it;
-		t_pos = t_pv->posWorld;
-		mCamera.transform(t_pos);
-		t_pv->posScreen[0] = t_pos[0] / t_pos[3];
-		t_pv->posScreen[1] = t_pos[1] / t_pos[3];
-		t_pv->posScreen[2] = t_pos[2] / t_pos[3];
+		t_sx[i] = m[0][0]*t_x[i] + m[0][1]*t_y[i] + m[0][2]*t_z[i] + m[0][3]*t_w[i];
+		t_sy[i] = m[1][0]*t_x[i] + m[1][1]*t_y[i] + m[1][2]*t_z[i] + m[1][3]*t_w[i];
+		t_sz[i] = m[2][0]*t_x[i] + m[2][1]*t_y[i] + m[2][2]*t_z[i] + m[2][3]*t_w[i];
+		t_sw[i] = m[3][0]*t_x[i] + m[3][1]*t_y[i] + m[3][2]*t_z[i] + m[3][3]*t_w[i];
+	}
 
-		// gouraud shading
-		if ( mRenderState.isFlatShading() )
-			_calculateLight(t_pv->posWorld, t_pv->normalWorld, t_pv->color);
+	// gouraud shading
+	if ( mRenderState.isFlatShading() )
+	{
+		for (int i=0; i<v_num; ++i)
+		{
+			Color4d t_clr = vb.color(i);
+			_calculateLight(vb.posWorld(i), vb.normalWorld(i), t_clr, mActiveLights);
+			vb.setColor(i, t_clr);
+		}
 	}
 }
 
@@ -823,6 +2367,13 @@ void CScanLine::_vertexTransform()
 //------------------------------------------------------------------------------
 // Render States
 //------------------------------------------------------------------------------
+void CScanLine::setDepthFormat(DepthFormat _format)
+{
+	mZBuffer.setFormat(_format);
+	if (mbInitialised)
+		_clearDepth(1.0);
+}
+
 void CScanLine::setRenderState(int _state, int _val)
 {
 	mRenderState.setState(_state, _val);
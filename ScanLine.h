@@ -1,30 +1,50 @@
 #pragma once
 
 #include <vector>
-#include <list>
-#include <map>
 #include "BasicStructure.h"
 #include "Camera.h"
 #include "RenderState.h"
+#include "FramePool.h"
+#include "ThreadPool.h"
+#include "SpanFill.h"
+#include "DepthBuffer.h"
+#include "HiZBuffer.h"
+#include "DepthPyramid.h"
+#include "RenderTarget.h"
+#include "FastMath.h"
 
-class QImage;
 class CPoint3D;
 
 class CScanLine
 {
 private:
 
-	// 3D vertex
-	class Vertex 
+	// 3D vertices, one array per component so that the transformation
+	// stages stream through contiguous memory
+	class VertexBuffer
 	{
 	public:
-		Vec4d posWorld;			// position in world space
-		Vec3d posScreen;		// position in screen space
-		Color4d color;			// color
-		Normald normalWorld;	// normal in world space
-		Vertex(double _x, double _y, double _z, double _w)
-			: posWorld(_x, _y, _z, _w)
+		std::vector<double> x, y, z, w;		// position in world space
+		std::vector<double> sx, sy, sz, sw;	// position in clip, then screen space
+		std::vector<double> r, g, b, a;		// color
+		std::vector<double> nx, ny, nz;		// normal in world space
+		std::vector<unsigned char> clip;	// planes it is outside of, see _clipCodes()
+
+		int size() const { return int(x.size()); }
+		void clear();
+		void resize(int _n);
+		void push_back(const Vec4d& _pos, const Color4d& _clr, const Normald& _nor);
+		// append the position in world space, color and normal _t of the
+		// way from _i to _j, returns its index
+		int push_lerp(int _i, int _j, double _t);
+
+		Vec4d posWorld(int i) const { return Vec4d(x[i], y[i], z[i], w[i]); }
+		Vec3d posScreen(int i) const { return Vec3d(sx[i], sy[i], sz[i]); }
+		Color4d color(int i) const { return Color4d(r[i], g[i], b[i], a[i]); }
+		Normald normalWorld(int i) const { return Normald(nx[i], ny[i], nz[i]); }
+		void setColor(int i, const Color4d& _clr)
 		{
+			r[i] = _clr[0]; g[i] = _clr[1]; b[i] = _clr[2]; a[i] = _clr[3];
 		}
 	};
 
@@ -42,10 +62,16 @@ private:
 		Normald normalW;	// ˵㷨World Space
 		Normald dNorW;	// ɨ߷World Space
 
+		int y;				// scanline where the edge starts
+
 		Vec4d posW;			// ˵λãWorld Space
 		Vec4d dPosW;		// ɨλòWorld Space
 
 		int id;				// α
+
+		// SL_FIXED_POINT: x in 16.16, the color as in FixedSpanInfo
+		int fx, fdx;
+		int fclr[4], fdclr[4];
 	};
 
 	class ActiveEdge 
@@ -62,7 +88,11 @@ private:
 		double dzy;		/*	yƹһɨʱ
 							ƽƽ淽̣dzyb/c
 							(c0)*/
-	//	int id;		// ѾԴEdgeеõ
+		int id;			// triangle id, the active edge list is sorted by it
+
+		// SL_FIXED_POINT: zl, dzx and dzy, see CDepthBuffer::fixedShift()
+		bool fixed;
+		int fzl, fdzx, fdzy;
 	};
 
 	// yMaxηӦ
@@ -71,40 +101,113 @@ private:
 	public:
 		Vec3d normal;	// 淨(Screen Space
 		double d;		// surface equation
+		int edge;		// first of its edges in mEdges
+		int nEdges;		// number of edges in mEdges
+		int minX, maxX, minY, maxY;	// bounding box on the screen
+		double zNear;	// no pixel of it is nearer, in depth buffer units
+		int vertex[3];		// SL_VISIBILITY: corners in mVertexBuffer
+		double bary[2][3];	// and the weights of the last two, a*x + b*y + c
+		bool fixed;			// SL_FIXED_POINT: its spans are stepped in fixed point
+		int fdclr[4];		// with this color step along x
 		int dy;			// οԽɨĿ
 	};
 
-	typedef std::list<Edge*> EdgeList;
-	typedef EdgeList::iterator EListIterator;
+	typedef std::vector<Edge> EdgeArray;
+	typedef EdgeArray::iterator EArrayItor;
 
-	typedef std::map<int, EdgeList, std::less<int> > EdgeTable;
-	typedef EdgeTable::iterator ETableIterator;
+	typedef std::vector<int> EdgeBucketArray;
 
 	typedef std::vector<Triangle*> TriangleArray;
 	typedef TriangleArray::iterator TArrayItor;
 
-	typedef std::map<int, ActiveEdge, std::less<int> > ActiveEdgeList;
+	// kept sorted by triangle id, so that triangles are filled in the
+	// order they were submitted
+	typedef std::vector<ActiveEdge> ActiveEdgeList;
 	typedef ActiveEdgeList::iterator AEListItor;
 
-	typedef std::vector<Vertex*> VertexBuffer;
-	typedef VertexBuffer::iterator VBufferItor;
+	struct ActiveEdgeLess
+	{
+		bool operator()(const ActiveEdge& _ae, int _id) const { return _ae.id < _id; }
+	};
+
 
 	//typedef std::vector<Color4u> ColorBuffer;
 	//typedef std::vector<Normald> NormalBuffer;
 	//typedef NormalBuffer::iterator NorBufItor;
 
-	//typedef std::vector<Light> LightArray;
-	//typedef LightArray::iterator LightItor;
+	typedef std::vector<Light> LightArray;
+	typedef LightArray::iterator LightItor;
+
+	// indices into mLights, increasing
+	typedef std::vector<int> LightList;
+	typedef std::vector<LightList> LightListArray;
+
+	// what the pixels need of a light, set up by _setupLights()
+	struct LightSetup
+	{
+		Vec3d dir;			// unit vector to a directional light, along a spot
+		double radius;		// nothing farther is lit, DBL_MAX if it never fades
+		double cosCutoff;	// SL_LIGHT_SPOT: nor outside the cone
+	};
+	typedef std::vector<LightSetup> LightSetupArray;
+
+	// triangle ids binned to a screen tile, increasing
+	typedef std::vector<int> TileBin;
+	typedef std::vector<TileBin> TileBinArray;
+
+	// a triangle scanned on its own, with private copies of its edges
+	class TriangleScan
+	{
+	public:
+		Edge edges[3];		// ordered by first row, as in the edge table
+		int nEdges;
+		int next;			// first edge not reached yet
+		ActiveEdge ae;
+		bool active;
+	};
+	typedef std::vector<TriangleScan> TriangleScanArray;
+
+	// SL_BANDED: the state of one band of scan lines
+	class ScanBand
+	{
+	public:
+		TileBin seedIds;			// triangles crossing the first row
+		TriangleScanArray seeds;	// and their edges stepped to it
+		EdgeArray edges;			// copies of the edges starting in the band
+		ActiveEdgeList ael;
+		ActiveEdgeList aeNew;
+	};
+	typedef std::vector<ScanBand> ScanBandArray;
+
+	// SL_VISIBILITY: the fragment that won the depth test, until it is lit
+	struct VisSample
+	{
+		int id;			// triangle in mTriArray, -1 for none
+		float l2, l3;	// weights of its second and third corner
+	};
+	typedef std::vector<VisSample> VisBuffer;
 
 	typedef std::vector<int> IndexBuffer;
 	typedef IndexBuffer::iterator IBufferItor;
 
+	// post-transform vertex cache: the vertex of a vindex in the current
+	// draw, if stamp is the draw's. The same vindex with other nindices is
+	// chained in mVertexCacheMore.
+	struct VertexCacheEntry
+	{
+		unsigned int stamp, nindex;
+		int slot;		// vertex in mVertexBuffer
+		int next;		// in mVertexCacheMore, -1 for none
+	};
+	typedef std::vector<VertexCacheEntry> VertexCache;
+
 public:
 	CScanLine();
-	CScanLine(int _w, int _h, QImage *_img);
+	CScanLine(CRenderTarget *_target);
 	~CScanLine(void);
 
-	void setRenderTarget(int _w, int _h, QImage *_img);
+	// the target is not owned. Set it again after it changes size.
+	void setRenderTarget(CRenderTarget *_target);
 
 	// start create target
 	void begin(TargetType _type);
@@ -120,7 +223,35 @@ public:
 	void color3i(unsigned char _r, unsigned char _g, unsigned char _b);
 	void color4i(unsigned char _r, unsigned char _g, unsigned char _b, unsigned char _a);
 
-	//void setLight(const Light& light);
+	// vertex arrays, read in place by drawElements(). _stride is the byte
+	// offset between consecutive elements, 0 if they are tightly packed.
+	// A null pointer disables the array (the current normal/color is used).
+	// With _perPrimitive the colors are indexed by the primitive drawn
+	// instead of the vertex, so each triangle or quad has a flat color.
+	void vertexPointer(int _stride, const float* _pointer);
+	void normalPointer(int _stride, const float* _pointer);
+	void colorPointer(int _size, int _stride, const unsigned char* _pointer, 
+		bool _perPrimitive = false);
+
+	// draw _count vertices fetched from the arrays through the indices.
+	// Normals use _nindices if given, otherwise _vindices; colors use
+	// _vindices, or the number of the primitive, see colorPointer(). The indices of one primitive (3 for triangles, 4 for quads)
+	// are packed, _istride is the byte offset between primitives, so that
+	// COBJtriangle::vindices/nindices can be passed directly.
+	void drawElements(TargetType _type, int _count, const unsigned int* _vindices, 
+		const unsigned int* _nindices = 0, int _istride = 0);
+
+	// the lights are summed in this order, the SL_LIGHT_NONE ones skipped.
+	// Light 0 exists from the start. Without any other type the lighting
+	// keeps the vertex colors. A point or spot light fades out at the
+	// distance its attenuation brings it below half a step of an 8-bit
+	// color, so attenuate them to let the pixels skip the far ones.
+	int addLight(const Light& _light);
+	void setLight(int _i, const Light& _light);
+	Light& light(int _i) { return mLights[_i]; }
+	int lightCount() const { return int(mLights.size()); }
+	void clearLights();
+
 	void clear(int _target, const Color4u& _c = Color4u(0,0,0,255), double _depth = 1.0);
 
 	// camera related, facade design model
@@ -128,32 +259,139 @@ public:
 	void perspective(double fovy, double aspect, double zNear, double zFar);
 	void frustum(double left, double right, double bottom, double top, double near, double far);
 	void ortho(double left, double right, double bottom, double top, double near, double far);
+	// false if the volume is out of sight, to skip what is inside before
+	// submitting it
+	bool sphereInFrustum(const Vec3d& _center, double _radius);
+	bool boxInFrustum(const Vec3d& _min, const Vec3d& _max);
+	// the 6 planes of the view frustum, see CCamera::frustumPlanes()
+	const Vec4d* frustumPlanes();
+	// occlusion culling: draw the likely occluders, buildDepthPyramid(),
+	// then skip what is inside the boxes found hidden behind them. The
+	// pyramid is dropped when the depth buffer is cleared.
+	void buildDepthPyramid();
+	bool boxOccluded(const Vec3d& _min, const Vec3d& _max);
+	// the smallest length a pixel spans inside the sphere, to choose a
+	// level of detail. 0 if the sphere reaches the eye.
+	double pixelSize(const Vec3d& _center, double _radius);
 
 	void setRenderState(int _state, int _val);
 	const CRenderState& renderState() { return mRenderState; }
 
+	// storage of the z buffer, SL_DEPTH_FLOAT64 by default. Changing it
+	// clears the depths to 1.0.
+	void setDepthFormat(DepthFormat _format);
+	DepthFormat depthFormat() const { return mZBuffer.format(); }
+
+	// threads used by the SL_TILED and SL_BANDED modes, 0 for one per
+	// hardware thread
+	void setThreadCount(int _n);
+	int threadCount() const { return mThreadPool.threadCount(); }
+
+	enum { TILE_SIZE = 64 };	// SL_TILED tile width and height in pixels
+
 private:
 	void _init();
 	void _clear();
+	// mZBuffer, mHiZ and mDepthPyramid
+	void _clearDepth(double _depth);
 	bool _compare_edges(const Edge* e1, const Edge* e2);
-	bool _addEdge(const Vertex* _v1, const Vertex* _v2, int _id);
-	void _addATriangle(const Vertex *_v1, const Vertex *_v2, const Vertex *_v3);
+	bool _addEdge(int _v1, int _v2, int _id, int _maxY);
+	// reject or clip the triangle, then _setupTriangle() the pieces
+	void _addATriangle(int _v1, int _v2, int _v3);
+	// clip to the planes of _planes, adding the new corners to mVertexBuffer
+	void _clipTriangle(int _v1, int _v2, int _v3, int _planes);
+	// the edges of a triangle inside the near and far planes and the guard band
+	void _setupTriangle(int _v1, int _v2, int _v3);
 	void _addTriangles();
 	void _addTriangleStrip();
 	void _addTriangleFan();
 	void _addQuads();
 	void _addQuadStrip();
 	void _addPolygon();
-	// scan a line at mCurY
+	// gather the unique indexed vertices into mVertexBuffer, and the
+	// corners into mIndexBuffer
+	void _fetchElements(int _count, const unsigned int* _vindices, 
+		const unsigned int* _nindices, int _istride);
+	// counting sort of mEdges into mSortedET
+	void _sortEdgeTable();
+	// merge _aeNew into _ael
+	void _mergeActiveEdges(ActiveEdgeList& _ael, ActiveEdgeList& _aeNew);
+	// scan the lines from mCurY to mMaxY
 	void _scanLine();
+	// scan the lines [_y0, _y1). The edges starting at y are 
+	// _et[mETBucket[y]-_etBase ... mETBucket[y+1]-_etBase)
+	void _scanRows(int _y0, int _y1, Edge* _et, int _etBase, 
+		ActiveEdgeList& _ael, ActiveEdgeList& _aeNew);
+
+	// shared by _scanLine() and _scanTriangle(). The span is filled inside
+	// [_x0, _x1) only, but always interpolated from its left end, so that a
+	// pixel gets the same value whichever way it is reached.
+	void _activateEdges(ActiveEdge& _ae, Edge* _e1, Edge* _e2, int _y);
+	void _handOffEdge(ActiveEdge& _ae, Edge* _e);
+	void _fillSpan(const ActiveEdge& _ae, int _y, int _x0, int _x1);
+	bool _stepActiveEdge(ActiveEdge& _ae);
+
+	// SL_FIXED_POINT: false if the values of the triangle don't fit, it
+	// is stepped in double then. Called once its edges are added.
+	bool _setupFixedPoint(Triangle& _tri, int _v1, int _v2, int _v3);
+	void _fillFixedSpan(const ActiveEdge& _ae, int _y, int _x0, int _x1);
+
+	// SL_TILED: bin the triangles to tiles and scan the tiles in parallel
+	void _scanTiles();
+	// scan one triangle clipped to the rows [_y0, _y1) and columns [_x0, _x1).
+	// Its edges are stepped from the first row on a private copy.
+	void _scanTriangle(int _id, int _x0, int _y0, int _x1, int _y1);
+	void _beginTriangle(int _id, TriangleScan& _ts);
+	// Step 1 of _scanRows() for one triangle, false if it has no span at _y
+	bool _enterRow(TriangleScan& _ts, int _y);
+	// step the triangle up to row _y without filling
+	void _seekTriangle(TriangleScan& _ts, int _y);
+
+	// SL_BANDED: split the lines into bands scanned in parallel
+	void _scanBands();
+	void _scanBand(ScanBand& _band, int _y0, int _y1);
+
+	// SL_HALFSPACE: fill a triangle right away, testing the pixels of its
+	// bounding box against the edge functions, 8 at a time with AVX2 and 4
+	// with SSE2. Without per pixel lighting each row goes to mSpanFill.
+	void _rasterizeTriangle(int _v1, int _v2, int _v3);
+
+	// SL_VISIBILITY: the spans and _rasterizeTriangle() only resolve the
+	// depth into mVisBuffer, then the winners are lit row by row
+	void _setupBarycentrics(Triangle& _tri, int _v1, int _v2, int _v3);
+	void _resolveVisibility();
+	void _shadeRow(int _y);
 
 	// ȼ
-	void _calculateLight(const Vec4d& _pos, const Normald& _nor, Color4d& _clr);
-	void _setFrameBuffer(int _y, int _x, Color4d& _clr);
+	void _calculateLight(const Vec4d& _pos, const Normald& _nor, Color4d& _clr, 
+		const LightList& _lights);
+	// mLightSetup, mActiveLights and, for smooth shading, mTileLights
+	void _setupLights();
+	// the lights that may reach pixel (_x, _y)
+	const LightList& _tileLights(int _x, int _y) const
+	{
+		return mTileLights[(_y/TILE_SIZE)*mLightTilesX + _x/TILE_SIZE];
+	}
+	// _row is _frameRow(_y), when it is 0 the pixel goes through mTarget
+	void _setFrameBuffer(unsigned int* _row, int _y, int _x, Color4d& _clr);
+	// the 32-bit pixels of scan line _y, counted from the bottom of mTarget.
+	// 0 if mTarget has no bits().
+	unsigned int* _frameRow(int _y) const
+	{
+		if (!mFrameBits)
+			return 0;
+		return reinterpret_cast<unsigned int*>(mFrameBits + (mHeight-_y-1)*mFrameStride);
+	}
 
 	void _modelViewProjectionTransform();
 	void _normalizeDeviceCoordinates();
 	void _screenCoordinates();
+	// the outcodes of the vertices in clip space
+	void _clipCodes();
+	// _normalizeDeviceCoordinates() and _screenCoordinates() of one vertex
+	void _projectVertex(int _i);
+	// _modelViewProjectionTransform() of one vertex
+	Vec4d _clipPosition(int _i);
 
 	// Step 1. Vertex Transformation
 	void _vertexTransform();
@@ -165,29 +403,63 @@ private:
 	int mCurY;				// contained
 	TargetType mType;
 	int mHeight, mWidth;
-	QImage *mImg;
+	CRenderTarget *mTarget;
 
-	EdgeTable mSortedET;		// sorted edge table
+	EdgeArray mEdges;			// edges in creation order
+	EdgeArray mSortedET;		// sorted edge table, edges grouped by start scanline
+	EdgeBucketArray mETBucket;	// edges starting at y are [mETBucket[y], mETBucket[y+1])
 	ActiveEdgeList mAEL;		// active edge list
+	ActiveEdgeList mAENew;		// triangles activated at the current scan line
 	TriangleArray mTriArray;	// sorted polygon table
 
+	CFramePool<Triangle> mTriPool;		// storage of mTriArray
+
+	CThreadPool mThreadPool;
+	TileBinArray mTileBins;		// SL_TILED, row by row
+	int mTilesX, mTilesY;
+	ScanBandArray mBands;		// SL_BANDED, from row 0 up
+
+	SpanFillFunc mSpanFill;		// kernel for the spans without per pixel lighting
+	FixedSpanFillFunc mFixedSpanFill;	// and for SL_FIXED_POINT
+	bool mbFixedPoint;			// SL_FIXED_POINT applies to this batch
+	unsigned char *mFrameBits;	// pixels of mTarget, 0 if it is not 32-bit
+	int mFrameStride;			// bytes per line of mTarget
+
 	VertexBuffer mVertexBuffer; // 
 	IndexBuffer mIndexBuffer;	// 
-	std::vector<double> mZBuffer;
+	VertexCache mVertexCache;	// by vindex, kept across draws, see _fetchElements()
+	VertexCache mVertexCacheMore;
+	unsigned int mVertexStamp;
+	CDepthBuffer mZBuffer;
+	CHiZBuffer mHiZ;			// tile maxima of mZBuffer, for SL_HIZ
+	CDepthPyramid mDepthPyramid;	// of mZBuffer, see buildDepthPyramid()
+	VisBuffer mVisBuffer;		// SL_VISIBILITY, all empty between batches
+	bool mbDeferred;			// the batch goes through mVisBuffer
+	int mVisMinY, mVisMaxY;		// rows of the batch in mVisBuffer
 
 	//ColorBuffer mColorBuffer;	
 	//NormalBuffer mNormalBuffer;	
 
 	Color4d mCurColor;		// ɫ
 	Normald mCurNormal;		// 
+	const float *mVertexPtr;			// vertex arrays, see vertexPointer()
+	const float *mNormalPtr;
+	const unsigned char *mColorPtr;
+	int mVertexStride, mNormalStride, mColorStride;
+	int mColorSize;
+	bool mbColorPerPrimitive;
 
 	CCamera mCamera;		// 
 
 	CRenderState mRenderState;		// ״̬
-	//LightArray mLights;
+	LightArray mLights;
+	LightSetupArray mLightSetup;	// one per light
+	LightList mActiveLights;		// all but SL_LIGHT_NONE, for the vertices
+	LightListArray mTileLights;		// per tile of TILE_SIZE pixels, row by row
+	int mLightTilesX;
+	CPowTable mSpecularPow;	// x^shiness for SL_FAST_MATH
 
 public:
 	Material mMaterial;		// 
-	Light mLight;
 	Color4d mGlobalAmbient; // ȫֻ
 };
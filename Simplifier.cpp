@@ -0,0 +1,443 @@
+#include "Simplifier.h"
+#include "AccessObj.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <unordered_map>
+#include <cfloat>
+#include <cmath>
+
+// chunks are cut to keep every thread busy, but not smaller than this
+#define SIMPLIFY_MIN_CHUNK 16384
+// the cosine of the largest turn a collapse may give a triangle
+#define SIMPLIFY_MIN_COS 0.2
+
+// the sum of the squared distances to some planes, a symmetric 4x4 matrix,
+// and the number of them
+struct Quadric
+{
+	double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+	double count;
+};
+
+static inline void sp_addPlane(Quadric& _q, double _a, double _b, double _c, double _d)
+{
+	_q.a00 += _a*_a; _q.a01 += _a*_b; _q.a02 += _a*_c; _q.a03 += _a*_d;
+	_q.a11 += _b*_b; _q.a12 += _b*_c; _q.a13 += _b*_d;
+	_q.a22 += _c*_c; _q.a23 += _c*_d;
+	_q.a33 += _d*_d;
+	_q.count += 1;
+}
+
+static inline void sp_add(Quadric& _q, const Quadric& _other)
+{
+	_q.a00 += _other.a00; _q.a01 += _other.a01; _q.a02 += _other.a02; _q.a03 += _other.a03;
+	_q.a11 += _other.a11; _q.a12 += _other.a12; _q.a13 += _other.a13;
+	_q.a22 += _other.a22; _q.a23 += _other.a23;
+	_q.a33 += _other.a33;
+	_q.count += _other.count;
+}
+
+// the sum of the squared distances to the planes. Its root bounds the
+// distance to each of them.
+static inline double sp_error(const Quadric& _q, const double* _p)
+{
+	double x = _p[0], y = _p[1], z = _p[2];
+	double e = _q.a00*x*x + 2*_q.a01*x*y + 2*_q.a02*x*z + 2*_q.a03*x
+		+ _q.a11*y*y + 2*_q.a12*y*z + 2*_q.a13*y
+		+ _q.a22*z*z + 2*_q.a23*z
+		+ _q.a33;
+	return (e > 0) ? e : 0;
+}
+
+// the normal of the triangle, times twice its area
+static inline void sp_normal(const double* _p0, const double* _p1, const double* _p2, double* _n)
+{
+	double e1[3] = { _p1[0]-_p0[0], _p1[1]-_p0[1], _p1[2]-_p0[2] };
+	double e2[3] = { _p2[0]-_p0[0], _p2[1]-_p0[1], _p2[2]-_p0[2] };
+	_n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+	_n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+	_n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+}
+
+// 10 bits of _v, spread to every third bit
+static inline unsigned int sp_spread(unsigned int _v)
+{
+	_v = (_v | (_v << 16)) & 0x030000FF;
+	_v = (_v | (_v <<  8)) & 0x0300F00F;
+	_v = (_v | (_v <<  4)) & 0x030C30C3;
+	_v = (_v | (_v <<  2)) & 0x09249249;
+	return _v;
+}
+
+//////////////////////////////////////////////////////////////////////////
+CSimplifier::CSimplifier()
+: mThreads(0)
+{
+}
+
+float CSimplifier::simplify(const COBJmodel* _model, std::vector<COBJtriangle>& _triangles,
+							std::vector<unsigned int>& _groups, unsigned int _target,
+							float _maxError)
+{
+	unsigned int t_num = (unsigned int)_triangles.size();
+	if (t_num <= _target || _maxError <= 0)
+		return 0;
+	double t_maxCost = (double)_maxError * _maxError;
+
+	// by group, then along a Morton curve through the centroids
+	const CPoint3D *t_v = _model->vpVertices;
+	float t_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, t_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (unsigned int i=1; i<=_model->nVertices; ++i)
+	{
+		float p[3] = { t_v[i].x, t_v[i].y, t_v[i].z };
+		for (int k=0; k<3; ++k)
+		{
+			t_min[k] = std::min(t_min[k], p[k]);
+			t_max[k] = std::max(t_max[k], p[k]);
+		}
+	}
+	double t_scale[3];
+	for (int k=0; k<3; ++k)
+		t_scale[k] = (t_max[k] > t_min[k]) ? 1023.0 / (3.0 * (t_max[k] - t_min[k])) : 0;
+
+	std::vector< std::pair<unsigned long long, unsigned int> > t_keys(t_num);
+	for (unsigned int i=0; i<t_num; ++i)
+	{
+		const unsigned int *vi = _triangles[i].vindices;
+		unsigned int t_code = 0;
+		for (int k=0; k<3; ++k)
+		{
+			float c = (&t_v[vi[0]].x)[k] + (&t_v[vi[1]].x)[k] + (&t_v[vi[2]].x)[k];
+			unsigned int q = (unsigned int)((c - 3*t_min[k]) * t_scale[k]);
+			t_code |= sp_spread(std::min(q, 1023u)) << k;
+		}
+		t_keys[i] = std::make_pair(((unsigned long long)_groups[i] << 32) | t_code, i);
+	}
+	std::sort(t_keys.begin(), t_keys.end());
+	{
+		std::vector<COBJtriangle> t_triangles(t_num);
+		std::vector<unsigned int> t_groups(t_num);
+		for (unsigned int i=0; i<t_num; ++i)
+		{
+			t_triangles[i] = _triangles[t_keys[i].second];
+			t_groups[i] = _groups[t_keys[i].second];
+		}
+		_triangles.swap(t_triangles);
+		_groups.swap(t_groups);
+	}
+
+	// the chunks, in one group each. The vertices on their seams are locked,
+	// so a second round with the chunks moved by half of one collapses them.
+	CThreadPool t_pool;
+	t_pool.setThreadCount(mThreads);
+	unsigned int t_chunkSize = t_num;
+	if (t_pool.threadCount() > 1)
+		t_chunkSize = std::max((unsigned int)SIMPLIFY_MIN_CHUNK, t_num / (4*t_pool.threadCount()));
+
+	struct Chunk
+	{
+		unsigned int first, count, result;
+		double error;
+	};
+	std::vector<Chunk> t_chunks;
+	std::vector<int> t_owner(_model->nVertices + 1);
+	double t_error = 0;
+	for (int t_round=0; t_round<2 && t_num > _target; ++t_round)
+	{
+		t_chunks.clear();
+		for (unsigned int i=0; i<t_num; )
+		{
+			unsigned int t_size = t_chunkSize;
+			if (t_round == 1 && (i == 0 || _groups[i-1] != _groups[i]))
+				t_size = (t_chunkSize + 1) / 2;
+			unsigned int j = i;
+			while (j < t_num && j - i < t_size && _groups[j] == _groups[i])
+				++j;
+			Chunk t_chunk = { i, j - i, 0, 0 };
+			t_chunks.push_back(t_chunk);
+			i = j;
+		}
+		if (t_round == 1 && t_chunks.size() == 1)
+			break;
+
+		// the chunk using each vertex, -2 for more than one
+		std::fill(t_owner.begin(), t_owner.end(), -1);
+		for (size_t c=0; c<t_chunks.size(); ++c)
+		{
+			for (unsigned int i = t_chunks[c].first; i < t_chunks[c].first + t_chunks[c].count; ++i)
+			{
+				for (int k=0; k<3; ++k)
+				{
+					int &t_o = t_owner[_triangles[i].vindices[k]];
+					if (t_o == -1)
+						t_o = int(c);
+					else if (t_o != int(c))
+						t_o = -2;
+				}
+			}
+		}
+
+		unsigned int t_from = t_num;
+		t_pool.parallelFor(int(t_chunks.size()), [&](int _c) {
+			Chunk &t_chunk = t_chunks[_c];
+			unsigned int t_target = (unsigned int)((double)t_chunk.count * _target / t_from);
+			t_chunk.result = _simplifyChunk(_model, &_triangles[t_chunk.first], t_chunk.count,
+				t_target, t_maxCost, t_owner, _c, t_chunk.error);
+		});
+
+		// close the gaps the chunks left, the order stays
+		unsigned int t_end = 0;
+		for (size_t c=0; c<t_chunks.size(); ++c)
+		{
+			const Chunk &t_chunk = t_chunks[c];
+			std::copy(_triangles.begin() + t_chunk.first, 
+				_triangles.begin() + t_chunk.first + t_chunk.result, _triangles.begin() + t_end);
+			std::fill(_groups.begin() + t_end, _groups.begin() + t_end + t_chunk.result, _groups[t_chunk.first]);
+			t_end += t_chunk.result;
+			t_error = std::max(t_error, t_chunk.error);
+		}
+		_triangles.resize(t_end);
+		_groups.resize(t_end);
+		t_num = t_end;
+	}
+	return float(sqrt(t_error));
+}
+
+unsigned int CSimplifier::_simplifyChunk(const COBJmodel* _model, COBJtriangle* _triangles,
+										 unsigned int _count, unsigned int _target, double _maxCost,
+										 const std::vector<int>& _owner, int _chunk, double& _error)
+{
+	_error = 0;
+
+	// the vertices of the chunk, numbered from 0, with a normal of each
+	std::unordered_map<unsigned int, int> t_local;
+	t_local.reserve(_count);
+	std::vector<unsigned int> t_global, t_normal;
+	std::vector<int> t_tris(3*_count);
+	for (unsigned int i=0; i<_count; ++i)
+	{
+		for (int k=0; k<3; ++k)
+		{
+			std::pair<std::unordered_map<unsigned int, int>::iterator, bool> t_it = 
+				t_local.insert(std::make_pair(_triangles[i].vindices[k], int(t_global.size())));
+			if (t_it.second)
+			{
+				t_global.push_back(_triangles[i].vindices[k]);
+				t_normal.push_back(_triangles[i].nindices[k]);
+			}
+			t_tris[3*i+k] = t_it.first->second;
+		}
+	}
+	int t_verts = int(t_global.size());
+	const std::vector<int> t_corners(t_tris);	// as loaded, to tell the moved ones
+
+	std::vector<double> t_pos(3*t_verts);
+	std::vector<char> t_locked(t_verts);
+	for (int i=0; i<t_verts; ++i)
+	{
+		const CPoint3D &p = _model->vpVertices[t_global[i]];
+		t_pos[3*i] = p.x;
+		t_pos[3*i+1] = p.y;
+		t_pos[3*i+2] = p.z;
+		t_locked[i] = (_owner[t_global[i]] != _chunk);
+	}
+
+	// the ends of the edges which are not between two triangles
+	{
+		std::vector<unsigned long long> t_edges(3*_count);
+		for (unsigned int i=0; i<3*_count; ++i)
+		{
+			unsigned int a = t_tris[i], b = t_tris[i - i%3 + (i+1)%3];
+			t_edges[i] = ((unsigned long long)std::min(a, b) << 32) | std::max(a, b);
+		}
+		std::sort(t_edges.begin(), t_edges.end());
+		for (size_t i=0; i<t_edges.size(); )
+		{
+			size_t j = i;
+			while (j < t_edges.size() && t_edges[j] == t_edges[i])
+				++j;
+			if (j - i != 2)
+			{
+				t_locked[t_edges[i] >> 32] = 1;
+				t_locked[t_edges[i] & 0xffffffffu] = 1;
+			}
+			i = j;
+		}
+	}
+
+	// the planes of the triangles around each vertex
+	Quadric t_zero = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	std::vector<Quadric> t_quadrics(t_verts, t_zero);
+	for (unsigned int i=0; i<_count; ++i)
+	{
+		const int *t = &t_tris[3*i];
+		double n[3];
+		sp_normal(&t_pos[3*t[0]], &t_pos[3*t[1]], &t_pos[3*t[2]], n);
+		double t_len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+		if (t_len == 0)
+			continue;
+		n[0] /= t_len; n[1] /= t_len; n[2] /= t_len;
+		double d = -(n[0]*t_pos[3*t[0]] + n[1]*t_pos[3*t[0]+1] + n[2]*t_pos[3*t[0]+2]);
+		for (int k=0; k<3; ++k)
+			sp_addPlane(t_quadrics[t[k]], n[0], n[1], n[2], d);
+	}
+
+	// passes of independent collapses, the cheapest first. The cost is
+	// the mean squared distance to the planes, which does not grow with
+	// the number of them.
+	struct Collapse
+	{
+		double cost, error;
+		int from, to;
+		bool operator < (const Collapse& _o) const { return cost < _o.cost; }
+	};
+	std::vector<Collapse> t_collapses;
+	std::vector<int> t_remap(t_verts);
+	std::vector<int> t_adjStart(t_verts+1), t_adj;
+	std::vector<char> t_touched(t_verts);
+	std::vector<unsigned int> t_source(_count);	// triangle as loaded
+	for (unsigned int i=0; i<_count; ++i)
+		t_source[i] = i;
+	unsigned int t_live = _count;
+
+	while (t_live > _target)
+	{
+		// the triangles around each vertex
+		std::fill(t_adjStart.begin(), t_adjStart.end(), 0);
+		for (unsigned int i=0; i<3*t_live; ++i)
+			++t_adjStart[t_tris[i]+1];
+		for (int i=0; i<t_verts; ++i)
+			t_adjStart[i+1] += t_adjStart[i];
+		t_adj.resize(3*t_live);
+		{
+			std::vector<int> t_fill(t_adjStart.begin(), t_adjStart.end()-1);
+			for (unsigned int i=0; i<3*t_live; ++i)
+				t_adj[t_fill[t_tris[i]]++] = i/3;
+		}
+
+		// the best neighbour of each vertex free to move
+		t_collapses.clear();
+		for (int u=0; u<t_verts; ++u)
+		{
+			if (t_locked[u] || t_adjStart[u] == t_adjStart[u+1])
+				continue;
+			Collapse t_best = { DBL_MAX, DBL_MAX, u, -1 };
+			for (int a = t_adjStart[u]; a < t_adjStart[u+1]; ++a)
+			{
+				const int *t = &t_tris[3*t_adj[a]];
+				for (int k=0; k<3; ++k)
+				{
+					if (t[k] == u)
+						continue;
+					double t_error = sp_error(t_quadrics[u], &t_pos[3*t[k]]);
+					if (t_error < t_best.error)
+					{
+						t_best.error = t_error;
+						t_best.to = t[k];
+					}
+				}
+			}
+			if (t_quadrics[u].count > 0)
+				t_best.cost = t_best.error / t_quadrics[u].count;
+			if (t_best.to >= 0 && t_best.error <= _maxCost)
+				t_collapses.push_back(t_best);
+		}
+		if (t_collapses.empty())
+			break;
+		std::sort(t_collapses.begin(), t_collapses.end());
+
+		// a collapse inside the mesh removes two triangles. None in this
+		// pass costs more than the last of the ones needed.
+		size_t t_needed = std::min(t_collapses.size(), size_t((t_live - _target + 1) / 2));
+		double t_limit = t_collapses[std::max(t_needed, size_t(1)) - 1].cost;
+		std::fill(t_touched.begin(), t_touched.end(), 0);
+		for (int i=0; i<t_verts; ++i)
+			t_remap[i] = i;
+		unsigned int t_removed = 0, t_done = 0;
+		for (size_t c=0; c<t_collapses.size() && t_live - t_removed > _target; ++c)
+		{
+			const Collapse &t_c = t_collapses[c];
+			if (t_c.cost > t_limit)
+				break;
+			int u = t_c.from, v = t_c.to;
+			if (t_touched[u] || t_touched[v])
+				continue;
+
+			// the triangles which keep their area must not turn over
+			bool t_flips = false;
+			unsigned int t_lost = 0;
+			for (int a = t_adjStart[u]; a < t_adjStart[u+1] && !t_flips; ++a)
+			{
+				const int *t = &t_tris[3*t_adj[a]];
+				if (t[0] == v || t[1] == v || t[2] == v)
+				{
+					++t_lost;
+					continue;
+				}
+				const double *p[3], *q[3];
+				for (int k=0; k<3; ++k)
+				{
+					p[k] = &t_pos[3*t[k]];
+					q[k] = &t_pos[3*(t[k] == u ? v : t[k])];
+				}
+				double n0[3], n1[3];
+				sp_normal(p[0], p[1], p[2], n0);
+				sp_normal(q[0], q[1], q[2], n1);
+				double t_dot = n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2];
+				double t_len = sqrt((n0[0]*n0[0] + n0[1]*n0[1] + n0[2]*n0[2]) *
+					(n1[0]*n1[0] + n1[1]*n1[1] + n1[2]*n1[2]));
+				if (!(t_dot > SIMPLIFY_MIN_COS * t_len))
+					t_flips = true;
+			}
+			if (t_flips)
+				continue;
+
+			t_remap[u] = v;
+			sp_add(t_quadrics[v], t_quadrics[u]);
+			for (int a = t_adjStart[u]; a < t_adjStart[u+1]; ++a)
+			{
+				const int *t = &t_tris[3*t_adj[a]];
+				t_touched[t[0]] = t_touched[t[1]] = t_touched[t[2]] = 1;
+			}
+			t_touched[v] = 1;
+			t_removed += t_lost;
+			_error = std::max(_error, t_c.error);
+			++t_done;
+		}
+		if (t_done == 0)
+			break;
+
+		// the triangles which lost a side are gone
+		unsigned int t_end = 0;
+		for (unsigned int i=0; i<t_live; ++i)
+		{
+			int a = t_remap[t_tris[3*i]], b = t_remap[t_tris[3*i+1]], c = t_remap[t_tris[3*i+2]];
+			if (a == b || b == c || c == a)
+				continue;
+			t_tris[3*t_end] = a;
+			t_tris[3*t_end+1] = b;
+			t_tris[3*t_end+2] = c;
+			t_source[t_end] = t_source[i];
+			++t_end;
+		}
+		t_live = t_end;
+	}
+
+	// back in place. A corner which moved takes the normal of its vertex.
+	for (unsigned int i=0; i<t_live; ++i)
+	{
+		unsigned int s = t_source[i];
+		COBJtriangle t_tri = _triangles[s];
+		for (int k=0; k<3; ++k)
+		{
+			int v = t_tris[3*i+k];
+			if (v != t_corners[3*s+k])
+			{
+				t_tri.vindices[k] = t_global[v];
+				t_tri.nindices[k] = t_normal[v];
+			}
+		}
+		_triangles[i] = t_tri;
+	}
+	return t_live;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+
+class COBJmodel;
+class COBJtriangle;
+
+//////////////////////////////////////////////////////////////////////////
+// CSimplifier: quadric error edge collapse of the triangles of a
+// COBJmodel, for its levels of detail.
+//
+// A vertex is only collapsed onto one of its neighbours, so the simplified
+// triangles still index the vertices and normals of the model and a level
+// costs only its triangles. The triangles are cut into chunks of one group
+// each, close in space, which are simplified in parallel. The vertices
+// used by more than one chunk don't move, and neither do the ones on an
+// open edge, so the groups keep their borders and the mesh its holes.
+//////////////////////////////////////////////////////////////////////////
+class CSimplifier
+{
+public:
+	CSimplifier();
+
+	// threads to use, 0 for one per hardware thread
+	void setThreadCount(int _n) { mThreads = _n; }
+
+	// collapse edges of _triangles, of the group _groups[i] each, until
+	// there are about _target of them, or the next one would move the
+	// surface further than _maxError. They are reordered by group and by
+	// place. Returns how far the surface moved: a bound of the distance of
+	// any vertex to the planes of the triangles it replaced.
+	float simplify(const COBJmodel* _model, std::vector<COBJtriangle>& _triangles,
+		std::vector<unsigned int>& _groups, unsigned int _target, float _maxError);
+
+private:
+	// the _count triangles of one chunk, reduced to the first ones in place,
+	// by collapses whose squared error is _maxCost at most. Returns their
+	// number, and the largest squared error of a collapse in _error.
+	unsigned int _simplifyChunk(const COBJmodel* _model, COBJtriangle* _triangles,
+		unsigned int _count, unsigned int _target, double _maxCost,
+		const std::vector<int>& _owner, int _chunk, double& _error);
+
+private:
+	int mThreads;
+};
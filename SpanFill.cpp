@@ -0,0 +1,648 @@
+#include "SpanFill.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SF_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX is compiled in on x86 and only used when the cpu and the os support it
+#if defined(SF_USE_SSE2) && defined(__GNUC__)
+#define SF_USE_AVX
+#define SF_TARGET_AVX __attribute__((target("avx")))
+#include <immintrin.h>
+#elif defined(SF_USE_SSE2) && defined(_MSC_VER) && _MSC_VER >= 1600
+#define SF_USE_AVX
+#define SF_TARGET_AVX
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#define SF_SATURATE(x) ( ((x)>255) ? 255 : (((x)<0) ? 0 : (x)) )
+
+//------------------------------------------------------------------------------
+// Depth formats, see CDepthBuffer
+//------------------------------------------------------------------------------
+template <int FORMAT> struct SfDepth;
+
+template <> struct SfDepth<SL_DEPTH_FLOAT64>
+{
+	typedef double T;
+	static double quantize(double _z, double) { return _z; }
+	static T fromFixed(int _z, int, double _unit, double) { return _z * _unit; }
+};
+
+template <> struct SfDepth<SL_DEPTH_FLOAT32>
+{
+	typedef float T;
+	static double quantize(double _z, double) { return float(_z); }
+	static T fromFixed(int _z, int, double _unit, double) { return float(_z * _unit); }
+};
+
+template <> struct SfDepth<SL_DEPTH_UNORM24>
+{
+	typedef unsigned int T;
+	static double quantize(double _z, double _scale)
+	{
+		if (_z <= 0) return 0;
+		if (_z >= _scale) return _scale;
+		return double((unsigned int)(_z + 0.5));
+	}
+	static T fromFixed(int _z, int _shift, double, double _scale)
+	{
+		// rounded like quantize()
+		int t_z = (_z + (1<<(_shift-1))) >> _shift;
+		if (t_z <= 0) return 0;
+		if (t_z >= int(_scale)) return T(_scale);
+		return T(t_z);
+	}
+};
+
+template <> struct SfDepth<SL_DEPTH_UNORM16>
+{
+	typedef unsigned short T;
+	static double quantize(double _z, double _scale)
+	{
+		return SfDepth<SL_DEPTH_UNORM24>::quantize(_z, _scale);
+	}
+	static T fromFixed(int _z, int _shift, double _unit, double _scale)
+	{
+		return T(SfDepth<SL_DEPTH_UNORM24>::fromFixed(_z, _shift, _unit, _scale));
+	}
+};
+
+// instantiate KERNEL for the depth format of _span
+#define SF_DISPATCH_DEPTH(KERNEL, _span) \
+	switch ((_span).depthFormat) \
+	{ \
+	case SL_DEPTH_FLOAT32: KERNEL<SL_DEPTH_FLOAT32>(_span); break; \
+	case SL_DEPTH_UNORM24: KERNEL<SL_DEPTH_UNORM24>(_span); break; \
+	case SL_DEPTH_UNORM16: KERNEL<SL_DEPTH_UNORM16>(_span); break; \
+	default: KERNEL<SL_DEPTH_FLOAT64>(_span); break; \
+	}
+
+//------------------------------------------------------------------------------
+// Scalar
+//------------------------------------------------------------------------------
+// pixel _k of the span. Its depth and color are the ones of the first pixel
+// plus _k steps, as the vector kernels have them, so that they all agree.
+template <int FORMAT>
+static inline void sf_fillPixel(const SpanInfo& _span, int _k)
+{
+	typedef typename SfDepth<FORMAT>::T T;
+	T *t_depth = static_cast<T*>(_span.depth);
+	double t_z = SfDepth<FORMAT>::quantize(_span.z + _k * _span.dz, _span.depthScale);
+	if (!(t_z < t_depth[_k]))
+		return;
+
+	double c[4];
+	for (int i=0; i<4; ++i)
+		c[i] = _span.color[i] + _k * _span.dcolor[i];
+	double r = c[0], g = c[1], b = c[2];
+	if (_span.blend)
+	{
+		unsigned int t_old = _span.pixels[_k];
+		double t_a = c[3];
+		r = r * t_a + ((t_old>>16)&0xff) * (1-t_a);
+		g = g * t_a + ((t_old>>8)&0xff) * (1-t_a);
+		b = b * t_a + (t_old&0xff) * (1-t_a);
+	}
+	r *= 255.0;
+	g *= 255.0;
+	b *= 255.0;
+	_span.pixels[_k] = 0xff000000u |
+		((int(SF_SATURATE(r))&0xff)<<16) |
+		((int(SF_SATURATE(g))&0xff)<<8) |
+		(int(SF_SATURATE(b))&0xff);
+	t_depth[_k] = T(t_z);
+}
+
+template <int FORMAT>
+static void sf_fillScalar(const SpanInfo& _span)
+{
+	for (int k=0; k<_span.count; ++k)
+		sf_fillPixel<FORMAT>(_span, k);
+}
+
+void fillSpanScalar(const SpanInfo& _span)
+{
+	SF_DISPATCH_DEPTH(sf_fillScalar, _span);
+}
+
+//------------------------------------------------------------------------------
+// SSE2, 4 pixels at a time. A value of them is two registers, of the pixels
+// 0, 1 and 2, 3.
+//------------------------------------------------------------------------------
+#ifdef SF_USE_SSE2
+// two depths as doubles
+static inline __m128d sf_load2(const double* _p) { return _mm_loadu_pd(_p); }
+static inline __m128d sf_load2(const float* _p) 
+{ 
+	return _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(_p)))); 
+}
+static inline __m128d sf_load2(const unsigned int* _p) 
+{ 
+	// 24-bit values, exact as signed 32-bit
+	return _mm_cvtepi32_pd(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(_p))); 
+}
+static inline __m128d sf_load2(const unsigned short* _p) 
+{ 
+	__m128i t_v = _mm_cvtsi32_si128(*reinterpret_cast<const int*>(_p));
+	return _mm_cvtepi32_pd(_mm_unpacklo_epi16(t_v, _mm_setzero_si128())); 
+}
+
+// two depths rounded as quantize() does
+static inline __m128d sf_quantizeSSE2(const double*, __m128d _z, __m128d) { return _z; }
+static inline __m128d sf_quantizeSSE2(const float*, __m128d _z, __m128d) 
+{ 
+	return _mm_cvtps_pd(_mm_cvtpd_ps(_z)); 
+}
+template <class T>
+static inline __m128d sf_quantizeSSE2(const T*, __m128d _z, __m128d _scale)
+{
+	// clamped before the truncation, which gives the same
+	_z = _mm_add_pd(_z, _mm_set1_pd(0.5));
+	_z = _mm_min_pd(_mm_max_pd(_z, _mm_setzero_pd()), _scale);
+	return _mm_cvtepi32_pd(_mm_cvttpd_epi32(_z));
+}
+
+// the lanes of the masks of the two halves as 32-bit lanes
+static inline __m128i sf_mask32(__m128d _lo, __m128d _hi)
+{
+	return _mm_castps_si128(_mm_shuffle_ps(_mm_castpd_ps(_lo), _mm_castpd_ps(_hi), 
+		_MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+static inline __m128i sf_select(__m128i _mask, __m128i _new, __m128i _old)
+{
+	return _mm_or_si128(_mm_and_si128(_mask, _new), _mm_andnot_si128(_mask, _old));
+}
+
+// 4 quantized depths as 16-bit values, through the signed saturation of
+// _mm_packs_epi32
+static inline __m128i sf_packDepth16(__m128i _z)
+{
+	_z = _mm_sub_epi32(_z, _mm_set1_epi32(0x8000));
+	_z = _mm_packs_epi32(_z, _z);
+	return _mm_add_epi16(_z, _mm_set1_epi16(short(0x8000)));
+}
+
+// store the depths of the lanes of the masks. The others are written back
+// as they were, they are all in the span.
+static inline void sf_storeSSE2(double* _p, __m128d _lo, __m128d _hi, __m128d _mlo, __m128d _mhi)
+{
+	_mm_storeu_pd(_p, _mm_or_pd(_mm_and_pd(_mlo, _lo), _mm_andnot_pd(_mlo, _mm_loadu_pd(_p))));
+	_mm_storeu_pd(_p+2, _mm_or_pd(_mm_and_pd(_mhi, _hi), _mm_andnot_pd(_mhi, _mm_loadu_pd(_p+2))));
+}
+static inline void sf_storeSSE2(float* _p, __m128d _lo, __m128d _hi, __m128d _mlo, __m128d _mhi)
+{
+	__m128 t_z = _mm_movelh_ps(_mm_cvtpd_ps(_lo), _mm_cvtpd_ps(_hi));
+	__m128 t_mask = _mm_castsi128_ps(sf_mask32(_mlo, _mhi));
+	_mm_storeu_ps(_p, _mm_or_ps(_mm_and_ps(t_mask, t_z), _mm_andnot_ps(t_mask, _mm_loadu_ps(_p))));
+}
+static inline void sf_storeSSE2(unsigned int* _p, __m128d _lo, __m128d _hi, __m128d _mlo, __m128d _mhi)
+{
+	__m128i *t_p = reinterpret_cast<__m128i*>(_p);
+	__m128i t_z = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_lo), _mm_cvttpd_epi32(_hi));
+	_mm_storeu_si128(t_p, sf_select(sf_mask32(_mlo, _mhi), t_z, _mm_loadu_si128(t_p)));
+}
+static inline void sf_storeSSE2(unsigned short* _p, __m128d _lo, __m128d _hi, __m128d _mlo, __m128d _mhi)
+{
+	__m128i *t_p = reinterpret_cast<__m128i*>(_p);
+	__m128i t_z = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_lo), _mm_cvttpd_epi32(_hi));
+	__m128i t_mask = sf_mask32(_mlo, _mhi);
+	t_mask = _mm_packs_epi32(t_mask, t_mask);
+	_mm_storel_epi64(t_p, sf_select(t_mask, sf_packDepth16(t_z), _mm_loadl_epi64(t_p)));
+}
+
+// a channel of 4 pixels in [0, 255], from its values in [0, 1] at them.
+// With _a, blended with the 8-bit channel _old.
+static inline __m128i sf_shadeSSE2(__m128d _lo, __m128d _hi, const __m128d* _a, __m128i _old)
+{
+	const __m128d t_255 = _mm_set1_pd(255.0);
+	const __m128d t_zero = _mm_setzero_pd();
+	if (_a)
+	{
+		const __m128d t_one = _mm_set1_pd(1.0);
+		__m128d t_oldlo = _mm_cvtepi32_pd(_old);
+		__m128d t_oldhi = _mm_cvtepi32_pd(_mm_srli_si128(_old, 8));
+		_lo = _mm_add_pd(_mm_mul_pd(_lo, _a[0]), _mm_mul_pd(t_oldlo, _mm_sub_pd(t_one, _a[0])));
+		_hi = _mm_add_pd(_mm_mul_pd(_hi, _a[1]), _mm_mul_pd(t_oldhi, _mm_sub_pd(t_one, _a[1])));
+	}
+	_lo = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_lo, t_255), t_zero), t_255);
+	_hi = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_hi, t_255), t_zero), t_255);
+	return _mm_unpacklo_epi64(_mm_cvttpd_epi32(_lo), _mm_cvttpd_epi32(_hi));
+}
+
+// the same from its value at the first pixel of the span and its step
+static inline __m128i sf_channelSSE2(double _c, double _dc, __m128d _klo, __m128d _khi,
+									 const __m128d* _a, __m128i _old)
+{
+	__m128d t_c = _mm_set1_pd(_c), t_dc = _mm_set1_pd(_dc);
+	return sf_shadeSSE2(_mm_add_pd(t_c, _mm_mul_pd(_klo, t_dc)), 
+		_mm_add_pd(t_c, _mm_mul_pd(_khi, t_dc)), _a, _old);
+}
+
+template <int FORMAT>
+static void sf_fillSSE2(const SpanInfo& _span)
+{
+	typedef typename SfDepth<FORMAT>::T T;
+	T *t_depth = static_cast<T*>(_span.depth);
+	const __m128d t_z0 = _mm_set1_pd(_span.z), t_dz = _mm_set1_pd(_span.dz);
+	const __m128d t_scale = _mm_set1_pd(_span.depthScale);
+	const __m128i t_byte = _mm_set1_epi32(0xff);
+
+	int k = 0;
+	for (; k+4<=_span.count; k+=4)
+	{
+		__m128d t_klo = _mm_set_pd(k+1, k), t_khi = _mm_set_pd(k+3, k+2);
+		__m128d t_zlo = sf_quantizeSSE2(t_depth, _mm_add_pd(t_z0, _mm_mul_pd(t_klo, t_dz)), t_scale);
+		__m128d t_zhi = sf_quantizeSSE2(t_depth, _mm_add_pd(t_z0, _mm_mul_pd(t_khi, t_dz)), t_scale);
+		__m128d t_mlo = _mm_cmplt_pd(t_zlo, sf_load2(t_depth+k));
+		__m128d t_mhi = _mm_cmplt_pd(t_zhi, sf_load2(t_depth+k+2));
+		if ((_mm_movemask_pd(t_mlo) | _mm_movemask_pd(t_mhi)) == 0)
+			continue;
+		sf_storeSSE2(t_depth+k, t_zlo, t_zhi, t_mlo, t_mhi);
+
+		__m128i *t_pixels = reinterpret_cast<__m128i*>(_span.pixels + k);
+		__m128i t_old = _mm_loadu_si128(t_pixels);
+		__m128d t_a[2];
+		if (_span.blend)
+		{
+			__m128d t_c = _mm_set1_pd(_span.color[3]), t_dc = _mm_set1_pd(_span.dcolor[3]);
+			t_a[0] = _mm_add_pd(t_c, _mm_mul_pd(t_klo, t_dc));
+			t_a[1] = _mm_add_pd(t_c, _mm_mul_pd(t_khi, t_dc));
+		}
+		const __m128d *t_blend = _span.blend ? t_a : 0;
+		__m128i r = sf_channelSSE2(_span.color[0], _span.dcolor[0], t_klo, t_khi, t_blend, 
+			_mm_and_si128(_mm_srli_epi32(t_old, 16), t_byte));
+		__m128i g = sf_channelSSE2(_span.color[1], _span.dcolor[1], t_klo, t_khi, t_blend, 
+			_mm_and_si128(_mm_srli_epi32(t_old, 8), t_byte));
+		__m128i b = sf_channelSSE2(_span.color[2], _span.dcolor[2], t_klo, t_khi, t_blend, 
+			_mm_and_si128(t_old, t_byte));
+		__m128i t_new = _mm_or_si128(_mm_set1_epi32(int(0xff000000u)), 
+			_mm_or_si128(_mm_slli_epi32(r, 16), _mm_or_si128(_mm_slli_epi32(g, 8), b)));
+		_mm_storeu_si128(t_pixels, sf_select(sf_mask32(t_mlo, t_mhi), t_new, t_old));
+	}
+	for (; k<_span.count; ++k)
+		sf_fillPixel<FORMAT>(_span, k);
+}
+
+static void fillSpanSSE2(const SpanInfo& _span)
+{
+	SF_DISPATCH_DEPTH(sf_fillSSE2, _span);
+}
+#endif
+
+//------------------------------------------------------------------------------
+// AVX, 4 pixels at a time. A value of them is one register.
+//------------------------------------------------------------------------------
+#ifdef SF_USE_AVX
+// four depths as doubles
+SF_TARGET_AVX static inline __m256d sf_load4(const double* _p) { return _mm256_loadu_pd(_p); }
+SF_TARGET_AVX static inline __m256d sf_load4(const float* _p) { return _mm256_cvtps_pd(_mm_loadu_ps(_p)); }
+SF_TARGET_AVX static inline __m256d sf_load4(const unsigned int* _p) 
+{ 
+	return _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(_p))); 
+}
+SF_TARGET_AVX static inline __m256d sf_load4(const unsigned short* _p) 
+{ 
+	__m128i t_v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(_p));
+	return _mm256_cvtepi32_pd(_mm_unpacklo_epi16(t_v, _mm_setzero_si128())); 
+}
+
+// four depths rounded as quantize() does
+SF_TARGET_AVX static inline __m256d sf_quantizeAVX(const double*, __m256d _z, __m256d) { return _z; }
+SF_TARGET_AVX static inline __m256d sf_quantizeAVX(const float*, __m256d _z, __m256d) 
+{ 
+	return _mm256_cvtps_pd(_mm256_cvtpd_ps(_z)); 
+}
+template <class T>
+SF_TARGET_AVX static inline __m256d sf_quantizeAVX(const T*, __m256d _z, __m256d _scale)
+{
+	_z = _mm256_add_pd(_z, _mm256_set1_pd(0.5));
+	_z = _mm256_min_pd(_mm256_max_pd(_z, _mm256_setzero_pd()), _scale);
+	return _mm256_round_pd(_z, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+}
+
+// store the depths of the lanes of _mask, _mask32 being the same as 32-bit lanes
+SF_TARGET_AVX static inline void sf_storeAVX(double* _p, __m256d _z, __m256d _mask, __m128i)
+{
+	_mm256_maskstore_pd(_p, _mm256_castpd_si256(_mask), _z);
+}
+SF_TARGET_AVX static inline void sf_storeAVX(float* _p, __m256d _z, __m256d, __m128i _mask32)
+{
+	_mm_maskstore_ps(_p, _mask32, _mm256_cvtpd_ps(_z));
+}
+SF_TARGET_AVX static inline void sf_storeAVX(unsigned int* _p, __m256d _z, __m256d, __m128i _mask32)
+{
+	_mm_maskstore_ps(reinterpret_cast<float*>(_p), _mask32, _mm_castsi128_ps(_mm256_cvttpd_epi32(_z)));
+}
+SF_TARGET_AVX static inline void sf_storeAVX(unsigned short* _p, __m256d _z, __m256d, __m128i _mask32)
+{
+	__m128i *t_p = reinterpret_cast<__m128i*>(_p);
+	__m128i t_mask = _mm_packs_epi32(_mask32, _mask32);
+	__m128i t_z = sf_packDepth16(_mm256_cvttpd_epi32(_z));
+	_mm_storel_epi64(t_p, sf_select(t_mask, t_z, _mm_loadl_epi64(t_p)));
+}
+
+// a channel of 4 pixels as sf_channelSSE2()
+SF_TARGET_AVX
+static inline __m128i sf_channelAVX(double _c, double _dc, __m256d _k, const __m256d* _a, __m128i _old)
+{
+	const __m256d t_255 = _mm256_set1_pd(255.0);
+	__m256d t_c = _mm256_add_pd(_mm256_set1_pd(_c), _mm256_mul_pd(_k, _mm256_set1_pd(_dc)));
+	if (_a)
+	{
+		__m256d t_1a = _mm256_sub_pd(_mm256_set1_pd(1.0), *_a);
+		t_c = _mm256_add_pd(_mm256_mul_pd(t_c, *_a), _mm256_mul_pd(_mm256_cvtepi32_pd(_old), t_1a));
+	}
+	t_c = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(t_c, t_255), _mm256_setzero_pd()), t_255);
+	return _mm256_cvttpd_epi32(t_c);
+}
+
+template <int FORMAT>
+SF_TARGET_AVX
+static void sf_fillAVX(const SpanInfo& _span)
+{
+	typedef typename SfDepth<FORMAT>::T T;
+	T *t_depth = static_cast<T*>(_span.depth);
+	const __m256d t_z0 = _mm256_set1_pd(_span.z), t_dz = _mm256_set1_pd(_span.dz);
+	const __m256d t_scale = _mm256_set1_pd(_span.depthScale);
+	const __m256d t_lanes = _mm256_set_pd(3, 2, 1, 0);
+	const __m128i t_byte = _mm_set1_epi32(0xff);
+
+	int k = 0;
+	for (; k+4<=_span.count; k+=4)
+	{
+		__m256d t_k = _mm256_add_pd(_mm256_set1_pd(k), t_lanes);
+		__m256d t_z = sf_quantizeAVX(t_depth, _mm256_add_pd(t_z0, _mm256_mul_pd(t_k, t_dz)), t_scale);
+		__m256d t_lt = _mm256_cmp_pd(t_z, sf_load4(t_depth+k), _CMP_LT_OQ);
+		if (_mm256_movemask_pd(t_lt) == 0)
+			continue;
+		__m128i t_mask = sf_mask32(_mm256_castpd256_pd128(t_lt), _mm256_extractf128_pd(t_lt, 1));
+		sf_storeAVX(t_depth+k, t_z, t_lt, t_mask);
+
+		__m128i t_old = _mm_loadu_si128(reinterpret_cast<const __m128i*>(_span.pixels + k));
+		__m256d t_a;
+		if (_span.blend)
+			t_a = _mm256_add_pd(_mm256_set1_pd(_span.color[3]), _mm256_mul_pd(t_k, _mm256_set1_pd(_span.dcolor[3])));
+		const __m256d *t_blend = _span.blend ? &t_a : 0;
+		__m128i r = sf_channelAVX(_span.color[0], _span.dcolor[0], t_k, t_blend, 
+			_mm_and_si128(_mm_srli_epi32(t_old, 16), t_byte));
+		__m128i g = sf_channelAVX(_span.color[1], _span.dcolor[1], t_k, t_blend, 
+			_mm_and_si128(_mm_srli_epi32(t_old, 8), t_byte));
+		__m128i b = sf_channelAVX(_span.color[2], _span.dcolor[2], t_k, t_blend, 
+			_mm_and_si128(t_old, t_byte));
+		__m128i t_new = _mm_or_si128(_mm_set1_epi32(int(0xff000000u)), 
+			_mm_or_si128(_mm_slli_epi32(r, 16), _mm_or_si128(_mm_slli_epi32(g, 8), b)));
+		_mm_maskstore_ps(reinterpret_cast<float*>(_span.pixels + k), t_mask, _mm_castsi128_ps(t_new));
+	}
+	_mm256_zeroupper();
+	for (; k<_span.count; ++k)
+		sf_fillPixel<FORMAT>(_span, k);
+}
+
+SF_TARGET_AVX
+static void fillSpanAVX(const SpanInfo& _span)
+{
+	SF_DISPATCH_DEPTH(sf_fillAVX, _span);
+}
+
+static bool sf_cpuHasAvx()
+{
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx") != 0;
+#else
+	int t_info[4];
+	__cpuid(t_info, 1);
+	bool t_osxsave = (t_info[2] & (1<<27)) != 0;
+	bool t_avx = (t_info[2] & (1<<28)) != 0;
+	// the os saves the ymm registers
+	return t_osxsave && t_avx && (_xgetbv(0) & 6) == 6;
+#endif
+}
+
+static bool sf_cpuHasAvx2()
+{
+	if (!sf_cpuHasAvx())
+		return false;
+#if defined(__GNUC__)
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	int t_info[4];
+	__cpuidex(t_info, 7, 0);
+	return (t_info[1] & (1<<5)) != 0;
+#endif
+}
+#endif
+
+//------------------------------------------------------------------------------
+// Fixed point
+//------------------------------------------------------------------------------
+// a pixel the way the double kernels make it
+static inline unsigned int sf_fixedPixel(const int* _c, bool _blend, unsigned int _old)
+{
+	int r = _c[0]>>16, g = _c[1]>>16, b = _c[2]>>16;
+	if (_blend)
+	{
+		const double t_unit = 1.0 / SF_FIXED_ONE;
+		double t_a = _c[3] * t_unit;
+		r = int(SF_SATURATE((_c[0] * t_unit * t_a + ((_old>>16)&0xff) * (1-t_a)) * 255.0));
+		g = int(SF_SATURATE((_c[1] * t_unit * t_a + ((_old>>8)&0xff) * (1-t_a)) * 255.0));
+		b = int(SF_SATURATE((_c[2] * t_unit * t_a + (_old&0xff) * (1-t_a)) * 255.0));
+	}
+	return 0xff000000u | (SF_SATURATE(r)<<16) | (SF_SATURATE(g)<<8) | SF_SATURATE(b);
+}
+
+// pixel _k of the span. The integer steps add up exactly, so this is the
+// same as stepping.
+template <int FORMAT>
+static inline void sf_fillFixedPixel(const FixedSpanInfo& _span, int _k)
+{
+	typedef typename SfDepth<FORMAT>::T T;
+	T *t_depth = static_cast<T*>(_span.depth);
+	double t_unit = 1.0 / (1<<_span.zShift);
+	T t_z = SfDepth<FORMAT>::fromFixed(_span.z + _k * _span.dz, _span.zShift, t_unit, _span.depthScale);
+	if (!(t_z < t_depth[_k]))
+		return;
+
+	int c[4];
+	for (int i=0; i<4; ++i)
+		c[i] = _span.color[i] + _k * _span.dcolor[i];
+	_span.pixels[_k] = sf_fixedPixel(c, _span.blend, _span.pixels[_k]);
+	t_depth[_k] = t_z;
+}
+
+template <int FORMAT>
+static void sf_fillFixedScalar(const FixedSpanInfo& _span)
+{
+	for (int k=0; k<_span.count; ++k)
+		sf_fillFixedPixel<FORMAT>(_span, k);
+}
+
+void fillFixedSpanScalar(const FixedSpanInfo& _span)
+{
+	SF_DISPATCH_DEPTH(sf_fillFixedScalar, _span);
+}
+
+#ifdef SF_USE_SSE2
+// 4 depths as fromFixed() has them, as doubles like sf_quantizeSSE2()
+static inline void sf_fixedDepthSSE2(const double*, __m128i _z, __m128i, __m128i, __m128d _unit, __m128d,
+									 __m128d& _lo, __m128d& _hi)
+{
+	_lo = _mm_mul_pd(_mm_cvtepi32_pd(_z), _unit);
+	_hi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(_z, 8)), _unit);
+}
+static inline void sf_fixedDepthSSE2(const float* _p, __m128i _z, __m128i _round, __m128i _shift, 
+									 __m128d _unit, __m128d _scale, __m128d& _lo, __m128d& _hi)
+{
+	sf_fixedDepthSSE2(static_cast<const double*>(0), _z, _round, _shift, _unit, _scale, _lo, _hi);
+	_lo = sf_quantizeSSE2(_p, _lo, _scale);
+	_hi = sf_quantizeSSE2(_p, _hi, _scale);
+}
+template <class T>
+static inline void sf_fixedDepthSSE2(const T*, __m128i _z, __m128i _round, __m128i _shift, 
+									 __m128d, __m128d _scale, __m128d& _lo, __m128d& _hi)
+{
+	_z = _mm_sra_epi32(_mm_add_epi32(_z, _round), _shift);
+	const __m128d t_zero = _mm_setzero_pd();
+	_lo = _mm_min_pd(_mm_max_pd(_mm_cvtepi32_pd(_z), t_zero), _scale);
+	_hi = _mm_min_pd(_mm_max_pd(_mm_cvtepi32_pd(_mm_srli_si128(_z, 8)), t_zero), _scale);
+}
+
+// a value at the pixels 0..3 from the one at 0 and its step
+static inline __m128i sf_fixedLanes(int _v, int _dv)
+{
+	return _mm_set_epi32(_v + 3*_dv, _v + 2*_dv, _v + _dv, _v);
+}
+
+// a channel of 4 pixels without blending, its top 16 bits saturated to 
+// [0, 255]. They fit the 16-bit lanes.
+static inline __m128i sf_fixedChannelSSE2(__m128i _c)
+{
+	_c = _mm_srai_epi32(_c, 16);
+	_c = _mm_packs_epi32(_c, _c);
+	_c = _mm_min_epi16(_mm_max_epi16(_c, _mm_setzero_si128()), _mm_set1_epi16(255));
+	return _mm_unpacklo_epi16(_c, _mm_setzero_si128());
+}
+
+// a channel of 4 pixels in [0, 1] as two registers
+static inline void sf_fixedUnitSSE2(__m128i _c, __m128d& _lo, __m128d& _hi)
+{
+	const __m128d t_unit = _mm_set1_pd(1.0 / SF_FIXED_ONE);
+	_lo = _mm_mul_pd(_mm_cvtepi32_pd(_c), t_unit);
+	_hi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(_c, 8)), t_unit);
+}
+
+// a value of 4 pixels is a register of 4 integers
+template <int FORMAT>
+static void sf_fillFixedSSE2(const FixedSpanInfo& _span)
+{
+	typedef typename SfDepth<FORMAT>::T T;
+	T *t_depth = static_cast<T*>(_span.depth);
+	const __m128i t_round = _mm_set1_epi32(1<<(_span.zShift-1));
+	const __m128i t_shift = _mm_cvtsi32_si128(_span.zShift);
+	const __m128d t_unit = _mm_set1_pd(1.0 / (1<<_span.zShift));
+	const __m128d t_scale = _mm_set1_pd(_span.depthScale);
+	const __m128i t_byte = _mm_set1_epi32(0xff);
+
+	// the values at the pixels k..k+3 and their steps to the next 4
+	__m128i t_z = sf_fixedLanes(_span.z, _span.dz), t_dz = _mm_set1_epi32(4*_span.dz);
+	__m128i t_r = sf_fixedLanes(_span.color[0], _span.dcolor[0]), t_dr = _mm_set1_epi32(4*_span.dcolor[0]);
+	__m128i t_g = sf_fixedLanes(_span.color[1], _span.dcolor[1]), t_dg = _mm_set1_epi32(4*_span.dcolor[1]);
+	__m128i t_b = sf_fixedLanes(_span.color[2], _span.dcolor[2]), t_db = _mm_set1_epi32(4*_span.dcolor[2]);
+	__m128i t_a = sf_fixedLanes(_span.color[3], _span.dcolor[3]), t_da = _mm_set1_epi32(4*_span.dcolor[3]);
+
+	int k = 0;
+	for (; k+4<=_span.count; k+=4)
+	{
+		__m128d t_zlo, t_zhi;
+		sf_fixedDepthSSE2(t_depth, t_z, t_round, t_shift, t_unit, t_scale, t_zlo, t_zhi);
+		__m128d t_mlo = _mm_cmplt_pd(t_zlo, sf_load2(t_depth+k));
+		__m128d t_mhi = _mm_cmplt_pd(t_zhi, sf_load2(t_depth+k+2));
+		if ((_mm_movemask_pd(t_mlo) | _mm_movemask_pd(t_mhi)) != 0)
+		{
+			sf_storeSSE2(t_depth+k, t_zlo, t_zhi, t_mlo, t_mhi);
+
+			__m128i *t_pixels = reinterpret_cast<__m128i*>(_span.pixels + k);
+			__m128i t_old = _mm_loadu_si128(t_pixels);
+			__m128i r, g, b;
+			if (_span.blend)
+			{
+				// blended as sf_fixedPixel() does
+				__m128d t_alpha[2], t_lo, t_hi;
+				sf_fixedUnitSSE2(t_a, t_alpha[0], t_alpha[1]);
+				sf_fixedUnitSSE2(t_r, t_lo, t_hi);
+				r = sf_shadeSSE2(t_lo, t_hi, t_alpha, _mm_and_si128(_mm_srli_epi32(t_old, 16), t_byte));
+				sf_fixedUnitSSE2(t_g, t_lo, t_hi);
+				g = sf_shadeSSE2(t_lo, t_hi, t_alpha, _mm_and_si128(_mm_srli_epi32(t_old, 8), t_byte));
+				sf_fixedUnitSSE2(t_b, t_lo, t_hi);
+				b = sf_shadeSSE2(t_lo, t_hi, t_alpha, _mm_and_si128(t_old, t_byte));
+			}
+			else
+			{
+				r = sf_fixedChannelSSE2(t_r);
+				g = sf_fixedChannelSSE2(t_g);
+				b = sf_fixedChannelSSE2(t_b);
+			}
+			__m128i t_new = _mm_or_si128(_mm_set1_epi32(int(0xff000000u)), 
+				_mm_or_si128(_mm_slli_epi32(r, 16), _mm_or_si128(_mm_slli_epi32(g, 8), b)));
+			_mm_storeu_si128(t_pixels, sf_select(sf_mask32(t_mlo, t_mhi), t_new, t_old));
+		}
+		t_z = _mm_add_epi32(t_z, t_dz);
+		t_r = _mm_add_epi32(t_r, t_dr);
+		t_g = _mm_add_epi32(t_g, t_dg);
+		t_b = _mm_add_epi32(t_b, t_db);
+		t_a = _mm_add_epi32(t_a, t_da);
+	}
+	for (; k<_span.count; ++k)
+		sf_fillFixedPixel<FORMAT>(_span, k);
+}
+
+static void fillFixedSpanSSE2(const FixedSpanInfo& _span)
+{
+	SF_DISPATCH_DEPTH(sf_fillFixedSSE2, _span);
+}
+#endif
+
+//------------------------------------------------------------------------------
+// Dispatch
+//------------------------------------------------------------------------------
+static SpanFillFunc sf_chooseKernel()
+{
+#ifdef SF_USE_AVX
+	if (sf_cpuHasAvx())
+		return fillSpanAVX;
+#endif
+#ifdef SF_USE_SSE2
+	return fillSpanSSE2;
+#else
+	return fillSpanScalar;
+#endif
+}
+
+SpanFillFunc spanFillFunc()
+{
+	static SpanFillFunc s_func = sf_chooseKernel();
+	return s_func;
+}
+
+bool cpuHasAvx2()
+{
+#ifdef SF_USE_AVX
+	static bool s_avx2 = sf_cpuHasAvx2();
+	return s_avx2;
+#else
+	return false;
+#endif
+}
+
+FixedSpanFillFunc fixedSpanFillFunc()
+{
+#ifdef SF_USE_SSE2
+	return fillFixedSpanSSE2;
+#else
+	return fillFixedSpanScalar;
+#endif
+}
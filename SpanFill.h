@@ -0,0 +1,76 @@
+#pragma once
+
+#include "BasicStructure.h"
+
+//////////////////////////////////////////////////////////////////////////
+// Span filling kernels for the states without per pixel lighting.
+//
+// For each pixel k of the span:
+//     z = round(z0 + k*dz); color = color0 + k*dcolor;
+//     if (z < depth[k]) { write color to pixels[k]; depth[k] = z; }
+// Every kernel computes a pixel from the first one with the same
+// operations, so they all give the same pixels. The vector kernels do 4
+// pixels at once, from the depth test to the stores. z is in the units of
+// the depth format, see CDepthBuffer, and rounded to it.
+//
+// The loop of CScanLine for per pixel lighting adds the steps up instead.
+// Against it z may be off by the rounding of those additions before it is
+// rounded to the format, which only shows with SL_DEPTH_FLOAT64, and a
+// channel by 1.
+//////////////////////////////////////////////////////////////////////////
+struct SpanInfo
+{
+	int count;				// number of pixels
+	double z, dz;			// depth at the first pixel and its step
+	double color[4];		// r, g, b, a at the first pixel, in [0, 1]
+	double dcolor[4];		// and their step
+	bool blend;				// mix with the pixels by the alpha
+	DepthFormat depthFormat;
+	double depthScale;		// see CDepthBuffer::scale()
+	void *depth;			// depth buffer at the first pixel
+	unsigned int *pixels;	// 32-bit 0xAARRGGBB pixels at the first pixel
+};
+
+typedef void (*SpanFillFunc)(const SpanInfo& _span);
+
+// the best kernel for this cpu, chosen on the first call
+SpanFillFunc spanFillFunc();
+
+// the portable kernel
+void fillSpanScalar(const SpanInfo& _span);
+
+// the cpu and the os run AVX2, for the other code picking its kernels
+// the same way
+bool cpuHasAvx2();
+
+//////////////////////////////////////////////////////////////////////////
+// The same loop in fixed point, for SL_FIXED_POINT. As above the kernels
+// give the same pixels, and the SSE2 one does 4 pixels at once.
+//
+// z is in the units of the depth format times 2^zShift, see
+// CDepthBuffer::fixedShift(). The color is in [0, 255] times 2^16, so
+// a channel is its top 16 bits.
+//////////////////////////////////////////////////////////////////////////
+#define SF_FIXED_ONE (255<<16)	// color 1.0
+
+struct FixedSpanInfo
+{
+	int count;				// number of pixels
+	int z, dz;				// depth at the first pixel and its step
+	int zShift;				// fraction bits of z
+	int color[4];			// r, g, b, a at the first pixel
+	int dcolor[4];			// and their step
+	bool blend;				// mix with the pixels by the alpha
+	DepthFormat depthFormat;
+	double depthScale;		// see CDepthBuffer::scale()
+	void *depth;			// depth buffer at the first pixel
+	unsigned int *pixels;	// 32-bit 0xAARRGGBB pixels at the first pixel
+};
+
+typedef void (*FixedSpanFillFunc)(const FixedSpanInfo& _span);
+
+// the best kernel for this cpu
+FixedSpanFillFunc fixedSpanFillFunc();
+
+// the portable kernel
+void fillFixedSpanScalar(const FixedSpanInfo& _span);
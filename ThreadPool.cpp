@@ -0,0 +1,102 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+CThreadPool::CThreadPool()
+: mJob(0), mCount(0), mNext(0), mBusy(0)
+, mGeneration(0), mQuit(false)
+{
+}
+
+CThreadPool::~CThreadPool()
+{
+	_stop();
+}
+
+void CThreadPool::setThreadCount(int _n)
+{
+	if (_n <= 0)
+		_n = std::max(1, int(std::thread::hardware_concurrency()));
+	if (_n == threadCount())
+		return;
+
+	_stop();
+	mQuit = false;
+	for (int i=1; i<_n; ++i)
+	{
+		mThreads.push_back(std::thread(&CThreadPool::_worker, this, mGeneration));
+	}
+}
+
+void CThreadPool::_stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mWake.notify_all();
+	for (size_t i=0; i<mThreads.size(); ++i)
+	{
+		mThreads[i].join();
+	}
+	mThreads.clear();
+}
+
+void CThreadPool::parallelFor(int _count, const Job& _job)
+{
+	if (_count <= 0)
+		return;
+
+	if (mThreads.empty() || _count == 1)
+	{
+		for (int i=0; i<_count; ++i)
+			_job(i);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJob = &_job;
+		mCount = _count;
+		mNext = 0;
+		mBusy = int(mThreads.size());
+		++mGeneration;
+	}
+	mWake.notify_all();
+
+	_runJobs();
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (mBusy > 0)
+		mDone.wait(lock);
+	mJob = 0;
+}
+
+void CThreadPool::_runJobs()
+{
+	for (int i = mNext++; i < mCount; i = mNext++)
+	{
+		(*mJob)(i);
+	}
+}
+
+void CThreadPool::_worker(unsigned int _generation)
+{
+	unsigned int t_seen = _generation;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			while (!mQuit && mGeneration == t_seen)
+				mWake.wait(lock);
+			if (mQuit)
+				return;
+			t_seen = mGeneration;
+		}
+
+		_runJobs();
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (--mBusy == 0)
+			mDone.notify_one();
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+//////////////////////////////////////////////////////////////////////////
+// CThreadPool: a fixed set of worker threads running parallel loops.
+//
+// parallelFor() hands out the indices one at a time from a shared counter,
+// so uneven jobs balance themselves. The calling thread works as well, so
+// a pool of n threads starts n-1 workers, and a pool of 1 runs the loop
+// inline.
+//////////////////////////////////////////////////////////////////////////
+class CThreadPool
+{
+public:
+	typedef std::function<void (int)> Job;
+
+	CThreadPool();
+	~CThreadPool();
+
+	// 0 means one thread per hardware thread
+	void setThreadCount(int _n);
+	int threadCount() const { return int(mThreads.size()) + 1; }
+
+	// call _job(i) for i in [0, _count), return when all calls are done
+	void parallelFor(int _count, const Job& _job);
+
+private:
+	CThreadPool(const CThreadPool&);
+	CThreadPool& operator=(const CThreadPool&);
+
+	void _stop();
+	void _worker(unsigned int _generation);
+	void _runJobs();
+
+private:
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mWake;	// a loop is started, or the pool stops
+	std::condition_variable mDone;	// the last worker finished its share
+
+	const Job *mJob;
+	int mCount;
+	std::atomic<int> mNext;		// next index to run
+	int mBusy;					// workers still in the current loop
+	unsigned int mGeneration;	// number of loops started
+	bool mQuit;
+};
@@ -1,6 +1,7 @@
 #include "mainwindow.h"
 #include "AccessObj.h"
 #include "ScanLine.h"
+#include "QImageTarget.h"
 #include <QtGui>
 #include <ctime>
 
@@ -8,11 +9,13 @@ const QString WIDGET_NAME = "ImageView";
 const QString WINDOW_TITLE = "CG ZBuffer";
 const Vec3d EYE_POS(3, 4, 5);
 const Vec4d LIGHT_POS(2, 3, 4, 1);
+const double LOD_PIXEL_ERROR = 1.0;	// pixels a level of detail may be off by
 
 MainWindow::MainWindow()
 : mImage(800, 600, QImage::Format_ARGB32)
 , mpAccessObj(0)
 , mpRenderSystem(0)
+, mpRenderTarget(0)
 {
 	init();
 }
@@ -21,6 +24,7 @@ MainWindow::MainWindow(const QString &fileName)
 : mImage(800, 600, QImage::Format_ARGB32)
 , mpAccessObj(0)
 , mpRenderSystem(0)
+, mpRenderTarget(0)
 {
 	init();
 	if (QFile::exists(fileName))
@@ -38,6 +42,7 @@ MainWindow::~MainWindow()
 {
 	SAFE_DELETE(mpAccessObj);
 	SAFE_DELETE(mpRenderSystem);
+	SAFE_DELETE(mpRenderTarget);
 }
 
 void MainWindow::init()
@@ -61,7 +66,8 @@ void MainWindow::initRenderSystem()
 {
 	mpAccessObj = new CAccessObj;
 	mImage.fill(qRgb(200, 200, 200));
-	mpRenderSystem = new CScanLine(mImage.width(), mImage.height(), &mImage);
+	mpRenderTarget = new CQImageTarget(&mImage);
+	mpRenderSystem = new CScanLine(mpRenderTarget);
 
 	// set camera
 	Vec3d at(0, 0, 0);
@@ -71,11 +77,11 @@ void MainWindow::initRenderSystem()
 	//mpRenderSystem.ortho(-2, 2, -2, 2, 1, 100);
 
 	// set light
-	mpRenderSystem->mLight.type = SL_LIGHT_POINT;
+	mpRenderSystem->light(0).type = SL_LIGHT_POINT;
 	//lit.type = SL_LIGHT_DIRECTIONAL;
-	mpRenderSystem->mLight.direction = Vec3d(-1.0, -1.0, -0.5);
+	mpRenderSystem->light(0).direction = Vec3d(-1.0, -1.0, -0.5);
 	//lit.position = Vec4d(3, 4, 5, 1);
-	mpRenderSystem->mLight.position = LIGHT_POS;
+	mpRenderSystem->light(0).position = LIGHT_POS;
 
 	mpRenderSystem->mMaterial.specular = Color4d(1.0, 1.0, 1.0, 1.0);
 	mpRenderSystem->mMaterial.shiness = 60;
@@ -145,12 +151,12 @@ void MainWindow::createActions()
 	mPointLightAct = new QAction(tr("&Point Light"), this);
 	mPointLightAct->setStatusTip(tr("Choose point light"));
 	mPointLightAct->setCheckable(true);
-	mPointLightAct->setChecked(mpRenderSystem->mLight.type == SL_LIGHT_POINT);
+	mPointLightAct->setChecked(mpRenderSystem->light(0).type == SL_LIGHT_POINT);
 
 	mDirLightAct = new QAction(tr("&Dir Light"), this);
 	mDirLightAct->setStatusTip(tr("Choose directional light"));
 	mDirLightAct->setCheckable(true);
-	mDirLightAct->setChecked(mpRenderSystem->mLight.type == SL_LIGHT_DIRECTIONAL);
+	mDirLightAct->setChecked(mpRenderSystem->light(0).type == SL_LIGHT_DIRECTIONAL);
 
 	mShadeActGroup = new QActionGroup(this);
 	mShadeActGroup->setExclusive(false);
@@ -223,14 +229,14 @@ void MainWindow::shadeModel(QAction* act)
 	{
 		act->setChecked(true);
 		mDirLightAct->setChecked(false);
-		mpRenderSystem->mLight.type = SL_LIGHT_POINT;
+		mpRenderSystem->light(0).type = SL_LIGHT_POINT;
 		statusBar()->showMessage(tr("Point lighting"), 3000);
 	}
 	else if (act == mDirLightAct)
 	{
 		act->setChecked(true);
 		mPointLightAct->setChecked(false);
-		mpRenderSystem->mLight.type = SL_LIGHT_DIRECTIONAL;
+		mpRenderSystem->light(0).type = SL_LIGHT_DIRECTIONAL;
 		statusBar()->showMessage(tr("Directional lighting"), 3000);
 	}
 	else
@@ -404,6 +410,7 @@ void MainWindow::openObjFile(const QString& fileName)
 	if (mpAccessObj->LoadOBJ(fileName.toStdString().c_str()))
 	{
 		mpAccessObj->UnifiedModel();
+		mLastVisible.clear();
 
 		renderObj();
 
@@ -421,35 +428,105 @@ void MainWindow::openObjFile(const QString& fileName)
 void MainWindow::renderObj()
 {
 	clock_t tt = clock();
+	unsigned int nTriangles = 12;
 
 	mpRenderSystem->clear(SL_COLOR_BUFFER | SL_DEPTH_BUFFER, Color4u(200, 200, 200, 255), 1.0);
 	if (mpAccessObj->m_pModel)
 	{
 		// clear frame buffer
 
-		mpRenderSystem->begin(SL_TRIANGLES);
-		CPoint3D *vpVertices = mpAccessObj->m_pModel->vpVertices;
-		CPoint3D *vpNormals = mpAccessObj->m_pModel->vpNormals;
-		if (!mRandomColorAct->isChecked())
+		COBJmodel *pModel = mpAccessObj->m_pModel;
+		CPoint3D *vpVertices = pModel->vpVertices;
+		CPoint3D *vpNormals = pModel->vpNormals;
+
+		mpRenderSystem->vertexPointer(sizeof(CPoint3D), &vpVertices[0].x);
+		mpRenderSystem->normalPointer(sizeof(CPoint3D), vpNormals ? &vpNormals[0].x : 0);
+		if (mRandomColorAct->isChecked())
+		{
+			// one flat color per triangle drawn
+			mRandomColors.resize(3 * pModel->nTriangles);
+			for (size_t i=0; i<mRandomColors.size(); ++i)
+				mRandomColors[i] = rand() % 256;
+			mpRenderSystem->colorPointer(3, 0, 
+				mRandomColors.empty() ? 0 : &mRandomColors[0], true);
+		}
+		else
+		{
+			mpRenderSystem->colorPointer(3, 0, 0);
 			mpRenderSystem->color3i(255, 255, 255);
-		for (unsigned int i=0; i<mpAccessObj->m_pModel->nTriangles; ++i)
+		}
+
+		// the coarsest level of detail which is off by less than a pixel
+		// where the model is nearest
+		const std::vector<COBJlod> &lods = mpAccessObj->Lods();
+		CPoint3D vMax, vMin;
+		mpAccessObj->Boundingbox(vMax, vMin);
+		CPoint3D vCenter = (vMax + vMin) * 0.5f;
+		double pixel = mpRenderSystem->pixelSize(Vec3d(vCenter.x, vCenter.y, vCenter.z), 
+			(vMax - vMin).length() * 0.5);
+		int lod = -1;
+		for (int i=int(lods.size())-1; i>=0 && lod<0; --i)
+		{
+			if (lods[i].m_fError < LOD_PIXEL_ERROR * pixel)
+				lod = i;
+		}
+		nTriangles = pModel->nTriangles;
+
+		// skip the triangles out of sight, by the leaves of the hierarchy
+		// if it is built, or else by groups. A level of detail is drawn
+		// whole.
+		const CBvh &bvh = mpAccessObj->Bvh();
+		if (lod >= 0)
+		{
+			const std::vector<COBJtriangle> &triangles = lods[lod].m_Triangles;
+			mpRenderSystem->drawElements(SL_TRIANGLES, 3*int(triangles.size()), 
+				triangles[0].vindices, vpNormals ? triangles[0].nindices : 0, 
+				sizeof(COBJtriangle));
+			mLastVisible.clear();
+			nTriangles = (unsigned int)triangles.size();
+		}
+		else if (!bvh.empty())
+		{
+			CBvh::RangeArray ranges;
+			bvh.cull(mpRenderSystem->frustumPlanes(), ranges);
+			if (!mpRenderSystem->renderState().isBlending())
+			{
+				// occlusion culling: the leaves seen in the last frame are
+				// drawn first, then the others not hidden behind them
+				CBvh::RangeArray occluders, visible;
+				CBvh::intersect(mLastVisible, ranges, occluders);
+				drawRanges(occluders);
+				mpRenderSystem->buildDepthPyramid();
+				CBvh::OcclusionTest occluded = [this](const CBvh::Box& box) {
+					return mpRenderSystem->boxOccluded(Vec3d(box.min[0], box.min[1], box.min[2]), 
+						Vec3d(box.max[0], box.max[1], box.max[2]));
+				};
+				bvh.cull(mpRenderSystem->frustumPlanes(), visible, &occluded);
+				CBvh::subtract(visible, occluders, ranges);
+				mLastVisible.swap(visible);
+			}
+			drawRanges(ranges);
+		}
+		else
 		{
-			COBJtriangle &pTri = mpAccessObj->m_pModel->pTriangles[i];
-			if (mRandomColorAct->isChecked())
+			TriangleLists lists;
+			unsigned int nVisible = 0;
+			for (COBJgroup *group = pModel->pGroups; group; group = group->next)
 			{
-				byte iR = rand() % 256;
-				byte iG = rand() % 256;
-				byte iB = rand() % 256;
-				mpRenderSystem->color3i(iR, iG, iB);
+				if (group->nTriangles == 0)
+					continue;
+				const CPoint3D &c = group->m_vCenter;
+				if (!mpRenderSystem->sphereInFrustum(Vec3d(c.x, c.y, c.z), group->m_fRadius))
+					continue;
+				const CPoint3D &vMin = group->m_vMin, &vMax = group->m_vMax;
+				if (!mpRenderSystem->boxInFrustum(Vec3d(vMin.x, vMin.y, vMin.z), 
+					Vec3d(vMax.x, vMax.y, vMax.z)))
+					continue;
+				lists.push_back(std::make_pair(group->nTriangles, (const unsigned int*)group->pTriangles));
+				nVisible += group->nTriangles;
 			}
-			if (vpNormals) mpRenderSystem->normal3fv(vpNormals[pTri.nindices[0]]);
-			mpRenderSystem->vertex3fv(vpVertices[pTri.vindices[0]]);
-			if (vpNormals) mpRenderSystem->normal3fv(vpNormals[pTri.nindices[1]]);
-			mpRenderSystem->vertex3fv(vpVertices[pTri.vindices[1]]);
-			if (vpNormals) mpRenderSystem->normal3fv(vpNormals[pTri.nindices[2]]);
-			mpRenderSystem->vertex3fv(vpVertices[pTri.vindices[2]]);
+			drawTriangles(lists, nVisible);
 		}
-		mpRenderSystem->end();
 	}
 	else
 	{
@@ -458,11 +535,64 @@ void MainWindow::renderObj()
 
 	statusBar()->showMessage(tr("Rendering finished in %1 ms. Triangles: %2")
 		.arg(clock()-tt)
-		.arg(mpAccessObj->m_pModel ? mpAccessObj->m_pModel->nTriangles : 12), 5000);
+		.arg(nTriangles), 5000);
 
 	mImgView->update();
 }
 
+void MainWindow::drawTriangles(const TriangleLists& lists, unsigned int nTriangles)
+{
+	COBJmodel *pModel = mpAccessObj->m_pModel;
+	CPoint3D *vpNormals = pModel->vpNormals;
+	COBJtriangle *pTriangles = pModel->pTriangles;
+
+	if (nTriangles == pModel->nTriangles && nTriangles > 0)
+	{
+		// all of them, drawn in place
+		mpRenderSystem->drawElements(SL_TRIANGLES, 3*pModel->nTriangles, 
+			pTriangles[0].vindices, vpNormals ? pTriangles[0].nindices : 0, 
+			sizeof(COBJtriangle));
+	}
+	else if (nTriangles > 0)
+	{
+		// packed as 3 vindices then 3 nindices per triangle
+		mVisibleIndices.resize(6 * nTriangles);
+		unsigned int *pIndices = &mVisibleIndices[0];
+		for (size_t i=0; i<lists.size(); ++i)
+		{
+			for (unsigned int j=0; j<lists[i].first; ++j)
+			{
+				const COBJtriangle &tri = pTriangles[lists[i].second[j]];
+				for (int k=0; k<3; ++k)
+				{
+					pIndices[k] = tri.vindices[k];
+					pIndices[3+k] = tri.nindices[k];
+				}
+				pIndices += 6;
+			}
+		}
+		mpRenderSystem->drawElements(SL_TRIANGLES, 3*nTriangles, 
+			&mVisibleIndices[0], vpNormals ? &mVisibleIndices[3] : 0, 
+			6*sizeof(unsigned int));
+	}
+}
+
+void MainWindow::drawRanges(const CBvh::RangeArray& ranges)
+{
+	// the leaves in the order of the model, the clusters facing out first
+	const CBvh &bvh = mpAccessObj->Bvh();
+	CBvh::RangeArray leaves(ranges);
+	bvh.sortByModel(leaves);
+	TriangleLists lists;
+	unsigned int nTriangles = 0;
+	for (size_t i=0; i<leaves.size(); ++i)
+	{
+		lists.push_back(std::make_pair(leaves[i].count, &bvh.triangles()[leaves[i].first]));
+		nTriangles += leaves[i].count;
+	}
+	drawTriangles(lists, nTriangles);
+}
+
 void MainWindow::saveAsImageFile(const QString& fileName)
 {
 	mImage.save(fileName);
@@ -471,7 +601,7 @@ void MainWindow::saveAsImageFile(const QString& fileName)
 void MainWindow::setResolution(int width, int height)
 {
 	mImage = mImage.scaled(width, height);
-	mpRenderSystem->setRenderTarget(mImage.width(), mImage.height(), &mImage);
+	mpRenderSystem->setRenderTarget(mpRenderTarget);
 	mpRenderSystem->perspective(3.14/6, mImage.width()*1.0/mImage.height(), 1, 100);
 	mpRenderSystem->clear(SL_DEPTH_BUFFER | SL_COLOR_BUFFER, Color4u(200, 200, 200, 255));
 
@@ -487,7 +617,7 @@ void MainWindow::newFrustumOrLight()
 	mpRenderSystem->lookAt(eye, at, up);
 	mpRenderSystem->perspective(3.14/6, mImage.width()*1.0/mImage.height(), 1, 100);
 
-	mpRenderSystem->mLight.position = 
+	mpRenderSystem->light(0).position = 
 		Vec4d(mSpinLightX->value(), mSpinLightY->value(), mSpinLightZ->value(), 1);
 
 	renderObj();
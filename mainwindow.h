@@ -2,12 +2,15 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <vector>
+#include "Bvh.h"
 
 class QMenu;
 class QAction;
 class QActionGroup;
 class CAccessObj;
 class CScanLine;
+class CQImageTarget;
 class QDoubleSpinBox;
 
 class MainWindow : public QMainWindow
@@ -34,6 +37,10 @@ private:
 	void drawCubeTest();
 	void openObjFile(const QString& fileName);
 	void renderObj();
+	// each list is a count and the indices of its triangles
+	typedef std::vector< std::pair<unsigned int, const unsigned int*> > TriangleLists;
+	void drawTriangles(const TriangleLists& lists, unsigned int nTriangles);
+	void drawRanges(const CBvh::RangeArray& ranges);
 	void saveAsImageFile(const QString& fileName);
 	void setResolution(int width, int height);
 	QString strippedName(const QString& fullFileName);
@@ -84,6 +91,10 @@ private:
 
 	CAccessObj *mpAccessObj;
 	CScanLine *mpRenderSystem;
+	CQImageTarget *mpRenderTarget;	// mImage for mpRenderSystem
+	std::vector<unsigned char> mRandomColors;	// per triangle, in random color mode
+	std::vector<unsigned int> mVisibleIndices;	// vindices and nindices of the triangles in sight
+	CBvh::RangeArray mLastVisible;	// leaves not occluded in the last frame
 
 	// mouse operations
 	QPoint lastPos;
@@ -0,0 +1,32 @@
+# ----------------------------------------------------
+# The rasterizer, without Qt. Shared by zbuffer_core.pro
+# and zbuffer_qt.pro.
+# ------------------------------------------------------
+
+HEADERS += ./BasicStructure.h \
+    ./Camera.h \
+    ./DepthBuffer.h \
+    ./DepthPyramid.h \
+    ./FastMath.h \
+    ./FramePool.h \
+    ./HiZBuffer.h \
+    ./Mat.h \
+    ./MathDefs.h \
+    ./Point3D.h \
+    ./RenderState.h \
+    ./RenderTarget.h \
+    ./ScanLine.h \
+    ./SpanFill.h \
+    ./ThreadPool.h \
+    ./Vec.h
+SOURCES += ./Camera.cpp \
+    ./DepthBuffer.cpp \
+    ./DepthPyramid.cpp \
+    ./FastMath.cpp \
+    ./HiZBuffer.cpp \
+    ./Point3D.cpp \
+    ./RenderState.cpp \
+    ./RenderTarget.cpp \
+    ./ScanLine.cpp \
+    ./SpanFill.cpp \
+    ./ThreadPool.cpp
\ No newline at end of file
@@ -0,0 +1,15 @@
+# ----------------------------------------------------
+# The rasterizer as a static library without Qt, for
+# programs that render to a CMemoryTarget or a
+# CMappedTarget.
+# ------------------------------------------------------
+
+TEMPLATE = lib
+TARGET = zbuffer_core
+CONFIG += staticlib thread c++11
+CONFIG -= qt
+QT -= core gui
+INCLUDEPATH += .
+DEPENDPATH += .
+*-g++*: QMAKE_CXXFLAGS += -std=c++0x
+include(zbuffer_core.pri)
\ No newline at end of file
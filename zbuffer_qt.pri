@@ -3,22 +3,19 @@
 # ------------------------------------------------------
 
 HEADERS += ./AccessObj.h \
-    ./BasicStructure.h \
-    ./Camera.h \
+    ./Bvh.h \
     ./mainwindow.h \
-    ./Mat.h \
-    ./MathDefs.h \
-    ./Point3D.h \
-    ./RenderState.h \
-    ./ScanLine.h \
-    ./Vec.h \
+    ./MeshOptimizer.h \
+    ./QImageTarget.h \
+    ./Simplifier.h \
     ./VectOps.h
 SOURCES += ./AccessObj.cpp \
-    ./Camera.cpp \
+    ./Bvh.cpp \
     ./main.cpp \
     ./mainwindow.cpp \
-    ./Point3D.cpp \
-    ./RenderState.cpp \
-    ./ScanLine.cpp \
+    ./MeshOptimizer.cpp \
+    ./QImageTarget.cpp \
+    ./Simplifier.cpp \
     ./VectOps.cpp
 RESOURCES += sdi.qrc
+include(zbuffer_core.pri)
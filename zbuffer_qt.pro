@@ -9,4 +9,7 @@ INCLUDEPATH += . \
     $(QTDIR)/mkspecs/win32-msvc2008
 DEPENDPATH += .
 UI_DIR += ./GeneratedFiles
+# std::thread in CThreadPool
+CONFIG += thread c++11
+*-g++*: QMAKE_CXXFLAGS += -std=c++0x
 include(zbuffer_qt.pri)
\ No newline at end of file